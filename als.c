@@ -1,18 +1,33 @@
+/*
+ * APDS9960 ALS, RGB, proximity and gesture sensor driver, written against
+ * the Linux v6.12 IIO, regmap and I2C APIs.
+ */
 #include <linux/acpi.h>
+#include <linux/bitfield.h>
 #include <linux/module.h>
 #include <linux/init.h>
 #include <linux/interrupt.h>
 #include <linux/delay.h>
+#include <linux/math64.h>
 #include <linux/mutex.h>
+#include <linux/nvmem-consumer.h>
+#include <linux/property.h>
 #include <linux/err.h>
 #include <linux/irq.h>
 #include <linux/i2c.h>
 #include <linux/pm_runtime.h>
 #include <linux/regmap.h>
+#include <linux/slab.h>
+#include <linux/units.h>
+#include <linux/unaligned.h>
+#include <linux/workqueue.h>
 #include <linux/iio/iio.h>
 #include <linux/iio/buffer.h>
 #include <linux/iio/events.h>
 #include <linux/iio/kfifo_buf.h>
+#include <linux/iio/trigger.h>
+#include <linux/iio/trigger_consumer.h>
+#include <linux/iio/triggered_buffer.h>
 #include <linux/iio/sysfs.h>
 
 #define APDS9960_REGMAP_NAME	"apds9960_regmap"
@@ -26,13 +41,128 @@ enum apds9960_als_channel_idx {
 	IDX_ALS_CLEAR, IDX_ALS_RED, IDX_ALS_GREEN, IDX_ALS_BLUE,
 };
 
+#define APDS9960_REG_ENABLE	0x80
+#define APDS9960_REG_ENABLE_PON		BIT(0)
+#define APDS9960_REG_ENABLE_AEN		BIT(1)
+#define APDS9960_REG_ENABLE_PEN		BIT(2)
+#define APDS9960_REG_ENABLE_WEN		BIT(3)
+#define APDS9960_REG_ENABLE_AIEN	BIT(4)
+#define APDS9960_REG_ENABLE_PIEN	BIT(5)
+#define APDS9960_REG_ENABLE_GEN		BIT(6)
+
 #define APDS9960_REG_ATIME	0x81
+#define APDS9960_REG_WTIME	0x83
+
+/* ALS low/high thresholds as little-endian pairs, proximity as bytes */
+#define APDS9960_REG_AILTL	0x84
+#define APDS9960_REG_AIHTL	0x86
+#define APDS9960_REG_AIHTH	0x87
+#define APDS9960_REG_PILT	0x89
+#define APDS9960_REG_PIHT	0x8b
+
+#define APDS9960_REG_PERS	0x8c
+#define APDS9960_REG_PERS_ALS_MASK	GENMASK(3, 0)
+#define APDS9960_REG_PERS_PROX_MASK	GENMASK(7, 4)
+
+#define APDS9960_REG_CONFIG_1	0x8d
+#define APDS9960_REG_CONFIG_1_WLONG	BIT(1)
+
+#define APDS9960_REG_PPULSE	0x8e
+#define APDS9960_REG_PPULSE_PPLEN_MASK	GENMASK(7, 6)
+#define APDS9960_REG_PPULSE_PULSES_MASK	GENMASK(5, 0)
+
+#define APDS9960_REG_CONTROL	0x8f
+#define APDS9960_REG_CONTROL_AGAIN_MASK	GENMASK(1, 0)
+#define APDS9960_REG_CONTROL_PGAIN_MASK	GENMASK(3, 2)
+#define APDS9960_REG_CONTROL_LDRIVE_MASK	GENMASK(7, 6)
+
+#define APDS9960_REG_CONFIG_2	0x90
+#define APDS9960_REG_CONFIG_2_LED_BOOST_MASK	GENMASK(5, 4)
+#define APDS9960_REG_CONFIG_2_CPSIEN	BIT(6)
+#define APDS9960_REG_CONFIG_2_PSIEN	BIT(7)
+
+#define APDS9960_REG_ID		0x92
+
+#define APDS9960_REG_STATUS	0x93
+#define APDS9960_REG_STATUS_PVALID	BIT(1)
+#define APDS9960_REG_STATUS_GINT	BIT(2)
+#define APDS9960_REG_STATUS_AINT	BIT(4)
+#define APDS9960_REG_STATUS_PINT	BIT(5)
+#define APDS9960_REG_STATUS_PGSAT	BIT(6)
+#define APDS9960_REG_STATUS_CPSAT	BIT(7)
+/* Everything AICLEAR acknowledges */
+#define APDS9960_REG_STATUS_NON_GESTURE	(APDS9960_REG_STATUS_AINT | \
+					 APDS9960_REG_STATUS_PINT | \
+					 APDS9960_REG_STATUS_PGSAT | \
+					 APDS9960_REG_STATUS_CPSAT)
+
+#define APDS9960_REG_PDATA	0x9c
+
+/* Sign-magnitude crosstalk offsets, a positive value lowers PDATA */
+#define APDS9960_REG_POFFSET_UR	0x9d
+#define APDS9960_REG_POFFSET_DL	0x9e
+#define APDS9960_POFFSET_MAX	0x7f
+
+#define APDS9960_REG_CONFIG_3	0x9f
+#define APDS9960_REG_CONFIG_3_SAI	BIT(4)
+
+#define APDS9960_REG_GCONF_1	0xa2
+#define APDS9960_REG_GCONF_1_GFIFO_THRES_MASK	GENMASK(7, 6)
+
+#define APDS9960_REG_GCONF_2	0xa3
+#define APDS9960_REG_GCONF_2_GWTIME_MASK	GENMASK(2, 0)
+
+#define APDS9960_REG_GPULSE	0xa6
+#define APDS9960_REG_GPULSE_GPLEN_MASK	GENMASK(7, 6)
+#define APDS9960_REG_GPULSE_PULSES_MASK	GENMASK(5, 0)
+
+#define APDS9960_REG_GCONF_4	0xab
+#define APDS9960_REG_GCONF_4_GIEN	BIT(1)
+#define APDS9960_REG_GCONF_4_GFIFO_CLR	BIT(2)
+
+#define APDS9960_REG_GFLVL	0xae
+#define APDS9960_REG_GSTATUS	0xaf
+
+#define APDS9960_REG_AICLEAR	0xe7
+
+#define APDS9960_REG_GFIFO_BASE	0xfc
+#define APDS9960_REG_GFIFO_UP	0xfc
+#define APDS9960_REG_GFIFO_DOWN	0xfd
+#define APDS9960_REG_GFIFO_LEFT	0xfe
+#define APDS9960_REG_GFIFO_RIGHT	0xff
+
+/* CDATAL up to PDATA, the widest block read for one scan */
+#define APDS9960_SCAN_REGS	(APDS9960_REG_PDATA - APDS9960_REG_ALS_BASE + 1)
+#define APDS9960_IDX_PROX	4
+
+/*
+ * Channels computed from CRGB in the IRQ thread: the IR estimate and the
+ * IR-compensated clear, red, green and blue, in that scan order.
+ */
+#define APDS9960_IDX_IR		5
+#define APDS9960_IDX_IR_COMP	6
+#define APDS9960_IDX_DERIVED_MASK	GENMASK(APDS9960_IDX_IR_COMP + 3, \
+						APDS9960_IDX_IR)
+#define APDS9960_IDX_CRGB_MASK	GENMASK(IDX_ALS_BLUE, IDX_ALS_CLEAR)
+#define APDS9960_NUM_SCAN_CHANNELS	(APDS9960_IDX_IR_COMP + 4)
+
+/* CRGB, PDATA and one pad byte, then five u16 derived channels */
+#define APDS9960_SCAN_BYTES	(APDS9960_SCAN_REGS + 1 + 5 * 2)
 
 #define APDS9960_MAX_ALS_THRES_VAL	0xffff
 #define APDS9960_MAX_INT_TIME_IN_US	1000000
 
 static const struct regmap_range apds9960_readable_ranges[] = {
-	regmap_reg_range(APDS9960_REG_ATIME, APDS9960_REG_ALS_BASE + 6),
+	regmap_reg_range(APDS9960_REG_ENABLE, APDS9960_REG_ATIME),
+	regmap_reg_range(APDS9960_REG_WTIME, APDS9960_REG_AIHTH),
+	regmap_reg_range(APDS9960_REG_PILT, APDS9960_REG_PILT),
+	regmap_reg_range(APDS9960_REG_PIHT, APDS9960_REG_CONFIG_2),
+	regmap_reg_range(APDS9960_REG_ID, APDS9960_REG_CONFIG_3),
+	regmap_reg_range(APDS9960_REG_GCONF_1, APDS9960_REG_GCONF_2),
+	regmap_reg_range(APDS9960_REG_GPULSE, APDS9960_REG_GPULSE),
+	regmap_reg_range(APDS9960_REG_GCONF_4, APDS9960_REG_GCONF_4),
+	regmap_reg_range(APDS9960_REG_GFLVL, APDS9960_REG_GSTATUS),
+	regmap_reg_range(APDS9960_REG_GFIFO_BASE, APDS9960_REG_GFIFO_BASE + 3),
 };
 
 static const struct regmap_access_table apds9960_readable_table = {
@@ -40,14 +170,186 @@ static const struct regmap_access_table apds9960_readable_table = {
 	.n_yes_ranges	= ARRAY_SIZE(apds9960_readable_ranges),
 };
 
+static const struct regmap_range apds9960_writeable_ranges[] = {
+	regmap_reg_range(APDS9960_REG_ENABLE, APDS9960_REG_ATIME),
+	regmap_reg_range(APDS9960_REG_WTIME, APDS9960_REG_AIHTH),
+	regmap_reg_range(APDS9960_REG_PILT, APDS9960_REG_PILT),
+	regmap_reg_range(APDS9960_REG_PIHT, APDS9960_REG_CONFIG_2),
+	regmap_reg_range(APDS9960_REG_POFFSET_UR, APDS9960_REG_CONFIG_3),
+	regmap_reg_range(APDS9960_REG_GCONF_1, APDS9960_REG_GCONF_2),
+	regmap_reg_range(APDS9960_REG_GPULSE, APDS9960_REG_GPULSE),
+	regmap_reg_range(APDS9960_REG_GCONF_4, APDS9960_REG_GCONF_4),
+	regmap_reg_range(APDS9960_REG_AICLEAR, APDS9960_REG_AICLEAR),
+};
+
+static const struct regmap_access_table apds9960_writeable_table = {
+	.yes_ranges	= apds9960_writeable_ranges,
+	.n_yes_ranges	= ARRAY_SIZE(apds9960_writeable_ranges),
+};
+
+static bool kfifo_mode;
+module_param(kfifo_mode, bool, 0444);
+MODULE_PARM_DESC(kfifo_mode,
+		 "Fill a kfifo buffer from the data-ready IRQ instead of a trigger");
+
+static bool agc;
+module_param(agc, bool, 0644);
+MODULE_PARM_DESC(agc, "Step gain and integration time down on saturation");
+
+static bool prox_calibrate;
+module_param(prox_calibrate, bool, 0444);
+MODULE_PARM_DESC(prox_calibrate,
+		 "Cancel proximity crosstalk with POFFSET calibration at probe");
+
+#define APDS9960_LPF_SHIFT_MAX	6
+#define APDS9960_ROC_HIST	32
+
+struct apds9960_batch_entry {
+	u8 scan[32] __aligned(8);
+	s64 timestamp;
+};
+
+/*
+ * Samples held back from one kfifo, the way a hardware FIFO would hold
+ * them, until the buffer's own watermark worth is pending or the oldest
+ * is max_report_latency_ms old. Both release the lot in one go. The IIO
+ * core hands the watermark over on enable and pulls pending samples
+ * through hwfifo_flush_to_buffer() for a reader that asks for more than
+ * the buffer holds. Samples released by the deadline are readable at
+ * once; poll() itself still wakes on buffer/watermark, as for any IIO
+ * buffer.
+ */
+struct apds9960_batch {
+	struct iio_dev *indio_dev;
+	struct mutex lock;
+	struct delayed_work work;
+	unsigned int watermark;
+	unsigned int latency_ms;
+	unsigned int count;
+	struct apds9960_batch_entry *pending;
+};
+
 struct apds9960_data {
 	struct i2c_client *client;
 	struct iio_dev *indio_dev;
 	struct mutex lock;
 	struct regmap *regmap;
-	int als_int;
 	int als_gain;
 	int als_adc_int_us;
+
+	/*
+	 * Time between two samples of the running engines. Recomputed under
+	 * the lock whenever ATIME, WTIME, PPULSE, a gain or ENABLE is
+	 * written, so the per-sample paths don't walk the regmap for it.
+	 */
+	unsigned int period_us;
+
+	/*
+	 * Per-channel deadband in counts. With any of them set, a scan is
+	 * only pushed once some enabled channel moves further than its
+	 * deadband away from the last pushed scan.
+	 */
+	unsigned int hysteresis[APDS9960_IDX_PROX + 1];
+	unsigned int last_pushed[APDS9960_IDX_PROX + 1];
+	bool have_pushed;
+
+	/*
+	 * Per-unit CRGB calibration, X' = X * calibscale + calibbias. The
+	 * scale is kept in micro units for sysfs and as the Q16 multiplier
+	 * applied to every sample; an all-unity set skips the pass.
+	 */
+	unsigned int cal_scale_micro[4];
+	u32 cal_mult[4];
+	int cal_bias[4];
+	bool cal_identity;
+
+	/*
+	 * First-order IIR low-pass, y += (x - y) / 2^lpf_shift, on the CRGB
+	 * channels before anything is pushed. State is Q8 so small steps are
+	 * not lost to truncation; a shift of 0 is no filtering. The cut-offs
+	 * follow the sample rate and are listed again whenever it changes.
+	 */
+	unsigned int lpf_shift;
+	u32 lpf_state[IDX_ALS_BLUE + 1];
+	bool lpf_primed;
+	int lpf_avail[2 * (APDS9960_LPF_SHIFT_MAX + 1)];
+
+	/*
+	 * Rate-of-change events: a step in the raw clear count, before
+	 * calibration and the low-pass, larger than roc_delta counts across
+	 * roc_period_us. History holds one entry per ALS cycle; raw_clear is
+	 * the count of the last scan read for the buffer.
+	 */
+	bool roc_rising;
+	bool roc_falling;
+	unsigned int roc_delta;
+	unsigned int roc_period_us;
+	u16 raw_clear;
+	u16 roc_hist[APDS9960_ROC_HIST];
+	unsigned int roc_head;
+	unsigned int roc_count;
+
+	/*
+	 * Threshold window interrupts and AGC step reports, for clear [0]
+	 * and proximity [1].
+	 */
+	bool thresh_en[2];
+	bool agc_notify[2];
+
+	/*
+	 * ROC and the kfifo buffer need an ALS interrupt every cycle, which
+	 * takes an ALS persistence of 0. While either holds it, als_pers is
+	 * the value programmed before, put back once both let go.
+	 */
+	bool als_pers_held;
+	unsigned int als_pers;
+
+	/*
+	 * Stall watchdog, re-armed by every data-ready interrupt while the
+	 * buffer or ROC events run. Expiry means the chip went quiet,
+	 * typically after a brown-out reset, and its configuration is
+	 * replayed.
+	 */
+	struct delayed_work watchdog;
+	unsigned int watchdog_recoveries;
+	bool recovery_notify;
+
+	/* Transient I2C failures absorbed or lost in the acquisition path */
+	unsigned int i2c_retries;
+	unsigned int i2c_recoveries;
+	unsigned int i2c_failed_reads;
+
+	/* Gesture datasets go to their own IIO device and buffer */
+	struct iio_dev *gesture_dev;
+
+	/*
+	 * Registers covering the enabled channels, and the STATUS bit that
+	 * flags a fresh scan, both derived from the active scan mask.
+	 */
+	u8 block[APDS9960_SCAN_REGS];
+	unsigned int block_reg;
+	unsigned int block_len;
+	unsigned int scan_status;
+
+	/*
+	 * Sleep-after-interrupt: the chip stops after asserting an interrupt
+	 * and keeps the sample behind it until the host clears it on rearm.
+	 */
+	bool sai;
+
+	/* Ensure naturally aligned timestamp */
+	struct {
+		u8 regs[APDS9960_SCAN_BYTES];
+		s64 timestamp __aligned(8);
+	} scan;
+
+	struct {
+		u8 udlr[4];
+		s64 timestamp __aligned(8);
+	} gscan;
+
+	struct apds9960_batch als_batch;
+	struct apds9960_batch gesture_batch;
 };
 
 static const struct reg_default apds9960_reg_defaults[] = {
@@ -55,9 +357,16 @@ static const struct reg_default apds9960_reg_defaults[] = {
 	{ APDS9960_REG_ATIME, 0xff },
 };
 
+/*
+ * GCONF_4 holds the self-clearing GFIFO_CLR, which a cached copy would
+ * replay on every cache sync; GIEN is put back by hand instead.
+ */
 static const struct regmap_range apds9960_volatile_ranges[] = {
-	regmap_reg_range(APDS9960_REG_ALS_BASE,
-				APDS9960_REG_ALS_BASE + 2),
+	regmap_reg_range(APDS9960_REG_ID, APDS9960_REG_PDATA),
+	regmap_reg_range(APDS9960_REG_GCONF_4, APDS9960_REG_GCONF_4),
+	regmap_reg_range(APDS9960_REG_GFLVL, APDS9960_REG_GSTATUS),
+	regmap_reg_range(APDS9960_REG_AICLEAR, APDS9960_REG_AICLEAR),
+	regmap_reg_range(APDS9960_REG_GFIFO_BASE, APDS9960_REG_GFIFO_BASE + 3),
 };
 
 static const struct regmap_access_table apds9960_volatile_table = {
@@ -68,6 +377,7 @@ static const struct regmap_access_table apds9960_volatile_table = {
 static const struct regmap_range apds9960_precious_ranges[] = {
 	regmap_reg_range(APDS9960_REG_ALS_BASE + 4,
 				APDS9960_REG_ALS_BASE + 6),
+	regmap_reg_range(APDS9960_REG_GFIFO_BASE, APDS9960_REG_GFIFO_BASE + 3),
 };
 
 static const struct regmap_access_table apds9960_precious_table = {
@@ -75,95 +385,522 @@ static const struct regmap_access_table apds9960_precious_table = {
 	.n_yes_ranges	= ARRAY_SIZE(apds9960_precious_ranges),
 };
 
-static const struct regmap_range apds9960_readable_ranges[] = {
-	regmap_reg_range(APDS9960_REG_ATIME, APDS9960_REG_ALS_BASE + 6),
-};
-
-static const struct regmap_access_table apds9960_readable_table = {
-	.yes_ranges	= apds9960_readable_ranges,
-	.n_yes_ranges	= ARRAY_SIZE(apds9960_readable_ranges),
-};
-
 static const struct regmap_config apds9960_regmap_config = {
 	.name = APDS9960_REGMAP_NAME,
 	.reg_bits = 8,
 	.val_bits = 8,
-	.use_single_read = true,
 	.use_single_write = true,
 
 	.volatile_table = &apds9960_volatile_table,
 	.precious_table = &apds9960_precious_table,
 	.rd_table = &apds9960_readable_table,
+	.wr_table = &apds9960_writeable_table,
 
 	.reg_defaults = apds9960_reg_defaults,
 	.num_reg_defaults = ARRAY_SIZE(apds9960_reg_defaults),
-	.max_register = APDS9960_REG_ALS_BASE + 6,
+	.max_register = APDS9960_REG_GFIFO_BASE + 3,
 	.cache_type = REGCACHE_RBTREE,
 };
 
-static const struct iio_chan_spec apds9960_channels[] = {
-	/* ALS */
+/*
+ * The rising and falling values are the high and low thresholds of the
+ * hardware window, armed by the either-direction enable and reported as
+ * either-direction events while the buffer is off. Saturation, ADC (CPSAT)
+ * on clear or analog (PGSAT) on proximity, is a rising magnitude event of
+ * its own. A change event flags an AGC step that alters the scale of later
+ * samples.
+ */
+#define APDS9960_THRESH_EVENTS \
+	{ \
+		.type = IIO_EV_TYPE_THRESH, \
+		.dir = IIO_EV_DIR_RISING, \
+		.mask_separate = BIT(IIO_EV_INFO_VALUE), \
+	}, { \
+		.type = IIO_EV_TYPE_THRESH, \
+		.dir = IIO_EV_DIR_FALLING, \
+		.mask_separate = BIT(IIO_EV_INFO_VALUE), \
+	}, { \
+		.type = IIO_EV_TYPE_THRESH, \
+		.dir = IIO_EV_DIR_EITHER, \
+		.mask_separate = BIT(IIO_EV_INFO_ENABLE), \
+	}, { \
+		.type = IIO_EV_TYPE_MAG, \
+		.dir = IIO_EV_DIR_RISING, \
+		.mask_separate = BIT(IIO_EV_INFO_ENABLE), \
+	}, { \
+		.type = IIO_EV_TYPE_CHANGE, \
+		.dir = IIO_EV_DIR_NONE, \
+		.mask_separate = BIT(IIO_EV_INFO_ENABLE), \
+	}
+
+/* Rate-of-change on illuminance is judged from the clear channel */
+static const struct iio_event_spec apds9960_clear_events[] = {
+	APDS9960_THRESH_EVENTS,
 	{
-		.type = IIO_INTENSITY,
-		.info_mask_separate = BIT(IIO_CHAN_INFO_RAW),
-		.info_mask_shared_by_type = BIT(IIO_CHAN_INFO_SCALE) |
-			BIT(IIO_CHAN_INFO_INT_TIME),
-		.channel2 = IIO_MOD_LIGHT_CLEAR,
-		.address = APDS9960_REG_ALS_CHANNEL(CLEAR),
-		.modified = 1,
-		.scan_index = -1,
+		.type = IIO_EV_TYPE_ROC,
+		.dir = IIO_EV_DIR_RISING,
+		.mask_separate = BIT(IIO_EV_INFO_ENABLE),
+	}, {
+		.type = IIO_EV_TYPE_ROC,
+		.dir = IIO_EV_DIR_FALLING,
+		.mask_separate = BIT(IIO_EV_INFO_ENABLE),
+	}, {
+		.type = IIO_EV_TYPE_ROC,
+		.dir = IIO_EV_DIR_EITHER,
+		.mask_separate = BIT(IIO_EV_INFO_VALUE),
 	},
-	/* RGB Sensor */
+};
+
+static const struct iio_event_spec apds9960_prox_events[] = {
+	APDS9960_THRESH_EVENTS,
+};
+
+/* A stall recovery breaks the timeline: samples resume after a gap */
+static const struct iio_event_spec apds9960_timestamp_events[] = {
 	{
-		.type = IIO_INTENSITY,
-		.info_mask_separate = BIT(IIO_CHAN_INFO_RAW),
-		.info_mask_shared_by_type = BIT(IIO_CHAN_INFO_SCALE) |
-			BIT(IIO_CHAN_INFO_INT_TIME),
-		.channel2 = IIO_MOD_LIGHT_RED,
-		.address = APDS9960_REG_ALS_CHANNEL(RED),
-		.modified = 1,
-		.scan_index = -1,
+		.type = IIO_EV_TYPE_CHANGE,
+		.dir = IIO_EV_DIR_NONE,
+		.mask_separate = BIT(IIO_EV_INFO_ENABLE),
 	},
+};
+
+#define APDS9960_INTENSITY_CHANNEL(_colour, ...) { \
+	.type = IIO_INTENSITY, \
+	.info_mask_separate = BIT(IIO_CHAN_INFO_RAW) | \
+		BIT(IIO_CHAN_INFO_HYSTERESIS) | \
+		BIT(IIO_CHAN_INFO_CALIBSCALE) | \
+		BIT(IIO_CHAN_INFO_CALIBBIAS), \
+	.info_mask_shared_by_type = BIT(IIO_CHAN_INFO_SCALE) | \
+		BIT(IIO_CHAN_INFO_INT_TIME) | \
+		BIT(IIO_CHAN_INFO_LOW_PASS_FILTER_3DB_FREQUENCY), \
+	.info_mask_shared_by_type_available = \
+		BIT(IIO_CHAN_INFO_LOW_PASS_FILTER_3DB_FREQUENCY), \
+	.channel2 = IIO_MOD_LIGHT_##_colour, \
+	.address = APDS9960_REG_ALS_CHANNEL(_colour), \
+	.modified = 1, \
+	.scan_index = IDX_ALS_##_colour, \
+	.scan_type = { \
+		.sign = 'u', \
+		.realbits = 16, \
+		.storagebits = 16, \
+		.endianness = IIO_LE, \
+	}, \
+	__VA_ARGS__ \
+}
+
+#define APDS9960_DERIVED_CHANNEL(_colour, _name, _si) { \
+	.type = IIO_INTENSITY, \
+	.channel2 = IIO_MOD_LIGHT_##_colour, \
+	.modified = 1, \
+	.extend_name = _name, \
+	.scan_index = _si, \
+	.scan_type = { \
+		.sign = 'u', \
+		.realbits = 16, \
+		.storagebits = 16, \
+		.endianness = IIO_LE, \
+	}, \
+}
+
+static const struct iio_chan_spec apds9960_channels[] = {
+	/* ALS */
+	APDS9960_INTENSITY_CHANNEL(CLEAR,
+		.event_spec = apds9960_clear_events,
+		.num_event_specs = ARRAY_SIZE(apds9960_clear_events),),
+	/* RGB Sensor */
+	APDS9960_INTENSITY_CHANNEL(RED),
+	APDS9960_INTENSITY_CHANNEL(GREEN),
+	APDS9960_INTENSITY_CHANNEL(BLUE),
+	/* Proximity */
 	{
-		.type = IIO_INTENSITY,
-		.info_mask_separate = BIT(IIO_CHAN_INFO_RAW),
-		.info_mask_shared_by_type = BIT(IIO_CHAN_INFO_SCALE) |
-			BIT(IIO_CHAN_INFO_INT_TIME),
-		.channel2 = IIO_MOD_LIGHT_GREEN,
-		.address = APDS9960_REG_ALS_CHANNEL(GREEN),
-		.modified = 1,
-		.scan_index = -1,
+		.type = IIO_PROXIMITY,
+		.info_mask_separate = BIT(IIO_CHAN_INFO_HYSTERESIS),
+		.address = APDS9960_REG_PDATA,
+		.event_spec = apds9960_prox_events,
+		.num_event_specs = ARRAY_SIZE(apds9960_prox_events),
+		.scan_index = APDS9960_IDX_PROX,
+		.scan_type = {
+			.sign = 'u',
+			.realbits = 8,
+			.storagebits = 8,
+		},
 	},
+	/* IR estimate and IR-compensated CRGB */
+	APDS9960_DERIVED_CHANNEL(IR, NULL, APDS9960_IDX_IR),
+	APDS9960_DERIVED_CHANNEL(CLEAR, "ir_comp", APDS9960_IDX_IR_COMP),
+	APDS9960_DERIVED_CHANNEL(RED, "ir_comp", APDS9960_IDX_IR_COMP + 1),
+	APDS9960_DERIVED_CHANNEL(GREEN, "ir_comp", APDS9960_IDX_IR_COMP + 2),
+	APDS9960_DERIVED_CHANNEL(BLUE, "ir_comp", APDS9960_IDX_IR_COMP + 3),
+	/* IIO_CHAN_SOFT_TIMESTAMP() plus the recovery event */
 	{
-		.type = IIO_INTENSITY,
-		.info_mask_separate = BIT(IIO_CHAN_INFO_RAW),
-		.info_mask_shared_by_type = BIT(IIO_CHAN_INFO_SCALE) |
-			BIT(IIO_CHAN_INFO_INT_TIME),
-		.channel2 = IIO_MOD_LIGHT_BLUE,
-		.address = APDS9960_REG_ALS_CHANNEL(BLUE),
-		.modified = 1,
-		.scan_index = -1,
+		.type = IIO_TIMESTAMP,
+		.channel = -1,
+		.event_spec = apds9960_timestamp_events,
+		.num_event_specs = ARRAY_SIZE(apds9960_timestamp_events),
+		.scan_index = APDS9960_NUM_SCAN_CHANNELS,
+		.scan_type = {
+			.sign = 's',
+			.realbits = 64,
+			.storagebits = 64,
+		},
 	},
-	/* End of channels */
-	{},
 };
 
+#define APDS9960_GESTURE_CHANNEL(_dir, _si) { \
+	.type = IIO_PROXIMITY, \
+	.channel = _si + 1, \
+	.address = APDS9960_REG_GFIFO_##_dir, \
+	.scan_index = _si, \
+	.indexed = 1, \
+	.scan_type = { \
+		.sign = 'u', \
+		.realbits = 8, \
+		.storagebits = 8, \
+	}, \
+}
+
+/* Up, down, left and right photodiode datasets, in GFIFO order */
+static const struct iio_chan_spec apds9960_gesture_channels[] = {
+	APDS9960_GESTURE_CHANNEL(UP, 0),
+	APDS9960_GESTURE_CHANNEL(DOWN, 1),
+	APDS9960_GESTURE_CHANNEL(LEFT, 2),
+	APDS9960_GESTURE_CHANNEL(RIGHT, 3),
+	IIO_CHAN_SOFT_TIMESTAMP(4),
+};
+
+static int apds9960_hwfifo_set_watermark(struct iio_dev *indio_dev,
+					 unsigned int val);
+static int apds9960_hwfifo_flush(struct iio_dev *indio_dev,
+				 unsigned int count);
+
+static const struct iio_info apds9960_gesture_info = {
+	.hwfifo_set_watermark = apds9960_hwfifo_set_watermark,
+	.hwfifo_flush_to_buffer = apds9960_hwfifo_flush,
+};
+
+/* One ALS integration or wait step */
+#define APDS9960_CYCLE_STEP_US		2780
+/* Proximity cycle cost outside the LED pulse train */
+#define APDS9960_PROX_OVERHEAD_US	696
+
+static const unsigned int apds9960_pulse_len_us[] = { 4, 8, 16, 32 };
+
+/*
+ * Full engine cycle from the cached configuration: proximity, wait and
+ * ALS, each only when enabled. The proximity part is an estimate, the
+ * pulse train at a 50% duty cycle plus a fixed overhead.
+ */
+static int apds9960_cycle_time_us(struct apds9960_data *data)
+{
+	unsigned int enable, reg, cfg, pulses, len;
+	int total = 0, ret;
+
+	ret = regmap_read(data->regmap, APDS9960_REG_ENABLE, &enable);
+	if (ret)
+		return ret;
+
+	if (enable & APDS9960_REG_ENABLE_PEN) {
+		ret = regmap_read(data->regmap, APDS9960_REG_PPULSE, &reg);
+		if (ret)
+			return ret;
+		pulses = FIELD_GET(APDS9960_REG_PPULSE_PULSES_MASK, reg) + 1;
+		len = apds9960_pulse_len_us[FIELD_GET(APDS9960_REG_PPULSE_PPLEN_MASK,
+						      reg)];
+		total += APDS9960_PROX_OVERHEAD_US + pulses * 2 * len;
+	}
+
+	if (enable & APDS9960_REG_ENABLE_WEN) {
+		ret = regmap_read(data->regmap, APDS9960_REG_WTIME, &reg);
+		if (!ret)
+			ret = regmap_read(data->regmap, APDS9960_REG_CONFIG_1,
+					  &cfg);
+		if (ret)
+			return ret;
+		total += (256 - reg) * APDS9960_CYCLE_STEP_US *
+			 (cfg & APDS9960_REG_CONFIG_1_WLONG ? 12 : 1);
+	}
+
+	if (enable & APDS9960_REG_ENABLE_AEN) {
+		ret = regmap_read(data->regmap, APDS9960_REG_ATIME, &reg);
+		if (ret)
+			return ret;
+		total += (256 - reg) * APDS9960_CYCLE_STEP_US;
+	}
+
+	return total;
+}
+
+static u64 apds9960_lpf_freq_uhz(struct apds9960_data *data,
+				 unsigned int shift);
+
+/*
+ * Refresh the cached sample period after a timing register changed, and
+ * the low-pass cut-offs that follow it.
+ */
+static void apds9960_update_period(struct apds9960_data *data)
+{
+	unsigned int shift;
+	int period;
+	u64 freq;
+
+	lockdep_assert_held(&data->lock);
+
+	period = apds9960_cycle_time_us(data);
+	if (period <= 0)
+		period = data->als_adc_int_us ?: APDS9960_CYCLE_STEP_US;
+
+	WRITE_ONCE(data->period_us, period);
+
+	for (shift = 0; shift <= APDS9960_LPF_SHIFT_MAX; shift++) {
+		freq = apds9960_lpf_freq_uhz(data, shift);
+		data->lpf_avail[2 * shift] =
+			div_u64_rem(freq, MICRO,
+				    (u32 *)&data->lpf_avail[2 * shift + 1]);
+	}
+}
+
+static unsigned int apds9960_sample_period_us(struct apds9960_data *data)
+{
+	return READ_ONCE(data->period_us) ?: APDS9960_CYCLE_STEP_US;
+}
+
+/*
+ * -3 dB point of the IIR for a given shift, in micro-Hz. Shift 0 passes
+ * everything up to Nyquist; otherwise fc ~= fs / (2 pi 2^shift).
+ */
+static u64 apds9960_lpf_freq_uhz(struct apds9960_data *data,
+				 unsigned int shift)
+{
+	u64 fs = div_u64(1000000ULL * MICRO, apds9960_sample_period_us(data));
+
+	if (!shift)
+		return fs / 2;
+
+	return div_u64(fs * 1000, 6283U << shift);
+}
+
+static int apds9960_set_lpf(struct apds9960_data *data, int val, int val2)
+{
+	u64 want = (u64)val * MICRO + val2;
+	unsigned int shift;
+
+	lockdep_assert_held(&data->lock);
+
+	if (val < 0 || val2 < 0)
+		return -EINVAL;
+
+	/* The mildest filter that cuts off at or below the request */
+	for (shift = 0; shift < APDS9960_LPF_SHIFT_MAX; shift++)
+		if (apds9960_lpf_freq_uhz(data, shift) <= want)
+			break;
+
+	data->lpf_shift = shift;
+	data->lpf_primed = false;
+
+	return 0;
+}
+
+/* Only CRGB carry the low-pass attribute, proximity passes unfiltered */
+static void apds9960_filter_block(struct apds9960_data *data)
+{
+	unsigned int reg, x;
+	u8 *p;
+	int i;
+
+	if (!data->lpf_shift)
+		return;
+
+	for (i = IDX_ALS_CLEAR; i <= IDX_ALS_BLUE; i++) {
+		reg = APDS9960_REG_ALS_BASE + i * 2;
+		if (reg < data->block_reg ||
+		    reg + 2 > data->block_reg + data->block_len)
+			continue;
+
+		p = &data->block[reg - data->block_reg];
+		x = get_unaligned_le16(p) << 8;
+
+		if (!data->lpf_primed)
+			data->lpf_state[i] = x;
+		else if (x >= data->lpf_state[i])
+			data->lpf_state[i] += (x - data->lpf_state[i]) >>
+					      data->lpf_shift;
+		else
+			data->lpf_state[i] -= (data->lpf_state[i] - x) >>
+					      data->lpf_shift;
+
+		put_unaligned_le16(data->lpf_state[i] >> 8, p);
+	}
+
+	data->lpf_primed = true;
+}
+
+#define APDS9960_CAL_SCALE_MAX	16
+
+static void apds9960_set_calibration(struct apds9960_data *data, int idx,
+				     unsigned int scale_micro, int bias)
+{
+	int i;
+
+	data->cal_scale_micro[idx] = scale_micro;
+	data->cal_mult[idx] = div_u64((u64)scale_micro << 16, MICRO);
+	data->cal_bias[idx] = bias;
+
+	data->cal_identity = true;
+	for (i = 0; i < ARRAY_SIZE(data->cal_mult); i++)
+		if (data->cal_scale_micro[i] != MICRO || data->cal_bias[i])
+			data->cal_identity = false;
+}
+
+/*
+ * Override scale and bias from the "calibration" nvmem cell if there is
+ * one. Only -EPROBE_DEFER is fatal; a broken cell leaves the firmware
+ * properties in place.
+ */
+static int apds9960_read_calibration_cell(struct device *dev, u32 *scale,
+					  u32 *bias)
+{
+	struct nvmem_cell *cell;
+	__le32 *buf;
+	size_t len;
+	int i;
+
+	cell = devm_nvmem_cell_get(dev, "calibration");
+	if (IS_ERR(cell)) {
+		if (PTR_ERR(cell) == -EPROBE_DEFER)
+			return -EPROBE_DEFER;
+		/* No cell, or no nvmem support at all, is the common case */
+		if (PTR_ERR(cell) != -ENOENT && PTR_ERR(cell) != -EOPNOTSUPP)
+			dev_warn(dev, "Failed to get calibration cell: %ld\n",
+				 PTR_ERR(cell));
+		return 0;
+	}
+
+	buf = nvmem_cell_read(cell, &len);
+	if (IS_ERR(buf)) {
+		dev_warn(dev, "Failed to read calibration cell: %ld\n",
+			 PTR_ERR(buf));
+		return 0;
+	}
+
+	if (len >= 8 * sizeof(*buf)) {
+		for (i = 0; i < 4; i++) {
+			scale[i] = le32_to_cpu(buf[i]);
+			bias[i] = le32_to_cpu(buf[i + 4]);
+		}
+	} else {
+		dev_warn(dev, "Short calibration cell: %zu bytes\n", len);
+	}
+	kfree(buf);
+
+	return 0;
+}
+
+/*
+ * Factory calibration, lowest to highest precedence: unity, the
+ * "avago,calibscale" (micro units) and "avago,calibbias" firmware
+ * properties, then a "calibration" nvmem cell holding four __le32 scales
+ * followed by four __le32 biases, both in CRGB order.
+ */
+static int apds9960_load_calibration(struct apds9960_data *data)
+{
+	struct device *dev = &data->client->dev;
+	u32 scale[4] = { MICRO, MICRO, MICRO, MICRO };
+	u32 bias[4] = { };
+	int i, ret;
+
+	device_property_read_u32_array(dev, "avago,calibscale", scale,
+				       ARRAY_SIZE(scale));
+	device_property_read_u32_array(dev, "avago,calibbias", bias,
+				       ARRAY_SIZE(bias));
+
+	ret = apds9960_read_calibration_cell(dev, scale, bias);
+	if (ret)
+		return ret;
+
+	for (i = 0; i < 4; i++) {
+		if (scale[i] >= APDS9960_CAL_SCALE_MAX * MICRO) {
+			dev_warn(dev, "Ignoring calibscale %u on channel %d\n",
+				 scale[i], i);
+			scale[i] = MICRO;
+		}
+		apds9960_set_calibration(data, i, scale[i], (s32)bias[i]);
+	}
+
+	return 0;
+}
+
+/* Apply the precomputed CRGB calibration in place on the raw block */
+static void apds9960_calibrate_block(struct apds9960_data *data)
+{
+	unsigned int reg;
+	int i, val;
+	u8 *p;
+
+	if (data->cal_identity)
+		return;
+
+	for (i = IDX_ALS_CLEAR; i <= IDX_ALS_BLUE; i++) {
+		reg = APDS9960_REG_ALS_BASE + i * 2;
+		if (reg < data->block_reg ||
+		    reg + 1 >= data->block_reg + data->block_len)
+			continue;
+
+		p = &data->block[reg - data->block_reg];
+		val = ((u64)get_unaligned_le16(p) * data->cal_mult[i]) >> 16;
+		put_unaligned_le16(clamp(val + data->cal_bias[i], 0,
+					 (int)U16_MAX), p);
+	}
+}
+
 static int apds9960_read_raw(struct iio_dev *indio_dev,
 			     struct iio_chan_spec const *chan,
 			     int *val, int *val2, long mask)
 {
+	struct apds9960_data *data = iio_priv(indio_dev);
 	int ret;
 
+	if (mask == IIO_CHAN_INFO_HYSTERESIS) {
+		*val = data->hysteresis[chan->scan_index];
+		return IIO_VAL_INT;
+	}
+
+	if (mask == IIO_CHAN_INFO_LOW_PASS_FILTER_3DB_FREQUENCY) {
+		u64 freq = apds9960_lpf_freq_uhz(data, data->lpf_shift);
+
+		*val = div_u64_rem(freq, MICRO, (u32 *)val2);
+		return IIO_VAL_INT_PLUS_MICRO;
+	}
+
+	if (mask == IIO_CHAN_INFO_CALIBSCALE) {
+		*val = data->cal_scale_micro[chan->scan_index] / MICRO;
+		*val2 = data->cal_scale_micro[chan->scan_index] % MICRO;
+		return IIO_VAL_INT_PLUS_MICRO;
+	}
+
+	if (mask == IIO_CHAN_INFO_CALIBBIAS) {
+		*val = data->cal_bias[chan->scan_index];
+		return IIO_VAL_INT;
+	}
+
+	/* Read back from ATIME, which AGC may have moved since the write */
+	if (mask == IIO_CHAN_INFO_INT_TIME) {
+		unsigned int atime;
+
+		ret = regmap_read(data->regmap, APDS9960_REG_ATIME, &atime);
+		if (ret)
+			return ret;
+
+		*val = 0;
+		*val2 = (256 - atime) * APDS9960_CYCLE_STEP_US;
+		return IIO_VAL_INT_PLUS_MICRO;
+	}
+
 	if (mask == IIO_CHAN_INFO_SCALE) {
 		switch (chan->channel2) {
 		case IIO_MOD_LIGHT_CLEAR:
 		case IIO_MOD_LIGHT_RED:
 		case IIO_MOD_LIGHT_GREEN:
 		case IIO_MOD_LIGHT_BLUE:
-			ret = iio_read_channel_ext_info(indio_dev, chan,
-					chan->channel2, val, val2);
-			if (ret)
-				return ret;
 			*val = 0;
 			*val2 = 10000; /* 10000 lux, [lx] */
 			return IIO_VAL_FRACTIONAL_LOG2;
@@ -180,7 +917,51 @@ static int apds9960_write_raw(struct iio_dev *indio_dev,
 			      int val, int val2, long mask)
 {
 	struct apds9960_data *data = iio_priv(indio_dev);
-	int reg;
+	int reg, ret;
+
+	/* Deadband, filter and calibration state is read by the IRQ thread */
+	if (mask == IIO_CHAN_INFO_HYSTERESIS) {
+		if (val < 0 || val >= BIT(chan->scan_type.realbits) || val2)
+			return -EINVAL;
+
+		mutex_lock(&data->lock);
+		data->hysteresis[chan->scan_index] = val;
+		data->have_pushed = false;
+		mutex_unlock(&data->lock);
+		return 0;
+	}
+
+	if (mask == IIO_CHAN_INFO_LOW_PASS_FILTER_3DB_FREQUENCY) {
+		mutex_lock(&data->lock);
+		ret = apds9960_set_lpf(data, val, val2);
+		mutex_unlock(&data->lock);
+		return ret;
+	}
+
+	if (mask == IIO_CHAN_INFO_CALIBSCALE) {
+		if (val < 0 || val >= APDS9960_CAL_SCALE_MAX ||
+		    val2 < 0 || val2 >= MICRO)
+			return -EINVAL;
+
+		mutex_lock(&data->lock);
+		apds9960_set_calibration(data, chan->scan_index,
+					 val * MICRO + val2,
+					 data->cal_bias[chan->scan_index]);
+		mutex_unlock(&data->lock);
+		return 0;
+	}
+
+	if (mask == IIO_CHAN_INFO_CALIBBIAS) {
+		if (abs(val) > U16_MAX || val2)
+			return -EINVAL;
+
+		mutex_lock(&data->lock);
+		apds9960_set_calibration(data, chan->scan_index,
+					 data->cal_scale_micro[chan->scan_index],
+					 val);
+		mutex_unlock(&data->lock);
+		return 0;
+	}
 
 	if (mask != IIO_CHAN_INFO_INT_TIME)
 		return -EINVAL;
@@ -217,119 +998,1991 @@ static int apds9960_write_raw(struct iio_dev *indio_dev,
 		return -EINVAL;
 	}
 
-	return regmap_update_bits(data->regmap, APDS9960_REG_ATIME,
-				  0xff, 255 - val);
+	mutex_lock(&data->lock);
+	ret = regmap_update_bits(data->regmap, APDS9960_REG_ATIME,
+				 0xff, 255 - val);
+	if (!ret)
+		apds9960_update_period(data);
+	mutex_unlock(&data->lock);
+
+	return ret;
 }
 
-static irqreturn_t apds9960_als_irq_handler(int irq, void *p)
+static int apds9960_read_avail(struct iio_dev *indio_dev,
+			       struct iio_chan_spec const *chan,
+			       const int **vals, int *type, int *length,
+			       long mask)
 {
-	struct iio_dev *indio_dev = p;
 	struct apds9960_data *data = iio_priv(indio_dev);
 
-	iio_push_event(indio_dev, data->als_int,
-		       iio_get_time_ns(indio_dev));
+	if (mask != IIO_CHAN_INFO_LOW_PASS_FILTER_3DB_FREQUENCY)
+		return -EINVAL;
+
+	/* Kept current by apds9960_update_period(), never filled here */
+	*vals = data->lpf_avail;
+	*type = IIO_VAL_INT_PLUS_MICRO;
+	*length = ARRAY_SIZE(data->lpf_avail);
 
-	return IRQ_HANDLED;
+	return IIO_AVAIL_LIST;
 }
 
-static int apds9960_als_read_event_config(struct iio_dev *indio_dev,
-					  const struct iio_chan_spec *chan,
-					  enum iio_event_type type,
-					  enum iio_event_direction dir)
+static void apds9960_watchdog_kick(struct apds9960_data *data);
+
+/* Whether anything needs the ALS interrupt on every cycle */
+static bool apds9960_als_per_cycle(struct apds9960_data *data, bool streaming)
 {
-	struct apds9960_data *data = iio_priv(indio_dev);
+	if (data->roc_rising || data->roc_falling)
+		return true;
 
-	return regmap_read(data->regmap, APDS9960_REG_ALS_CHANNEL(CLEAR),
-			   &data->als_int);
+	return streaming && kfifo_mode && !data->sai &&
+	       data->scan_status == APDS9960_REG_STATUS_AINT;
 }
 
-static int apds9960_als_write_event_config(struct iio_dev *indio_dev,
-					   const struct iio_chan_spec *chan,
-					   enum iio_event_type type,
-					   enum iio_event_direction dir,
-					   int state)
+/*
+ * Hold the ALS persistence at 0 while per-cycle interrupts are needed and
+ * restore the programmed one afterwards. Meanwhile the window threshold
+ * event fires on the first cycle outside the window.
+ */
+static int apds9960_als_pers_update(struct apds9960_data *data,
+				    bool streaming)
 {
-	struct apds9960_data *data = iio_priv(indio_dev);
+	bool hold = apds9960_als_per_cycle(data, streaming);
+	unsigned int pers;
+	int ret;
+
+	lockdep_assert_held(&data->lock);
+
+	if (hold == data->als_pers_held)
+		return 0;
 
-	return regmap_write(data->regmap, APDS9960_REG_ALS_CHANNEL(CLEAR),
-			    state);
+	if (hold) {
+		ret = regmap_read(data->regmap, APDS9960_REG_PERS, &pers);
+		if (ret)
+			return ret;
+		data->als_pers = pers & APDS9960_REG_PERS_ALS_MASK;
+	}
+
+	ret = regmap_update_bits(data->regmap, APDS9960_REG_PERS,
+				 APDS9960_REG_PERS_ALS_MASK,
+				 hold ? 0 : data->als_pers);
+	if (!ret)
+		data->als_pers_held = hold;
+
+	return ret;
 }
 
-static int apds9960_als_buffer_postenable(struct iio_dev *indio_dev)
+/*
+ * Stop the ALS engine once neither thresholds nor ROC need it, and power
+ * the chip down if nothing else runs. Called with the buffer off.
+ */
+static int apds9960_als_idle(struct apds9960_data *data)
 {
-	return iio_triggered_buffer_postenable(indio_dev);
+	unsigned int enable;
+	int ret;
+
+	if (data->thresh_en[0] || data->roc_rising || data->roc_falling)
+		return 0;
+
+	ret = regmap_update_bits(data->regmap, APDS9960_REG_ENABLE,
+				 APDS9960_REG_ENABLE_AEN |
+				 APDS9960_REG_ENABLE_AIEN, 0);
+	if (!ret)
+		ret = regmap_read(data->regmap, APDS9960_REG_ENABLE, &enable);
+	if (ret)
+		return ret;
+
+	if (enable & (APDS9960_REG_ENABLE_PEN | APDS9960_REG_ENABLE_GEN))
+		return 0;
+
+	return regmap_update_bits(data->regmap, APDS9960_REG_ENABLE,
+				  APDS9960_REG_ENABLE_PON, 0);
 }
 
-static int apds9960_als_buffer_predisable(struct iio_dev *indio_dev)
+/*
+ * Arm the threshold window interrupt, keeping the engine powered for it.
+ * The interrupt enable stays on while the buffer or ROC still needs it.
+ */
+static int apds9960_write_thresh_config(struct iio_dev *indio_dev,
+					const struct iio_chan_spec *chan,
+					int state)
 {
-	return iio_triggered_buffer_predisable(indio_dev);
+	struct apds9960_data *data = iio_priv(indio_dev);
+	bool prox = chan->type == IIO_PROXIMITY;
+	unsigned int run, ien;
+	int ret = 0;
+
+	run = APDS9960_REG_ENABLE_PON | (prox ? APDS9960_REG_ENABLE_PEN :
+						APDS9960_REG_ENABLE_AEN);
+	ien = prox ? APDS9960_REG_ENABLE_PIEN : APDS9960_REG_ENABLE_AIEN;
+
+	mutex_lock(&data->lock);
+
+	data->thresh_en[prox] = state;
+	if (state)
+		ret = regmap_update_bits(data->regmap, APDS9960_REG_ENABLE,
+					 run | ien, run | ien);
+	else if (iio_buffer_enabled(indio_dev))
+		ret = 0;
+	else if (prox)
+		ret = regmap_update_bits(data->regmap, APDS9960_REG_ENABLE,
+					 ien, 0);
+	else
+		ret = apds9960_als_idle(data);
+	apds9960_update_period(data);
+
+	mutex_unlock(&data->lock);
+
+	return ret;
 }
 
-static const struct iio_buffer_setup_ops apds9960_buffer_setup_ops = {
-	.postenable = &apds9960_als_buffer_postenable,
-	.predisable = &apds9960_als_buffer_predisable,
-};
+/* Saturation interrupt enable behind a channel's magnitude event */
+static unsigned int apds9960_sat_bit(const struct iio_chan_spec *chan)
+{
+	return chan->type == IIO_PROXIMITY ? APDS9960_REG_CONFIG_2_PSIEN :
+					     APDS9960_REG_CONFIG_2_CPSIEN;
+}
 
-static int apds9960_probe(struct i2c_client *client)
+static int apds9960_read_event_config(struct iio_dev *indio_dev,
+				      const struct iio_chan_spec *chan,
+				      enum iio_event_type type,
+				      enum iio_event_direction dir)
 {
-	struct apds9960_data *data;
-	struct iio_dev *indio_dev;
+	struct apds9960_data *data = iio_priv(indio_dev);
+	bool prox = chan->type == IIO_PROXIMITY;
+	unsigned int reg;
 	int ret;
 
-	indio_dev = devm_iio_device_alloc(&client->dev, sizeof(*data));
-	if (!indio_dev)
-		return -ENOMEM;
+	if (chan->type == IIO_TIMESTAMP)
+		return data->recovery_notify;
+
+	switch (type) {
+	case IIO_EV_TYPE_THRESH:
+		return data->thresh_en[prox];
+	case IIO_EV_TYPE_MAG:
+		ret = regmap_read(data->regmap, APDS9960_REG_CONFIG_2, &reg);
+		if (ret)
+			return ret;
+		return !!(reg & apds9960_sat_bit(chan));
+	case IIO_EV_TYPE_CHANGE:
+		return data->agc_notify[prox];
+	case IIO_EV_TYPE_ROC:
+		return dir == IIO_EV_DIR_RISING ? data->roc_rising :
+						  data->roc_falling;
+	default:
+		return -EINVAL;
+	}
+}
 
- 	indio_dev->name = APDS9960_DRV_NAME;
-	indio_dev->channels = apds9960_channels;
-	indio_dev->num_channels = ARRAY_SIZE(apds9960_channels);
-	indio_dev->info = &apds9960_info;
-	indio_dev->modes = INDIO_DIRECT_MODE;
-	indio_dev->available_scan_masks = apds9960_scan_masks;
-	indio_dev->channels[0].ext_info = apds9960_intensity_ext_info;
+/*
+ * ROC needs a sample every ALS cycle, so while it is armed the ALS
+ * interrupt fires per cycle even with the buffer off.
+ */
+static int apds9960_write_event_config(struct iio_dev *indio_dev,
+				       const struct iio_chan_spec *chan,
+				       enum iio_event_type type,
+				       enum iio_event_direction dir,
+				       int state)
+{
+	struct apds9960_data *data = iio_priv(indio_dev);
+	unsigned int bits = APDS9960_REG_ENABLE_PON | APDS9960_REG_ENABLE_AEN |
+			    APDS9960_REG_ENABLE_AIEN;
+	bool was, armed, streaming;
+	int ret = 0;
+
+	if (chan->type == IIO_TIMESTAMP) {
+		data->recovery_notify = state;
+		return 0;
+	}
 
-	
+	if (type == IIO_EV_TYPE_THRESH)
+		return apds9960_write_thresh_config(indio_dev, chan, state);
 
-	data = iio_priv(indio_dev);
-	data->client = client;
-	mutex_init(&data->lock);
+	if (type == IIO_EV_TYPE_MAG)
+		return regmap_update_bits(data->regmap, APDS9960_REG_CONFIG_2,
+					  apds9960_sat_bit(chan),
+					  state ? apds9960_sat_bit(chan) : 0);
 
-	data->regmap = devm_regmap_init_i2c(client, &apds9960_regmap_config);
-	if (IS_ERR(data->regmap)) {
-		ret = PTR_ERR(data->regmap);
-		dev_err(&client->dev, "Failed to initialize register map: %d\n",
-			ret);
-		return ret;
+	if (type == IIO_EV_TYPE_CHANGE) {
+		data->agc_notify[chan->type == IIO_PROXIMITY] = state;
+		return 0;
 	}
 
-	ret = regmap_write(data->regmap, APDS9960_REG_ATIME, 0xff);
-	if (ret) {
-		dev_err(&client->dev, "Failed to write ATIME register: %d\n",
-			ret);
-		return ret;
-	}
+	if (type != IIO_EV_TYPE_ROC)
+		return -EINVAL;
 
-	ret = devm_iio_triggered_buffer_setup(&client->dev, indio_dev, NULL,
-					      NULL,
-					      &apds9960_buffer_setup_ops);
-	if (ret) {
-		dev_err(&client->dev, "Failed to setup buffer: %d\n", ret);
+	mutex_lock(&data->lock);
+
+	was = data->roc_rising || data->roc_falling;
+	if (dir == IIO_EV_DIR_RISING)
+		data->roc_rising = state;
+	else
+		data->roc_falling = state;
+	data->roc_count = 0;
+	armed = data->roc_rising || data->roc_falling;
+	streaming = iio_buffer_enabled(indio_dev);
+
+	if (armed != was)
+		ret = apds9960_als_pers_update(data, streaming);
+	if (!ret && armed && !was)
+		ret = regmap_update_bits(data->regmap, APDS9960_REG_ENABLE,
+					 bits, bits);
+	else if (!ret && !armed && was && !streaming)
+		ret = apds9960_als_idle(data);
+	apds9960_update_period(data);
+
+	mutex_unlock(&data->lock);
+
+	/* ROC runs on per-cycle interrupts, which the watchdog guards */
+	if (armed && !was)
+		apds9960_watchdog_kick(data);
+	else if (!armed && was && !(kfifo_mode && streaming))
+		cancel_delayed_work_sync(&data->watchdog);
+
+	return ret;
+}
+
+/* Low byte of the threshold register behind a rising or falling value */
+static unsigned int apds9960_thresh_reg(const struct iio_chan_spec *chan,
+					enum iio_event_direction dir)
+{
+	if (chan->type == IIO_PROXIMITY)
+		return dir == IIO_EV_DIR_RISING ? APDS9960_REG_PIHT :
+						  APDS9960_REG_PILT;
+
+	return dir == IIO_EV_DIR_RISING ? APDS9960_REG_AIHTL :
+					  APDS9960_REG_AILTL;
+}
+
+static int apds9960_read_event_value(struct iio_dev *indio_dev,
+				     const struct iio_chan_spec *chan,
+				     enum iio_event_type type,
+				     enum iio_event_direction dir,
+				     enum iio_event_info info,
+				     int *val, int *val2)
+{
+	struct apds9960_data *data = iio_priv(indio_dev);
+	unsigned int reg;
+	__le16 buf;
+	int ret;
+
+	if (type == IIO_EV_TYPE_THRESH) {
+		reg = apds9960_thresh_reg(chan, dir);
+		if (chan->type == IIO_PROXIMITY) {
+			ret = regmap_read(data->regmap, reg, &reg);
+			*val = reg;
+		} else {
+			ret = regmap_bulk_read(data->regmap, reg, &buf,
+					       sizeof(buf));
+			*val = le16_to_cpu(buf);
+		}
+		return ret ? ret : IIO_VAL_INT;
+	}
+
+	switch (info) {
+	case IIO_EV_INFO_VALUE:
+		*val = data->roc_delta;
+		return IIO_VAL_INT;
+	default:
+		return -EINVAL;
+	}
+}
+
+static int apds9960_write_event_value(struct iio_dev *indio_dev,
+				      const struct iio_chan_spec *chan,
+				      enum iio_event_type type,
+				      enum iio_event_direction dir,
+				      enum iio_event_info info,
+				      int val, int val2)
+{
+	struct apds9960_data *data = iio_priv(indio_dev);
+	unsigned int reg;
+	__le16 buf;
+	int ret;
+
+	if (type == IIO_EV_TYPE_THRESH) {
+		reg = apds9960_thresh_reg(chan, dir);
+		if (val < 0 || val >= BIT(chan->scan_type.realbits) || val2)
+			return -EINVAL;
+
+		mutex_lock(&data->lock);
+		if (chan->type == IIO_PROXIMITY) {
+			ret = regmap_write(data->regmap, reg, val);
+		} else {
+			buf = cpu_to_le16(val);
+			ret = regmap_bulk_write(data->regmap, reg, &buf,
+						sizeof(buf));
+		}
+		mutex_unlock(&data->lock);
+
+		return ret;
+	}
+
+	switch (info) {
+	case IIO_EV_INFO_VALUE:
+		if (val < 1 || val > U16_MAX)
+			return -EINVAL;
+		data->roc_delta = val;
+		return 0;
+	default:
+		return -EINVAL;
+	}
+}
+
+/*
+ * Span a ROC step is measured over. IIO_EV_INFO_PERIOD means how long a
+ * condition has to hold, not this, so it gets an attribute of its own
+ * next to the standard ones under events/.
+ */
+static ssize_t in_intensity_clear_roc_window_us_show(struct device *dev,
+						     struct device_attribute *attr,
+						     char *buf)
+{
+	struct apds9960_data *data = iio_priv(dev_to_iio_dev(dev));
+
+	return sysfs_emit(buf, "%u\n", data->roc_period_us);
+}
+
+static ssize_t in_intensity_clear_roc_window_us_store(struct device *dev,
+						      struct device_attribute *attr,
+						      const char *buf, size_t len)
+{
+	struct apds9960_data *data = iio_priv(dev_to_iio_dev(dev));
+	unsigned int val;
+	int ret;
+
+	ret = kstrtouint(buf, 0, &val);
+	if (ret)
+		return ret;
+
+	if (!val || val > 60 * USEC_PER_SEC)
+		return -EINVAL;
+
+	mutex_lock(&data->lock);
+	data->roc_period_us = val;
+	data->roc_count = 0;
+	mutex_unlock(&data->lock);
+
+	return len;
+}
+
+static IIO_DEVICE_ATTR_RW(in_intensity_clear_roc_window_us, 0);
+
+static struct attribute *apds9960_event_attributes[] = {
+	&iio_dev_attr_in_intensity_clear_roc_window_us.dev_attr.attr,
+	NULL
+};
+
+static const struct attribute_group apds9960_event_attribute_group = {
+	.attrs = apds9960_event_attributes,
+};
+
+/*
+ * Compare the new clear sample with the one a ROC period ago and report
+ * a step beyond the threshold. History restarts after each event so one
+ * transition is reported once.
+ */
+static void apds9960_roc_sample(struct iio_dev *indio_dev, unsigned int x,
+				s64 timestamp)
+{
+	struct apds9960_data *data = iio_priv(indio_dev);
+	unsigned int window, old;
+	int delta;
+
+	window = clamp(DIV_ROUND_UP(data->roc_period_us,
+				    apds9960_sample_period_us(data)),
+		       1U, APDS9960_ROC_HIST - 1);
+
+	data->roc_hist[data->roc_head] = x;
+	data->roc_head = (data->roc_head + 1) % APDS9960_ROC_HIST;
+	if (data->roc_count < window) {
+		data->roc_count++;
+		return;
+	}
+
+	old = data->roc_hist[(data->roc_head + APDS9960_ROC_HIST - 1 - window) %
+			     APDS9960_ROC_HIST];
+	delta = (int)x - (int)old;
+
+	if (data->roc_rising && delta > (int)data->roc_delta)
+		iio_push_event(indio_dev,
+			       IIO_MOD_EVENT_CODE(IIO_INTENSITY, 0,
+						  IIO_MOD_LIGHT_CLEAR,
+						  IIO_EV_TYPE_ROC,
+						  IIO_EV_DIR_RISING),
+			       timestamp);
+	else if (data->roc_falling && -delta > (int)data->roc_delta)
+		iio_push_event(indio_dev,
+			       IIO_MOD_EVENT_CODE(IIO_INTENSITY, 0,
+						  IIO_MOD_LIGHT_CLEAR,
+						  IIO_EV_TYPE_ROC,
+						  IIO_EV_DIR_FALLING),
+			       timestamp);
+	else
+		return;
+
+	data->roc_count = 1;
+}
+
+/* Highest PDATA left over once crosstalk is cancelled */
+#define APDS9960_PROX_CAL_TARGET	4
+
+/* One PDATA sample taken entirely with the current offsets */
+static int apds9960_prox_sample(struct apds9960_data *data, unsigned int *val)
+{
+	unsigned int status;
+	int i, ret;
+
+	/* The first PVALID may belong to a cycle started before the write */
+	for (i = 0; i < 2; i++) {
+		ret = regmap_read(data->regmap, APDS9960_REG_PDATA, val);
+		if (ret)
+			return ret;
+
+		ret = regmap_read_poll_timeout(data->regmap,
+					       APDS9960_REG_STATUS, status,
+					       status & APDS9960_REG_STATUS_PVALID,
+					       1000, 50000);
+		if (ret)
+			return ret;
+	}
+
+	return regmap_read(data->regmap, APDS9960_REG_PDATA, val);
+}
+
+static int apds9960_prox_set_offset(struct apds9960_data *data,
+				    unsigned int offset)
+{
+	int ret;
+
+	ret = regmap_write(data->regmap, APDS9960_REG_POFFSET_UR, offset);
+	if (ret)
+		return ret;
+
+	return regmap_write(data->regmap, APDS9960_REG_POFFSET_DL, offset);
+}
+
+/*
+ * Binary search for the smallest offset that brings the no-target PDATA
+ * down to APDS9960_PROX_CAL_TARGET, one proximity cycle or two per step.
+ * The result stays in the regmap cache and survives a cache sync.
+ */
+static int apds9960_prox_calibrate(struct apds9960_data *data)
+{
+	unsigned int lo = 0, hi = APDS9960_POFFSET_MAX, mid, enable, pdata;
+	int ret, err;
+
+	mutex_lock(&data->lock);
+
+	ret = regmap_read(data->regmap, APDS9960_REG_ENABLE, &enable);
+	if (ret)
+		goto out;
+
+	ret = regmap_update_bits(data->regmap, APDS9960_REG_ENABLE,
+				 APDS9960_REG_ENABLE_PON |
+				 APDS9960_REG_ENABLE_PEN,
+				 APDS9960_REG_ENABLE_PON |
+				 APDS9960_REG_ENABLE_PEN);
+	if (ret)
+		goto out;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+
+		ret = apds9960_prox_set_offset(data, mid);
+		if (!ret)
+			ret = apds9960_prox_sample(data, &pdata);
+		if (ret)
+			goto restore;
+
+		if (pdata <= APDS9960_PROX_CAL_TARGET)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+
+	ret = apds9960_prox_set_offset(data, lo);
+	if (!ret)
+		dev_dbg(&data->client->dev, "Proximity offset %u\n", lo);
+
+restore:
+	err = regmap_write(data->regmap, APDS9960_REG_ENABLE, enable);
+	if (!ret)
+		ret = err;
+	apds9960_update_period(data);
+out:
+	mutex_unlock(&data->lock);
+
+	return ret;
+}
+
+static ssize_t in_proximity_calibrate_store(struct device *dev,
+					    struct device_attribute *attr,
+					    const char *buf, size_t len)
+{
+	struct iio_dev *indio_dev = dev_to_iio_dev(dev);
+	struct apds9960_data *data = iio_priv(indio_dev);
+	bool val;
+	int ret;
+
+	ret = kstrtobool(buf, &val);
+	if (ret)
+		return ret;
+
+	if (!val)
+		return len;
+
+	/*
+	 * The search rewrites POFFSET and ENABLE under the IRQ thread's
+	 * feet, so refuse while either buffer is streaming.
+	 */
+	ret = iio_device_claim_direct_mode(indio_dev);
+	if (ret)
+		return ret;
+
+	if (data->gesture_dev && iio_buffer_enabled(data->gesture_dev))
+		ret = -EBUSY;
+	else
+		ret = apds9960_prox_calibrate(data);
+
+	iio_device_release_direct_mode(indio_dev);
+
+	return ret ? ret : len;
+}
+
+static IIO_DEVICE_ATTR_WO(in_proximity_calibrate, 0);
+
+/* Grace on top of a few cycles before a missing interrupt counts */
+#define APDS9960_WATCHDOG_CYCLES	4
+#define APDS9960_WATCHDOG_SLACK_MS	100
+
+static bool apds9960_id_valid(unsigned int id)
+{
+	/* APDS-9960 and the two known register-compatible revisions */
+	return id == 0xab || id == 0x9c || id == 0xa8;
+}
+
+static void apds9960_watchdog_kick(struct apds9960_data *data)
+{
+	unsigned int ms = APDS9960_WATCHDOG_CYCLES *
+			  DIV_ROUND_UP(apds9960_sample_period_us(data), 1000) +
+			  APDS9960_WATCHDOG_SLACK_MS;
+
+	/* One-shot SAI captures are quiet on purpose */
+	if (data->sai)
+		return;
+
+	mod_delayed_work(system_wq, &data->watchdog, msecs_to_jiffies(ms));
+}
+
+static void apds9960_watchdog_work(struct work_struct *work)
+{
+	struct apds9960_data *data = container_of(work, struct apds9960_data,
+						  watchdog.work);
+	struct device *dev = &data->client->dev;
+	unsigned int id;
+	int ret;
+
+	mutex_lock(&data->lock);
+
+	/* Raced with sleep_after_interrupt being set: parked, not stalled */
+	if (data->sai) {
+		mutex_unlock(&data->lock);
+		return;
+	}
+
+	/* Only touch the bus config once the chip answers as itself */
+	ret = regmap_read(data->regmap, APDS9960_REG_ID, &id);
+	if (ret || !apds9960_id_valid(id)) {
+		dev_warn_ratelimited(dev, "Stalled and not responding: %d\n",
+				     ret);
+		goto rearm;
+	}
+
+	/*
+	 * Replay the configuration with the engines still off and start
+	 * them last, so no cycle runs on half-restored settings.
+	 */
+	regcache_mark_dirty(data->regmap);
+	ret = regcache_sync_region(data->regmap, APDS9960_REG_ENABLE + 1,
+				   apds9960_regmap_config.max_register);
+	if (!ret && data->gesture_dev && iio_buffer_enabled(data->gesture_dev))
+		ret = regmap_update_bits(data->regmap, APDS9960_REG_GCONF_4,
+					 APDS9960_REG_GCONF_4_GIEN,
+					 APDS9960_REG_GCONF_4_GIEN);
+	if (!ret)
+		ret = regcache_sync_region(data->regmap, APDS9960_REG_ENABLE,
+					   APDS9960_REG_ENABLE);
+	if (!ret)
+		ret = regmap_write(data->regmap, APDS9960_REG_AICLEAR, 1);
+	if (ret) {
+		dev_warn_ratelimited(dev, "Stall recovery failed: %d\n", ret);
+		goto rearm;
+	}
+
+	data->watchdog_recoveries++;
+	dev_warn(dev, "Stalled, configuration restored\n");
+	if (data->recovery_notify)
+		iio_push_event(data->indio_dev,
+			       IIO_UNMOD_EVENT_CODE(IIO_TIMESTAMP, 0,
+						    IIO_EV_TYPE_CHANGE,
+						    IIO_EV_DIR_NONE),
+			       iio_get_time_ns(data->indio_dev));
+
+rearm:
+	mutex_unlock(&data->lock);
+	apds9960_watchdog_kick(data);
+}
+
+static void apds9960_watchdog_cancel(void *data)
+{
+	cancel_delayed_work_sync(&((struct apds9960_data *)data)->watchdog);
+}
+
+static ssize_t watchdog_recoveries_show(struct device *dev,
+					struct device_attribute *attr,
+					char *buf)
+{
+	struct apds9960_data *data = iio_priv(dev_to_iio_dev(dev));
+
+	return sysfs_emit(buf, "%u\n", data->watchdog_recoveries);
+}
+
+static IIO_DEVICE_ATTR_RO(watchdog_recoveries, 0);
+
+#define APDS9960_I2C_STAT_ATTR(_name) \
+static ssize_t _name##_show(struct device *dev, \
+			    struct device_attribute *attr, char *buf) \
+{ \
+	struct apds9960_data *data = iio_priv(dev_to_iio_dev(dev)); \
+\
+	return sysfs_emit(buf, "%u\n", data->_name); \
+} \
+static IIO_DEVICE_ATTR_RO(_name, 0)
+
+APDS9960_I2C_STAT_ATTR(i2c_retries);
+APDS9960_I2C_STAT_ATTR(i2c_recoveries);
+APDS9960_I2C_STAT_ATTR(i2c_failed_reads);
+
+enum apds9960_led_field {
+	APDS9960_LED_PULSE_LEN,
+	APDS9960_LED_DRIVE,
+	APDS9960_LED_BOOST,
+};
+
+static const unsigned int apds9960_led_drive_ua[] = {
+	100000, 50000, 25000, 12500
+};
+static const unsigned int apds9960_led_boost_pct[] = { 100, 150, 200, 300 };
+
+/* Register field and value table behind each LED attribute */
+static const struct {
+	unsigned int reg;
+	unsigned int mask;
+	const unsigned int *vals;
+} apds9960_led_fields[] = {
+	[APDS9960_LED_PULSE_LEN] = {
+		APDS9960_REG_PPULSE, APDS9960_REG_PPULSE_PPLEN_MASK,
+		apds9960_pulse_len_us,
+	},
+	[APDS9960_LED_DRIVE] = {
+		APDS9960_REG_CONTROL, APDS9960_REG_CONTROL_LDRIVE_MASK,
+		apds9960_led_drive_ua,
+	},
+	[APDS9960_LED_BOOST] = {
+		APDS9960_REG_CONFIG_2, APDS9960_REG_CONFIG_2_LED_BOOST_MASK,
+		apds9960_led_boost_pct,
+	},
+};
+
+static ssize_t apds9960_led_show(struct device *dev,
+				 struct device_attribute *attr, char *buf)
+{
+	struct apds9960_data *data = iio_priv(dev_to_iio_dev(dev));
+	int field = to_iio_dev_attr(attr)->address;
+	unsigned int reg;
+	int ret;
+
+	ret = regmap_read(data->regmap, apds9960_led_fields[field].reg, &reg);
+	if (ret)
+		return ret;
+
+	reg = (reg & apds9960_led_fields[field].mask) >>
+	      __ffs(apds9960_led_fields[field].mask);
+
+	return sysfs_emit(buf, "%u\n", apds9960_led_fields[field].vals[reg]);
+}
+
+static ssize_t apds9960_led_store(struct device *dev,
+				  struct device_attribute *attr,
+				  const char *buf, size_t len)
+{
+	struct apds9960_data *data = iio_priv(dev_to_iio_dev(dev));
+	int field = to_iio_dev_attr(attr)->address;
+	unsigned int val, i;
+	int ret;
+
+	ret = kstrtouint(buf, 0, &val);
+	if (ret)
+		return ret;
+
+	/* All three fields are two bits wide */
+	for (i = 0; i < 4; i++)
+		if (apds9960_led_fields[field].vals[i] == val)
+			break;
+	if (i == 4)
+		return -EINVAL;
+
+	mutex_lock(&data->lock);
+	ret = regmap_update_bits(data->regmap, apds9960_led_fields[field].reg,
+				 apds9960_led_fields[field].mask,
+				 i << __ffs(apds9960_led_fields[field].mask));
+	if (!ret && field == APDS9960_LED_PULSE_LEN)
+		apds9960_update_period(data);
+	mutex_unlock(&data->lock);
+
+	return ret ? ret : len;
+}
+
+static ssize_t in_proximity_pulse_count_show(struct device *dev,
+					     struct device_attribute *attr,
+					     char *buf)
+{
+	struct apds9960_data *data = iio_priv(dev_to_iio_dev(dev));
+	unsigned int reg;
+	int ret;
+
+	ret = regmap_read(data->regmap, APDS9960_REG_PPULSE, &reg);
+	if (ret)
+		return ret;
+
+	return sysfs_emit(buf, "%lu\n",
+			  FIELD_GET(APDS9960_REG_PPULSE_PULSES_MASK, reg) + 1);
+}
+
+static ssize_t in_proximity_pulse_count_store(struct device *dev,
+					      struct device_attribute *attr,
+					      const char *buf, size_t len)
+{
+	struct apds9960_data *data = iio_priv(dev_to_iio_dev(dev));
+	unsigned int val;
+	int ret;
+
+	ret = kstrtouint(buf, 0, &val);
+	if (ret)
+		return ret;
+
+	if (val < 1 || val > APDS9960_REG_PPULSE_PULSES_MASK + 1)
+		return -EINVAL;
+
+	mutex_lock(&data->lock);
+	ret = regmap_update_bits(data->regmap, APDS9960_REG_PPULSE,
+				 APDS9960_REG_PPULSE_PULSES_MASK,
+				 FIELD_PREP(APDS9960_REG_PPULSE_PULSES_MASK,
+					    val - 1));
+	if (!ret)
+		apds9960_update_period(data);
+	mutex_unlock(&data->lock);
+
+	return ret ? ret : len;
+}
+
+static ssize_t cycle_time_us_show(struct device *dev,
+				  struct device_attribute *attr, char *buf)
+{
+	struct apds9960_data *data = iio_priv(dev_to_iio_dev(dev));
+	int ret;
+
+	ret = apds9960_cycle_time_us(data);
+	if (ret < 0)
+		return ret;
+
+	return sysfs_emit(buf, "%d\n", ret);
+}
+
+static IIO_DEVICE_ATTR(in_proximity_pulse_length_us, 0644,
+		       apds9960_led_show, apds9960_led_store,
+		       APDS9960_LED_PULSE_LEN);
+static IIO_DEVICE_ATTR(in_proximity_led_drive_ua, 0644,
+		       apds9960_led_show, apds9960_led_store,
+		       APDS9960_LED_DRIVE);
+static IIO_DEVICE_ATTR(in_proximity_led_boost_percent, 0644,
+		       apds9960_led_show, apds9960_led_store,
+		       APDS9960_LED_BOOST);
+static IIO_DEVICE_ATTR_RW(in_proximity_pulse_count, 0);
+static IIO_DEVICE_ATTR_RO(cycle_time_us, 0);
+
+static IIO_CONST_ATTR(in_proximity_pulse_length_us_available, "4 8 16 32");
+static IIO_CONST_ATTR(in_proximity_led_drive_ua_available,
+		      "12500 25000 50000 100000");
+static IIO_CONST_ATTR(in_proximity_led_boost_percent_available,
+		      "100 150 200 300");
+static IIO_CONST_ATTR(in_proximity_pulse_count_available, "[1 1 64]");
+
+static struct attribute *apds9960_attributes[] = {
+	&iio_dev_attr_in_proximity_calibrate.dev_attr.attr,
+	&iio_dev_attr_in_proximity_pulse_length_us.dev_attr.attr,
+	&iio_dev_attr_in_proximity_led_drive_ua.dev_attr.attr,
+	&iio_dev_attr_in_proximity_led_boost_percent.dev_attr.attr,
+	&iio_dev_attr_in_proximity_pulse_count.dev_attr.attr,
+	&iio_dev_attr_cycle_time_us.dev_attr.attr,
+	&iio_dev_attr_watchdog_recoveries.dev_attr.attr,
+	&iio_dev_attr_i2c_retries.dev_attr.attr,
+	&iio_dev_attr_i2c_recoveries.dev_attr.attr,
+	&iio_dev_attr_i2c_failed_reads.dev_attr.attr,
+	&iio_const_attr_in_proximity_pulse_length_us_available.dev_attr.attr,
+	&iio_const_attr_in_proximity_led_drive_ua_available.dev_attr.attr,
+	&iio_const_attr_in_proximity_led_boost_percent_available.dev_attr.attr,
+	&iio_const_attr_in_proximity_pulse_count_available.dev_attr.attr,
+	NULL
+};
+
+static const struct attribute_group apds9960_attribute_group = {
+	.attrs = apds9960_attributes,
+};
+
+static const struct iio_info apds9960_info = {
+	.attrs = &apds9960_attribute_group,
+	.event_attrs = &apds9960_event_attribute_group,
+	.read_raw = apds9960_read_raw,
+	.write_raw = apds9960_write_raw,
+	.read_avail = apds9960_read_avail,
+	.read_event_config = apds9960_read_event_config,
+	.write_event_config = apds9960_write_event_config,
+	.read_event_value = apds9960_read_event_value,
+	.write_event_value = apds9960_write_event_value,
+	.hwfifo_set_watermark = apds9960_hwfifo_set_watermark,
+	.hwfifo_flush_to_buffer = apds9960_hwfifo_flush,
+};
+
+/* Push the n oldest pending samples, keeping the rest in order */
+static unsigned int apds9960_batch_release_n(struct apds9960_batch *batch,
+					     unsigned int n)
+{
+	unsigned int i;
+
+	n = min(n, batch->count);
+	for (i = 0; i < n; i++)
+		iio_push_to_buffers_with_timestamp(batch->indio_dev,
+						   batch->pending[i].scan,
+						   batch->pending[i].timestamp);
+
+	batch->count -= n;
+	memmove(batch->pending, batch->pending + n,
+		batch->count * sizeof(*batch->pending));
+
+	return n;
+}
+
+static void apds9960_batch_release(struct apds9960_batch *batch)
+{
+	apds9960_batch_release_n(batch, batch->count);
+}
+
+static void apds9960_batch_work(struct work_struct *work)
+{
+	struct apds9960_batch *batch = container_of(work, struct apds9960_batch,
+						    work.work);
+
+	mutex_lock(&batch->lock);
+	apds9960_batch_release(batch);
+	mutex_unlock(&batch->lock);
+}
+
+static void apds9960_batch_push(struct apds9960_batch *batch, const void *scan,
+				size_t len, s64 timestamp)
+{
+	mutex_lock(&batch->lock);
+
+	memcpy(batch->pending[batch->count].scan, scan, len);
+	batch->pending[batch->count].timestamp = timestamp;
+
+	/* The latency budget runs from the oldest pending sample */
+	if (!batch->count++ && batch->latency_ms)
+		schedule_delayed_work(&batch->work,
+				      msecs_to_jiffies(batch->latency_ms));
+
+	if (!batch->latency_ms || batch->count >= batch->watermark) {
+		cancel_delayed_work(&batch->work);
+		apds9960_batch_release(batch);
+	}
+
+	mutex_unlock(&batch->lock);
+}
+
+/* Hand over whatever is pending before the buffer goes away */
+static void apds9960_batch_stop(struct apds9960_batch *batch)
+{
+	cancel_delayed_work_sync(&batch->work);
+
+	mutex_lock(&batch->lock);
+	apds9960_batch_release(batch);
+	mutex_unlock(&batch->lock);
+}
+
+static void apds9960_batch_cancel(void *data)
+{
+	struct apds9960_batch *batch = data;
+
+	cancel_delayed_work_sync(&batch->work);
+	kvfree(batch->pending);
+}
+
+static int apds9960_batch_init(struct device *dev,
+			       struct apds9960_batch *batch,
+			       struct iio_dev *indio_dev)
+{
+	BUILD_BUG_ON(sizeof_field(struct apds9960_data, scan) >
+		     sizeof_field(struct apds9960_batch_entry, scan));
+
+	batch->pending = kvmalloc_array(1, sizeof(*batch->pending),
+					GFP_KERNEL);
+	if (!batch->pending)
+		return -ENOMEM;
+
+	batch->indio_dev = indio_dev;
+	batch->watermark = 1;
+	mutex_init(&batch->lock);
+	INIT_DELAYED_WORK(&batch->work, apds9960_batch_work);
+
+	return devm_add_action_or_reset(dev, apds9960_batch_cancel, batch);
+}
+
+static struct apds9960_batch *apds9960_batch_of(struct iio_dev *indio_dev);
+
+/*
+ * Called by the IIO core with buffer/watermark before the buffer starts,
+ * so nothing is pending. On allocation failure the old size stays.
+ */
+static int apds9960_hwfifo_set_watermark(struct iio_dev *indio_dev,
+					 unsigned int val)
+{
+	struct apds9960_batch *batch = apds9960_batch_of(indio_dev);
+	struct apds9960_batch_entry *pending;
+
+	/* Triggered mode pushes straight to the buffer */
+	if (!batch->indio_dev)
+		return 0;
+
+	pending = kvmalloc_array(max(val, 1U), sizeof(*pending), GFP_KERNEL);
+	if (!pending)
+		return -ENOMEM;
+
+	mutex_lock(&batch->lock);
+	apds9960_batch_release(batch);
+	kvfree(batch->pending);
+	batch->pending = pending;
+	batch->watermark = max(val, 1U);
+	mutex_unlock(&batch->lock);
+
+	return 0;
+}
+
+/* A reader wants more than the buffer holds: hand over what is pending */
+static int apds9960_hwfifo_flush(struct iio_dev *indio_dev,
+				 unsigned int count)
+{
+	struct apds9960_batch *batch = apds9960_batch_of(indio_dev);
+	unsigned int n;
+
+	if (!batch->indio_dev)
+		return 0;
+
+	mutex_lock(&batch->lock);
+	n = apds9960_batch_release_n(batch, count);
+	if (!batch->count)
+		cancel_delayed_work(&batch->work);
+	mutex_unlock(&batch->lock);
+
+	return n;
+}
+
+static ssize_t max_report_latency_ms_show(struct device *dev,
+					  struct device_attribute *attr,
+					  char *buf)
+{
+	struct apds9960_batch *batch = apds9960_batch_of(dev_to_iio_dev(dev));
+
+	return sysfs_emit(buf, "%u\n", batch->latency_ms);
+}
+
+static ssize_t max_report_latency_ms_store(struct device *dev,
+					   struct device_attribute *attr,
+					   const char *buf, size_t len)
+{
+	struct apds9960_batch *batch = apds9960_batch_of(dev_to_iio_dev(dev));
+	unsigned int val;
+	int ret;
+
+	ret = kstrtouint(buf, 0, &val);
+	if (ret)
+		return ret;
+
+	/*
+	 * Shortening the budget must not strand already pending samples,
+	 * and turning batching off hands them over right away.
+	 */
+	mutex_lock(&batch->lock);
+	batch->latency_ms = val;
+	if (batch->count && !val) {
+		cancel_delayed_work(&batch->work);
+		apds9960_batch_release(batch);
+	} else if (batch->count) {
+		mod_delayed_work(system_wq, &batch->work,
+				 msecs_to_jiffies(val));
+	}
+	mutex_unlock(&batch->lock);
+
+	return len;
+}
+
+static IIO_DEVICE_ATTR_RW(max_report_latency_ms, 0);
+
+static const struct iio_dev_attr *apds9960_batch_attrs[] = {
+	&iio_dev_attr_max_report_latency_ms,
+	NULL
+};
+
+static ssize_t sleep_after_interrupt_show(struct device *dev,
+					  struct device_attribute *attr,
+					  char *buf)
+{
+	struct apds9960_data *data = iio_priv(dev_to_iio_dev(dev));
+
+	return sysfs_emit(buf, "%d\n", data->sai);
+}
+
+static ssize_t sleep_after_interrupt_store(struct device *dev,
+					   struct device_attribute *attr,
+					   const char *buf, size_t len)
+{
+	struct apds9960_data *data = iio_priv(dev_to_iio_dev(dev));
+	bool val;
+	int ret;
+
+	ret = kstrtobool(buf, &val);
+	if (ret)
+		return ret;
+
+	/* A parked chip is quiet on purpose, not stalled */
+	if (val)
+		cancel_delayed_work_sync(&data->watchdog);
+
+	mutex_lock(&data->lock);
+	ret = regmap_update_bits(data->regmap, APDS9960_REG_CONFIG_3,
+				 APDS9960_REG_CONFIG_3_SAI,
+				 val ? APDS9960_REG_CONFIG_3_SAI : 0);
+	/* Wake the chip if it is parked on an interrupt nobody will rearm */
+	if (!ret && data->sai && !val)
+		ret = regmap_write(data->regmap, APDS9960_REG_AICLEAR, 1);
+	if (!ret)
+		data->sai = val;
+	mutex_unlock(&data->lock);
+
+	if (!ret && !val && kfifo_mode && iio_buffer_enabled(data->indio_dev))
+		apds9960_watchdog_kick(data);
+
+	return ret ? ret : len;
+}
+
+/* Acknowledge the captured interrupt, letting the chip run again */
+static ssize_t rearm_store(struct device *dev, struct device_attribute *attr,
+			   const char *buf, size_t len)
+{
+	struct apds9960_data *data = iio_priv(dev_to_iio_dev(dev));
+	int ret;
+
+	mutex_lock(&data->lock);
+	ret = regmap_write(data->regmap, APDS9960_REG_AICLEAR, 1);
+	mutex_unlock(&data->lock);
+
+	return ret ? ret : len;
+}
+
+static IIO_DEVICE_ATTR_RW(sleep_after_interrupt, 0);
+static IIO_DEVICE_ATTR_WO(rearm, 0);
+
+static const struct iio_dev_attr *apds9960_als_buffer_attrs[] = {
+	&iio_dev_attr_max_report_latency_ms,
+	&iio_dev_attr_sleep_after_interrupt,
+	&iio_dev_attr_rearm,
+	NULL
+};
+
+static unsigned int apds9960_scan_reg(int idx)
+{
+	if (idx == APDS9960_IDX_PROX)
+		return APDS9960_REG_PDATA;
+
+	return APDS9960_REG_ALS_BASE + idx * 2;
+}
+
+static unsigned int apds9960_scan_value(struct apds9960_data *data, int idx)
+{
+	const u8 *reg = &data->block[apds9960_scan_reg(idx) - data->block_reg];
+
+	if (idx == APDS9960_IDX_PROX)
+		return *reg;
+
+	return get_unaligned_le16(reg);
+}
+
+/* Deadband filter: true if the scan just read is worth pushing */
+static bool apds9960_scan_changed(struct iio_dev *indio_dev)
+{
+	struct apds9960_data *data = iio_priv(indio_dev);
+	bool deadband = false, changed = !data->have_pushed;
+	unsigned int val;
+	int i;
+
+	for_each_set_bit(i, indio_dev->active_scan_mask,
+			 APDS9960_IDX_PROX + 1) {
+		val = apds9960_scan_value(data, i);
+		if (data->hysteresis[i])
+			deadband = true;
+		if (abs((int)val - (int)data->last_pushed[i]) >
+		    data->hysteresis[i])
+			changed = true;
+	}
+
+	if (deadband && !changed)
+		return false;
+
+	for_each_set_bit(i, indio_dev->active_scan_mask,
+			 APDS9960_IDX_PROX + 1)
+		data->last_pushed[i] = apds9960_scan_value(data, i);
+	data->have_pushed = true;
+
+	return true;
+}
+
+#define APDS9960_I2C_RETRIES	2
+
+/*
+ * Bulk read for the IRQ thread: a couple of quick retries for a NACK or
+ * glitch, then one adapter bus recovery if the bus looks stuck (timeout
+ * or busy, typically SDA held low) before the read is given up.
+ */
+static int apds9960_read_retry(struct apds9960_data *data, unsigned int reg,
+			       void *buf, size_t len)
+{
+	int i, ret;
+
+	for (i = 0; i <= APDS9960_I2C_RETRIES; i++) {
+		if (i) {
+			data->i2c_retries++;
+			usleep_range(100, 200);
+		}
+
+		ret = regmap_bulk_read(data->regmap, reg, buf, len);
+		if (!ret)
+			return 0;
+	}
+
+	if (ret == -ETIMEDOUT || ret == -EBUSY) {
+		if (!i2c_recover_bus(data->client->adapter)) {
+			data->i2c_recoveries++;
+			ret = regmap_bulk_read(data->regmap, reg, buf, len);
+			if (!ret)
+				return 0;
+		}
+	}
+
+	data->i2c_failed_reads++;
+
+	return ret;
+}
+
+/*
+ * IR = max(0, (R + G + B - C) / 2) and X' = max(0, X - IR) for each of
+ * C, R, G and B, the same integer math as the userspace DN40 conversion.
+ */
+static void apds9960_ir_compensate(struct apds9960_data *data, u16 *comp)
+{
+	int c = apds9960_scan_value(data, IDX_ALS_CLEAR);
+	int r = apds9960_scan_value(data, IDX_ALS_RED);
+	int g = apds9960_scan_value(data, IDX_ALS_GREEN);
+	int b = apds9960_scan_value(data, IDX_ALS_BLUE);
+	int ir = max((r + g + b - c) / 2, 0);
+
+	comp[0] = ir;
+	comp[1] = max(c - ir, 0);
+	comp[2] = max(r - ir, 0);
+	comp[3] = max(g - ir, 0);
+	comp[4] = max(b - ir, 0);
+}
+
+static int apds9960_push_scan(struct iio_dev *indio_dev, s64 timestamp)
+{
+	struct apds9960_data *data = iio_priv(indio_dev);
+	const unsigned long derived = APDS9960_IDX_DERIVED_MASK;
+	unsigned int len = 0;
+	u16 comp[5];
+	int i, ret;
+
+	/* A lost sample leaves a gap in the timestamps, not a dead buffer */
+	ret = apds9960_read_retry(data, data->block_reg,
+				  data->block, data->block_len);
+	if (ret) {
+		dev_err_ratelimited(&data->client->dev,
+				    "Failed to read ALS data: %d\n", ret);
+		return ret;
+	}
+
+	if (data->block_reg == APDS9960_REG_ALS_BASE)
+		data->raw_clear = get_unaligned_le16(data->block);
+
+	mutex_lock(&data->lock);
+
+	apds9960_calibrate_block(data);
+	apds9960_filter_block(data);
+
+	if (!apds9960_scan_changed(indio_dev)) {
+		mutex_unlock(&data->lock);
+		return 0;
+	}
+
+	if (bitmap_intersects(indio_dev->active_scan_mask, &derived,
+			      APDS9960_NUM_SCAN_CHANNELS))
+		apds9960_ir_compensate(data, comp);
+
+	/*
+	 * Pack the enabled channels in scan order, each aligned to its own
+	 * size: u16 intensities, PDATA, then the derived u16 channels.
+	 */
+	for_each_set_bit(i, indio_dev->active_scan_mask,
+			 APDS9960_NUM_SCAN_CHANNELS) {
+		unsigned int size = i == APDS9960_IDX_PROX ? 1 : 2;
+
+		len = ALIGN(len, size);
+		if (i > APDS9960_IDX_PROX)
+			put_unaligned_le16(comp[i - APDS9960_IDX_IR],
+					   &data->scan.regs[len]);
+		else
+			memcpy(&data->scan.regs[len],
+			       &data->block[apds9960_scan_reg(i) -
+					    data->block_reg],
+			       size);
+		len += size;
+	}
+
+	mutex_unlock(&data->lock);
+
+	if (kfifo_mode)
+		apds9960_batch_push(&data->als_batch, &data->scan, len,
+				    timestamp);
+	else
+		iio_push_to_buffers_with_timestamp(indio_dev, &data->scan,
+						   timestamp);
+
+	return 0;
+}
+
+/* GWTIME steps, in microseconds */
+static const unsigned int apds9960_gwtime_us[] = {
+	0, 2800, 5600, 8400, 14000, 22400, 30800, 39200
+};
+
+/*
+ * One gesture dataset every wait time plus pulse train, estimated the
+ * same way as the proximity cycle. Falls back to the shortest wait.
+ */
+static unsigned int apds9960_gesture_cycle_us(struct apds9960_data *data)
+{
+	unsigned int conf, pulse, pulses, len;
+
+	if (regmap_read(data->regmap, APDS9960_REG_GCONF_2, &conf) ||
+	    regmap_read(data->regmap, APDS9960_REG_GPULSE, &pulse))
+		return apds9960_gwtime_us[1];
+
+	pulses = FIELD_GET(APDS9960_REG_GPULSE_PULSES_MASK, pulse) + 1;
+	len = apds9960_pulse_len_us[FIELD_GET(APDS9960_REG_GPULSE_GPLEN_MASK,
+					      pulse)];
+
+	return apds9960_gwtime_us[FIELD_GET(APDS9960_REG_GCONF_2_GWTIME_MASK,
+					    conf)] +
+	       APDS9960_PROX_OVERHEAD_US + pulses * 2 * len;
+}
+
+static int apds9960_gesture_drain(struct apds9960_data *data, s64 timestamp)
+{
+	s64 period;
+	u8 cnt;
+	int ret;
+
+	ret = apds9960_read_retry(data, APDS9960_REG_GFLVL, &cnt, 1);
+	if (ret || !cnt)
+		return ret;
+
+	/*
+	 * The newest dataset is the one that raised the interrupt, the
+	 * older ones went in a gesture cycle apart before it.
+	 */
+	period = (s64)apds9960_gesture_cycle_us(data) * NSEC_PER_USEC;
+
+	/* GFIFO_U..R wraps back on itself, one dataset per 4-byte read */
+	while (cnt--) {
+		ret = apds9960_read_retry(data, APDS9960_REG_GFIFO_BASE,
+					  data->gscan.udlr,
+					  sizeof(data->gscan.udlr));
+		if (ret)
+			return ret;
+
+		apds9960_batch_push(&data->gesture_batch, &data->gscan,
+				    sizeof(data->gscan.udlr),
+				    timestamp - cnt * period);
+	}
+
+	return 0;
+}
+
+/*
+ * One AGAIN step, or halving ATIME once already at the lowest gain.
+ * Returns 1 if a step was taken, 0 at the bottom of the range.
+ */
+static int apds9960_als_step_down(struct apds9960_data *data)
+{
+	unsigned int ctrl, atime, cycles, again;
+	int ret;
+
+	ret = regmap_read(data->regmap, APDS9960_REG_CONTROL, &ctrl);
+	if (ret)
+		return ret;
+
+	again = FIELD_GET(APDS9960_REG_CONTROL_AGAIN_MASK, ctrl);
+	if (again) {
+		again--;
+		data->als_gain = 1 << (2 * again);
+		ret = regmap_update_bits(data->regmap, APDS9960_REG_CONTROL,
+					 APDS9960_REG_CONTROL_AGAIN_MASK,
+					 FIELD_PREP(APDS9960_REG_CONTROL_AGAIN_MASK,
+						    again));
+		return ret ?: 1;
+	}
+
+	ret = regmap_read(data->regmap, APDS9960_REG_ATIME, &atime);
+	if (ret)
+		return ret;
+
+	cycles = 256 - atime;
+	if (cycles <= 1)
+		return 0;
+
+	cycles /= 2;
+	/* 2.78 ms per integration cycle */
+	data->als_adc_int_us = cycles * 2780;
+
+	ret = regmap_write(data->regmap, APDS9960_REG_ATIME, 256 - cycles);
+
+	return ret ?: 1;
+}
+
+static int apds9960_prox_step_down(struct apds9960_data *data)
+{
+	unsigned int ctrl, pgain;
+	int ret;
+
+	ret = regmap_read(data->regmap, APDS9960_REG_CONTROL, &ctrl);
+	if (ret)
+		return ret;
+
+	pgain = FIELD_GET(APDS9960_REG_CONTROL_PGAIN_MASK, ctrl);
+	if (!pgain)
+		return 0;
+
+	ret = regmap_update_bits(data->regmap, APDS9960_REG_CONTROL,
+				 APDS9960_REG_CONTROL_PGAIN_MASK,
+				 FIELD_PREP(APDS9960_REG_CONTROL_PGAIN_MASK,
+					    pgain - 1));
+
+	return ret ?: 1;
+}
+
+/*
+ * AGC runs from the IRQ thread, so it takes the lock the sysfs paths use
+ * for the same registers. Readers are told the scale changed under them.
+ */
+static void apds9960_agc_step(struct iio_dev *indio_dev, bool prox,
+			      s64 timestamp)
+{
+	struct apds9960_data *data = iio_priv(indio_dev);
+	int ret;
+
+	mutex_lock(&data->lock);
+	ret = prox ? apds9960_prox_step_down(data) :
+		     apds9960_als_step_down(data);
+	if (ret > 0)
+		apds9960_update_period(data);
+	mutex_unlock(&data->lock);
+
+	if (ret <= 0 || !data->agc_notify[prox])
+		return;
+
+	iio_push_event(indio_dev,
+		       prox ? IIO_UNMOD_EVENT_CODE(IIO_PROXIMITY, 0,
+						   IIO_EV_TYPE_CHANGE,
+						   IIO_EV_DIR_NONE) :
+			      IIO_MOD_EVENT_CODE(IIO_INTENSITY, 0,
+						 IIO_MOD_LIGHT_CLEAR,
+						 IIO_EV_TYPE_CHANGE,
+						 IIO_EV_DIR_NONE),
+		       timestamp);
+}
+
+/*
+ * STATUS latches CPSAT and PGSAT whether or not their interrupts are
+ * enabled, so only act on the ones userspace left armed.
+ */
+static void apds9960_handle_saturation(struct iio_dev *indio_dev,
+				       unsigned int status, s64 timestamp)
+{
+	struct apds9960_data *data = iio_priv(indio_dev);
+	unsigned int cfg;
+
+	if (regmap_read(data->regmap, APDS9960_REG_CONFIG_2, &cfg))
+		return;
+
+	if ((status & APDS9960_REG_STATUS_CPSAT) &&
+	    (cfg & APDS9960_REG_CONFIG_2_CPSIEN)) {
+		iio_push_event(indio_dev,
+			       IIO_MOD_EVENT_CODE(IIO_INTENSITY, 0,
+						  IIO_MOD_LIGHT_CLEAR,
+						  IIO_EV_TYPE_MAG,
+						  IIO_EV_DIR_RISING),
+			       timestamp);
+		if (agc)
+			apds9960_agc_step(indio_dev, false, timestamp);
+	}
+
+	if ((status & APDS9960_REG_STATUS_PGSAT) &&
+	    (cfg & APDS9960_REG_CONFIG_2_PSIEN)) {
+		iio_push_event(indio_dev,
+			       IIO_UNMOD_EVENT_CODE(IIO_PROXIMITY, 0,
+						    IIO_EV_TYPE_MAG,
+						    IIO_EV_DIR_RISING),
+			       timestamp);
+		if (agc)
+			apds9960_agc_step(indio_dev, true, timestamp);
+	}
+}
+
+static void apds9960_handle_scan(struct iio_dev *indio_dev,
+				 unsigned int status, s64 timestamp)
+{
+	struct apds9960_data *data = iio_priv(indio_dev);
+	bool roc = data->roc_rising || data->roc_falling;
+	bool pushed = false;
+	__le16 clear;
+
+	/*
+	 * In kfifo mode the interrupt fires once per ALS (or, for a
+	 * proximity-only scan, proximity) cycle while the buffer is enabled,
+	 * and the sample goes straight into the buffer.
+	 */
+	if (kfifo_mode && iio_buffer_enabled(indio_dev)) {
+		if (status & data->scan_status) {
+			apds9960_watchdog_kick(data);
+			pushed = !apds9960_push_scan(indio_dev, timestamp);
+		}
+	} else {
+		if ((status & APDS9960_REG_STATUS_AINT) && !roc &&
+		    data->thresh_en[0])
+			iio_push_event(indio_dev,
+				       IIO_MOD_EVENT_CODE(IIO_INTENSITY, 0,
+							  IIO_MOD_LIGHT_CLEAR,
+							  IIO_EV_TYPE_THRESH,
+							  IIO_EV_DIR_EITHER),
+				       timestamp);
+		if ((status & APDS9960_REG_STATUS_PINT) && data->thresh_en[1])
+			iio_push_event(indio_dev,
+				       IIO_UNMOD_EVENT_CODE(IIO_PROXIMITY, 0,
+							    IIO_EV_TYPE_THRESH,
+							    IIO_EV_DIR_EITHER),
+				       timestamp);
+	}
+
+	if (!roc || !(status & APDS9960_REG_STATUS_AINT))
+		return;
+
+	if (!pushed)
+		apds9960_watchdog_kick(data);
+
+	/* Reuse the raw clear count just read for the buffer if there is one */
+	if (pushed && data->block_reg == APDS9960_REG_ALS_BASE) {
+		apds9960_roc_sample(indio_dev, data->raw_clear, timestamp);
+	} else if (!apds9960_read_retry(data, APDS9960_REG_ALS_BASE,
+					&clear, sizeof(clear))) {
+		apds9960_roc_sample(indio_dev, le16_to_cpu(clear), timestamp);
+	}
+}
+
+/*
+ * A single STATUS read decides what asserted the line: gesture FIFO,
+ * saturation, or a completed ALS/proximity cycle. Saturation is handled
+ * after the scan, so the sample pushed in this pass was taken, and is
+ * scaled, with the gain it was integrated at.
+ */
+static irqreturn_t apds9960_irq_handler(int irq, void *p)
+{
+	struct iio_dev *indio_dev = p;
+	struct apds9960_data *data = iio_priv(indio_dev);
+	s64 timestamp = iio_get_time_ns(indio_dev);
+	unsigned int status;
+	u8 reg;
+	int ret;
+
+	ret = apds9960_read_retry(data, APDS9960_REG_STATUS, &reg, 1);
+	if (ret) {
+		/*
+		 * The cause is unknown, but leaving the interrupt latched
+		 * would stall the stream for good. SAI keeps its sample.
+		 */
+		if (!data->sai)
+			regmap_write(data->regmap, APDS9960_REG_AICLEAR, 1);
+		return IRQ_HANDLED;
+	}
+	status = reg;
+
+	/*
+	 * A GINT left undrained, one racing the gesture buffer going down
+	 * or a failed read, keeps the FIFO over threshold and the line low
+	 * for good, so flush whatever could not be read.
+	 */
+	if ((status & APDS9960_REG_STATUS_GINT) &&
+	    (!data->gesture_dev || !iio_buffer_enabled(data->gesture_dev) ||
+	     apds9960_gesture_drain(data, timestamp)))
+		regmap_update_bits(data->regmap, APDS9960_REG_GCONF_4,
+				   APDS9960_REG_GCONF_4_GFIFO_CLR,
+				   APDS9960_REG_GCONF_4_GFIFO_CLR);
+
+	apds9960_handle_scan(indio_dev, status, timestamp);
+
+	if (status & (APDS9960_REG_STATUS_CPSAT | APDS9960_REG_STATUS_PGSAT))
+		apds9960_handle_saturation(indio_dev, status, timestamp);
+
+	/* With SAI the chip sleeps on this sample until rearm clears it */
+	if ((status & APDS9960_REG_STATUS_NON_GESTURE) && !data->sai)
+		regmap_write(data->regmap, APDS9960_REG_AICLEAR, 1);
+
+	return IRQ_HANDLED;
+}
+
+/*
+ * Work out the bulk read for the active scan mask and the ENABLE bits of
+ * the engines feeding it, without their interrupt enables.
+ */
+static int apds9960_scan_setup(struct iio_dev *indio_dev, unsigned int *bits)
+{
+	struct apds9960_data *data = iio_priv(indio_dev);
+	unsigned long hw = *indio_dev->active_scan_mask;
+	const unsigned long *mask = &hw;
+	unsigned int first, last;
+
+	/* Derived channels are computed from a full CRGB read */
+	if (hw & APDS9960_IDX_DERIVED_MASK)
+		hw |= APDS9960_IDX_CRGB_MASK;
+	hw &= GENMASK(APDS9960_IDX_PROX, 0);
+
+	first = find_first_bit(mask, APDS9960_IDX_PROX + 1);
+	last = find_last_bit(mask, APDS9960_IDX_PROX + 1);
+	if (first > APDS9960_IDX_PROX)
+		return -EINVAL;
+
+	/* One bulk read from the first to the last enabled channel */
+	data->block_reg = apds9960_scan_reg(first);
+	data->block_len = apds9960_scan_reg(last) - data->block_reg +
+			  (last == APDS9960_IDX_PROX ? 1 : 2);
+
+	/* The first scan after enabling always goes out */
+	data->have_pushed = false;
+	data->lpf_primed = false;
+
+	*bits = APDS9960_REG_ENABLE_PON;
+	if (first < APDS9960_IDX_PROX)
+		*bits |= APDS9960_REG_ENABLE_AEN;
+	if (test_bit(APDS9960_IDX_PROX, mask))
+		*bits |= APDS9960_REG_ENABLE_PEN;
+
+	return 0;
+}
+
+/* Stop the engines a scan was using, unless events still need them */
+static int apds9960_scan_stop(struct apds9960_data *data)
+{
+	unsigned int bits = 0;
+	int ret;
+
+	mutex_lock(&data->lock);
+
+	/*
+	 * Proximity thresholds keep their engine and interrupt, and the
+	 * gesture engine is entered from proximity cycles.
+	 */
+	if (!data->thresh_en[1]) {
+		bits |= APDS9960_REG_ENABLE_PIEN;
+		if (!data->gesture_dev ||
+		    !iio_buffer_enabled(data->gesture_dev))
+			bits |= APDS9960_REG_ENABLE_PEN;
+	}
+
+	ret = regmap_update_bits(data->regmap, APDS9960_REG_ENABLE, bits, 0);
+	if (!ret)
+		ret = apds9960_als_pers_update(data, false);
+	if (!ret)
+		ret = apds9960_als_idle(data);
+	apds9960_update_period(data);
+
+	mutex_unlock(&data->lock);
+
+	return ret;
+}
+
+static int apds9960_kfifo_buffer_postenable(struct iio_dev *indio_dev)
+{
+	struct apds9960_data *data = iio_priv(indio_dev);
+	unsigned int bits;
+	bool als;
+	int ret;
+
+	ret = apds9960_scan_setup(indio_dev, &bits);
+	if (ret)
+		return ret;
+
+	/*
+	 * A proximity-only scan has no ALS cycle to pace it, so it
+	 * interrupts on PINT.
+	 */
+	als = bits & APDS9960_REG_ENABLE_AEN;
+	bits |= als ? APDS9960_REG_ENABLE_AIEN : APDS9960_REG_ENABLE_PIEN;
+	data->scan_status = als ? APDS9960_REG_STATUS_AINT :
+				  APDS9960_REG_STATUS_PINT;
+
+	/*
+	 * A persistence of 0 interrupts on every completed cycle. One-shot
+	 * captures keep the persistence set up with the threshold events.
+	 */
+	mutex_lock(&data->lock);
+	if (als)
+		ret = apds9960_als_pers_update(data, true);
+	else if (!data->sai)
+		ret = regmap_update_bits(data->regmap, APDS9960_REG_PERS,
+					 APDS9960_REG_PERS_PROX_MASK, 0);
+	else
+		ret = 0;
+	if (!ret)
+		ret = regmap_update_bits(data->regmap, APDS9960_REG_ENABLE,
+					 bits, bits);
+	if (!ret)
+		apds9960_update_period(data);
+	mutex_unlock(&data->lock);
+	if (ret)
+		return ret;
+
+	apds9960_watchdog_kick(data);
+
+	return 0;
+}
+
+static int apds9960_kfifo_buffer_predisable(struct iio_dev *indio_dev)
+{
+	struct apds9960_data *data = iio_priv(indio_dev);
+
+	/* Armed ROC events keep the ALS interrupt, and its watchdog, going */
+	if (!data->roc_rising && !data->roc_falling)
+		cancel_delayed_work_sync(&data->watchdog);
+	apds9960_batch_stop(&data->als_batch);
+
+	return apds9960_scan_stop(data);
+}
+
+static const struct iio_buffer_setup_ops apds9960_kfifo_setup_ops = {
+	.postenable = &apds9960_kfifo_buffer_postenable,
+	.predisable = &apds9960_kfifo_buffer_predisable,
+};
+
+/*
+ * Triggered mode: the engines free-run without interrupts and each
+ * trigger samples the latest completed cycle.
+ */
+static int apds9960_triggered_buffer_postenable(struct iio_dev *indio_dev)
+{
+	struct apds9960_data *data = iio_priv(indio_dev);
+	unsigned int bits;
+	int ret;
+
+	ret = apds9960_scan_setup(indio_dev, &bits);
+	if (ret)
+		return ret;
+
+	mutex_lock(&data->lock);
+	ret = regmap_update_bits(data->regmap, APDS9960_REG_ENABLE,
+				 bits, bits);
+	if (!ret)
+		apds9960_update_period(data);
+	mutex_unlock(&data->lock);
+
+	return ret;
+}
+
+static int apds9960_triggered_buffer_predisable(struct iio_dev *indio_dev)
+{
+	return apds9960_scan_stop(iio_priv(indio_dev));
+}
+
+static const struct iio_buffer_setup_ops apds9960_triggered_setup_ops = {
+	.postenable = &apds9960_triggered_buffer_postenable,
+	.predisable = &apds9960_triggered_buffer_predisable,
+};
+
+static irqreturn_t apds9960_trigger_handler(int irq, void *p)
+{
+	struct iio_poll_func *pf = p;
+	struct iio_dev *indio_dev = pf->indio_dev;
+
+	apds9960_push_scan(indio_dev, pf->timestamp);
+	iio_trigger_notify_done(indio_dev->trig);
+
+	return IRQ_HANDLED;
+}
+
+static struct apds9960_data *apds9960_gesture_data(struct iio_dev *indio_dev)
+{
+	return *(struct apds9960_data **)iio_priv(indio_dev);
+}
+
+static struct apds9960_batch *apds9960_batch_of(struct iio_dev *indio_dev)
+{
+	if (indio_dev->channels == apds9960_gesture_channels)
+		return &apds9960_gesture_data(indio_dev)->gesture_batch;
+
+	return &((struct apds9960_data *)iio_priv(indio_dev))->als_batch;
+}
+
+static int apds9960_gesture_buffer_postenable(struct iio_dev *indio_dev)
+{
+	struct apds9960_data *data = apds9960_gesture_data(indio_dev);
+	int ret;
+
+	/* Interrupt once 4 datasets are queued, then drain them in one go */
+	ret = regmap_update_bits(data->regmap, APDS9960_REG_GCONF_1,
+				 APDS9960_REG_GCONF_1_GFIFO_THRES_MASK,
+				 FIELD_PREP(APDS9960_REG_GCONF_1_GFIFO_THRES_MASK,
+					    1));
+	if (ret)
+		return ret;
+
+	ret = regmap_update_bits(data->regmap, APDS9960_REG_GCONF_4,
+				 APDS9960_REG_GCONF_4_GIEN |
+				 APDS9960_REG_GCONF_4_GFIFO_CLR,
+				 APDS9960_REG_GCONF_4_GIEN |
+				 APDS9960_REG_GCONF_4_GFIFO_CLR);
+	if (ret)
+		return ret;
+
+	/* The gesture engine is entered from a proximity cycle */
+	mutex_lock(&data->lock);
+	ret = regmap_update_bits(data->regmap, APDS9960_REG_ENABLE,
+				 APDS9960_REG_ENABLE_PON |
+				 APDS9960_REG_ENABLE_PEN |
+				 APDS9960_REG_ENABLE_GEN,
+				 APDS9960_REG_ENABLE_PON |
+				 APDS9960_REG_ENABLE_PEN |
+				 APDS9960_REG_ENABLE_GEN);
+	apds9960_update_period(data);
+	mutex_unlock(&data->lock);
+
+	return ret;
+}
+
+static int apds9960_gesture_buffer_predisable(struct iio_dev *indio_dev)
+{
+	struct apds9960_data *data = apds9960_gesture_data(indio_dev);
+	int ret;
+
+	apds9960_batch_stop(&data->gesture_batch);
+
+	mutex_lock(&data->lock);
+	ret = regmap_update_bits(data->regmap, APDS9960_REG_ENABLE,
+				 APDS9960_REG_ENABLE_GEN, 0);
+	apds9960_update_period(data);
+	mutex_unlock(&data->lock);
+	if (ret)
+		return ret;
+
+	return regmap_update_bits(data->regmap, APDS9960_REG_GCONF_4,
+				  APDS9960_REG_GCONF_4_GIEN, 0);
+}
+
+static const struct iio_buffer_setup_ops apds9960_gesture_setup_ops = {
+	.postenable = &apds9960_gesture_buffer_postenable,
+	.predisable = &apds9960_gesture_buffer_predisable,
+};
+
+/*
+ * The IIO core pushes every scan to all buffers attached to a device, so
+ * two buffers on one device can not run at independent rates. Gestures get
+ * a second IIO device instead, with its own kfifo, scan mask, length and
+ * watermark, next to the CRGB/proximity buffer.
+ */
+static int apds9960_gesture_setup(struct apds9960_data *data)
+{
+	struct device *dev = &data->client->dev;
+	struct iio_dev *gesture_dev;
+	int ret;
+
+	if (data->client->irq <= 0)
+		return 0;
+
+	gesture_dev = devm_iio_device_alloc(dev, sizeof(data));
+	if (!gesture_dev)
+		return -ENOMEM;
+
+	*(struct apds9960_data **)iio_priv(gesture_dev) = data;
+	gesture_dev->name = APDS9960_DRV_NAME "-gesture";
+	gesture_dev->channels = apds9960_gesture_channels;
+	gesture_dev->num_channels = ARRAY_SIZE(apds9960_gesture_channels);
+	gesture_dev->info = &apds9960_gesture_info;
+	gesture_dev->modes = INDIO_DIRECT_MODE;
+
+	ret = apds9960_batch_init(dev, &data->gesture_batch, gesture_dev);
+	if (ret)
+		return ret;
+
+	/* Sized by userspace through buffer/length, like the ALS one */
+	ret = devm_iio_kfifo_buffer_setup_ext(dev, gesture_dev,
+					      &apds9960_gesture_setup_ops,
+					      apds9960_batch_attrs);
+	if (ret)
+		return ret;
+
+	ret = devm_iio_device_register(dev, gesture_dev);
+	if (ret)
+		return ret;
+
+	data->gesture_dev = gesture_dev;
+
+	return 0;
+}
+
+static int apds9960_buffer_setup(struct iio_dev *indio_dev)
+{
+	struct apds9960_data *data = iio_priv(indio_dev);
+	struct device *dev = &data->client->dev;
+	int ret;
+
+	if (!kfifo_mode)
+		return devm_iio_triggered_buffer_setup(dev, indio_dev,
+						       iio_pollfunc_store_time,
+						       apds9960_trigger_handler,
+						       &apds9960_triggered_setup_ops);
+
+	/*
+	 * Samples are pushed from the IRQ thread, without a trigger and
+	 * pollfunc in between, so an interrupt line is mandatory.
+	 */
+	if (data->client->irq <= 0)
+		return -EINVAL;
+
+	ret = apds9960_batch_init(dev, &data->als_batch, indio_dev);
+	if (ret)
+		return ret;
+
+	/* The length is left to userspace, through buffer/length */
+	return devm_iio_kfifo_buffer_setup_ext(dev, indio_dev,
+					       &apds9960_kfifo_setup_ops,
+					       apds9960_als_buffer_attrs);
+}
+
+static int apds9960_probe(struct i2c_client *client)
+{
+	struct apds9960_data *data;
+	struct iio_dev *indio_dev;
+	int ret;
+
+	indio_dev = devm_iio_device_alloc(&client->dev, sizeof(*data));
+	if (!indio_dev)
+		return -ENOMEM;
+
+	indio_dev->name = APDS9960_DRV_NAME;
+	indio_dev->channels = apds9960_channels;
+	indio_dev->num_channels = ARRAY_SIZE(apds9960_channels);
+	indio_dev->info = &apds9960_info;
+	indio_dev->modes = INDIO_DIRECT_MODE;
+	i2c_set_clientdata(client, indio_dev);
+
+	data = iio_priv(indio_dev);
+	data->client = client;
+	data->indio_dev = indio_dev;
+	mutex_init(&data->lock);
+	data->roc_delta = 1000;
+	data->roc_period_us = 500000;
+
+	data->regmap = devm_regmap_init_i2c(client, &apds9960_regmap_config);
+	if (IS_ERR(data->regmap)) {
+		ret = PTR_ERR(data->regmap);
+		dev_err(&client->dev, "Failed to initialize register map: %d\n",
+			ret);
+		return ret;
+	}
+
+	ret = regmap_write(data->regmap, APDS9960_REG_ATIME, 0xff);
+	if (ret) {
+		dev_err(&client->dev, "Failed to write ATIME register: %d\n",
+			ret);
+		return ret;
+	}
+
+	mutex_lock(&data->lock);
+	apds9960_update_period(data);
+	mutex_unlock(&data->lock);
+
+	ret = apds9960_load_calibration(data);
+	if (ret)
+		return dev_err_probe(&client->dev, ret,
+				     "Failed to load calibration\n");
+
+	INIT_DELAYED_WORK(&data->watchdog, apds9960_watchdog_work);
+	ret = devm_add_action_or_reset(&client->dev, apds9960_watchdog_cancel,
+				       data);
+	if (ret)
 		return ret;
+
+	if (prox_calibrate) {
+		ret = apds9960_prox_calibrate(data);
+		if (ret)
+			dev_warn(&client->dev,
+				 "Proximity calibration failed: %d\n", ret);
+	}
+
+	/* Saturation is reported on the interrupt line, if there is one */
+	if (client->irq > 0) {
+		ret = regmap_update_bits(data->regmap, APDS9960_REG_CONFIG_2,
+					 APDS9960_REG_CONFIG_2_CPSIEN |
+					 APDS9960_REG_CONFIG_2_PSIEN,
+					 APDS9960_REG_CONFIG_2_CPSIEN |
+					 APDS9960_REG_CONFIG_2_PSIEN);
+		if (ret) {
+			dev_err(&client->dev,
+				"Failed to enable saturation interrupts: %d\n",
+				ret);
+			return ret;
+		}
 	}
 
-	
+	ret = apds9960_buffer_setup(indio_dev);
+	if (ret) {
+		dev_err(&client->dev, "Failed to setup buffer: %d\n", ret);
+		return ret;
+	}
 
-	ret = iio_triggered_event_setup(indio_dev, 0,
-					&apds9960_als_write_event_config,
-					&apds9960_als_read_event_config);
+	ret = apds9960_gesture_setup(data);
 	if (ret) {
-		dev_err(&client->dev,
-			"Failed to setup trigger event: %d\n", ret);
+		dev_err(&client->dev, "Failed to setup gesture buffer: %d\n",
+			ret);
 		return ret;
 	}
 
 	ret = devm_request_threaded_irq(&client->dev, client->irq,
-					NULL, apds9960_als_irq_handler,
+					NULL, apds9960_irq_handler,
 					IRQF_TRIGGER_FALLING |
 					IRQF_ONESHOT,
 					APDS9960_DRV_NAME, indio_dev);
@@ -353,17 +3006,13 @@ static int apds9960_probe(struct i2c_client *client)
 	return ret;
 }
 
-static int apds9960_remove(struct i2c_client *client)
+static void apds9960_remove(struct i2c_client *client)
 {
 	struct iio_dev *indio_dev = i2c_get_clientdata(client);
 
-	iio_triggered_event_cleanup(indio_dev);
-
 	iio_device_unregister(indio_dev);
 	pm_runtime_disable(&client->dev);
 	pm_runtime_put_noidle(&client->dev);
-
-	return 0;
 }
 
 static const struct acpi_device_id apds9960_acpi_match[] = {
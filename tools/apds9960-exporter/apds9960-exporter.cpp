@@ -0,0 +1,340 @@
+/*
+ * apds9960-exporter - keep rolling 1 s / 1 min / 1 h aggregates of the
+ * apds9960 stream and serve them as Prometheus text exposition.
+ *
+ * Each sample costs one bucket update per channel, and a scrape folds a
+ * fixed number of buckets, so serving the page does not depend on the
+ * sample rate. The page is
+ * written to every client connecting to the Unix socket (-u), and/or
+ * rewritten once a second into a file (-f) for node_exporter's textfile
+ * collector.
+ */
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <getopt.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../libapds9960/metrics.h"
+#include "../libapds9960/shm_ring.h"
+#include "../libapds9960/stream.h"
+#include "../libapds9960/sysfs.h"
+
+using namespace apds9960;
+
+#define APDS9960_EXPORTER_SOCKET	"/run/apds9960-exporter.sock"
+#define APDS9960_EXPORTER_TICK_MS	100
+
+/* One ALS integration cycle, and ATIME 0xff as set up at probe */
+#define APDS9960_CYCLE_STEP_US		2780
+#define APDS9960_DEFAULT_CYCLES		1
+
+/* Driver counters exported as-is when the running driver provides them */
+static const char *const driver_stats[] = {
+	"i2c_retries",
+	"i2c_recoveries",
+	"i2c_failed_reads",
+	"watchdog_recoveries",
+};
+
+struct exporter {
+	std::vector<std::string> names;
+	std::vector<int> chans;
+	std::vector<int64_t> full_scale;
+	/* Colour channels, whose full scale follows the integration time */
+	std::vector<bool> als;
+	std::vector<metric_windows> series;
+	metric_windows events;
+	/* Event counter of the daemon in -s mode, as of the last tick */
+	uint64_t shm_events = 0;
+	std::string dev_dir;
+
+	void setup(const scan_layout &l);
+	void update_full_scale();
+	void add(const batch &b);
+	std::string page();
+};
+
+static int64_t now_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void exporter::setup(const scan_layout &l)
+{
+	for (std::size_t i = 0; i < l.num_channels(); i++) {
+		const scan_channel &ch = l.channel(i);
+		std::string n = ch.name;
+
+		if ((int)i == l.timestamp_channel())
+			continue;
+		if (!n.compare(0, 3, "in_"))
+			n = n.substr(3);
+
+		names.push_back("apds9960_" + n);
+		chans.push_back(i);
+		/* A reading at the top of the channel's range is clipped */
+		full_scale.push_back(ch.is_signed ? (1LL << (ch.bits - 1)) - 1 :
+				     (int64_t)ch.mask);
+		als.push_back(n == "intensity_clear" || n == "intensity_red" ||
+			      n == "intensity_green" || n == "intensity_blue");
+	}
+	series.resize(chans.size());
+	update_full_scale();
+}
+
+/*
+ * The ALS ADC saturates at 1025 counts per integration cycle, well below
+ * 65535 for short integration times. Follow the driver's integration time
+ * (it changes under AGC), assuming the probe default when it can't be read.
+ */
+void exporter::update_full_scale()
+{
+	long long cycles = APDS9960_DEFAULT_CYCLES;
+	std::string v;
+
+	if (!dev_dir.empty() &&
+	    !sysfs_read(dev_dir + "/in_intensity_integration_time", v)) {
+		double t = strtod(v.c_str(), NULL);
+
+		if (t > 0)
+			cycles = (long long)(t * 1000000 /
+					     APDS9960_CYCLE_STEP_US + 0.5);
+	}
+	cycles = std::min(std::max(cycles, 1LL), 256LL);
+
+	for (std::size_t i = 0; i < chans.size(); i++)
+		if (als[i])
+			full_scale[i] = std::min(65535LL, 1025 * cycles);
+}
+
+void exporter::add(const batch &b)
+{
+	/* One clock read per batch: a batch always lands in one bucket */
+	int64_t now = now_ns();
+
+	for (sample s : b) {
+		for (std::size_t i = 0; i < chans.size(); i++) {
+			int64_t v = s.value(chans[i]);
+
+			series[i].add(now, v, v >= full_scale[i]);
+		}
+	}
+}
+
+std::string exporter::page()
+{
+	int64_t now = now_ns();
+	std::string out;
+
+	for (std::size_t i = 0; i < series.size(); i++)
+		series[i].expose(out, names[i], now);
+	events.expose_events(out, "apds9960_iio", now);
+
+	for (const char *attr : driver_stats) {
+		long long v;
+
+		if (dev_dir.empty() ||
+		    sysfs_read_int(dev_dir + "/" + attr, v))
+			continue;
+		out += "apds9960_" + std::string(attr) + " " +
+		       std::to_string(v) + "\n";
+	}
+
+	return out;
+}
+
+static int write_file(const char *path, const std::string &s)
+{
+	std::string tmp = std::string(path) + ".tmp";
+	FILE *f;
+
+	f = fopen(tmp.c_str(), "w");
+	if (!f)
+		return -errno;
+	fwrite(s.data(), 1, s.size(), f);
+	if (fclose(f))
+		return -errno;
+
+	/* Scrapers must never see a half-written page */
+	return rename(tmp.c_str(), path) ? -errno : 0;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [-d iio_dir | -s socket] [-u listen_socket] [-f file]\n",
+		prog);
+}
+
+int main(int argc, char **argv)
+{
+	const char *sock = NULL, *listen_path = NULL, *file = NULL;
+	std::string dev_dir;
+	struct itimerspec its = {};
+	struct sockaddr_un addr = {};
+	device_config cfg;
+	shm_consumer shm;
+	event_loop loop;
+	stream_handlers h;
+	exporter exp;
+	device dev;
+	stream st;
+	sigset_t mask;
+	unsigned int ticks = 0;
+	int opt, ret, lfd = -1, tfd, sfd;
+
+	while ((opt = getopt(argc, argv, "d:s:u:f:h")) != -1) {
+		switch (opt) {
+		case 'd':
+			dev_dir = optarg;
+			break;
+		case 's':
+			sock = optarg;
+			break;
+		case 'u':
+			listen_path = optarg;
+			break;
+		case 'f':
+			file = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	if (!listen_path && !file)
+		listen_path = APDS9960_EXPORTER_SOCKET;
+
+	ret = loop.init();
+	if (ret)
+		goto err;
+
+	if (sock) {
+		ret = shm.connect(sock);
+		if (ret)
+			goto err;
+		/* The daemon owns the buffer; the sysfs stats are still ours */
+		if (dev_dir.empty())
+			device::find(dev_dir);
+		exp.dev_dir = dev_dir;
+		exp.setup(shm.layout());
+		exp.shm_events = shm.events();
+	} else {
+		cfg.nonblock = true;
+		ret = dev.open(cfg, dev_dir);
+		if (ret)
+			goto err;
+		dev_dir = dev.dir();
+		exp.dev_dir = dev_dir;
+		exp.setup(dev.layout());
+
+		h.on_batch = [&exp](const batch &b) { exp.add(b); };
+		h.on_event = [&exp](span<const struct iio_event_data> evs) {
+			int64_t now = now_ns();
+
+			for (std::size_t i = 0; i < evs.size(); i++)
+				exp.events.add_event(now);
+		};
+		ret = st.attach(loop, dev, h);
+		if (ret)
+			goto err;
+		st.drain_buffer();
+	}
+
+	if (listen_path) {
+		if (strlen(listen_path) >= sizeof(addr.sun_path)) {
+			ret = -ENAMETOOLONG;
+			goto err;
+		}
+		lfd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK |
+			     SOCK_CLOEXEC, 0);
+		addr.sun_family = AF_UNIX;
+		strcpy(addr.sun_path, listen_path);
+		unlink(listen_path);
+		if (lfd < 0 || bind(lfd, (struct sockaddr *)&addr,
+				    sizeof(addr)) || listen(lfd, 16)) {
+			ret = -errno;
+			goto err;
+		}
+
+		loop.add(lfd, EPOLLIN, [&exp, lfd](uint32_t) {
+			int fd;
+
+			while ((fd = accept4(lfd, NULL, NULL,
+					     SOCK_CLOEXEC)) >= 0) {
+				std::string p = exp.page();
+
+				send(fd, p.data(), p.size(), MSG_NOSIGNAL);
+				close(fd);
+			}
+		});
+	}
+
+	/* Coarse tick: drains the shm ring and refreshes the file */
+	tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	its.it_interval.tv_nsec = APDS9960_EXPORTER_TICK_MS * 1000000L;
+	its.it_value = its.it_interval;
+	timerfd_settime(tfd, 0, &its, NULL);
+	loop.add(tfd, EPOLLIN, [&](uint32_t) {
+		uint64_t n;
+		batch b;
+
+		if (read(tfd, &n, sizeof(n)) < 0)
+			return;
+
+		/*
+		 * The daemon holds the event fd; its counter is only sampled
+		 * here, so events land in the bucket of the tick that saw them.
+		 */
+		if (sock) {
+			uint64_t ev = shm.events();
+
+			while (shm.read(b, 4096, 0) > 0)
+				exp.add(b);
+			if (ev != exp.shm_events)
+				exp.events.add_event(now_ns(),
+						     ev - exp.shm_events);
+			exp.shm_events = ev;
+		}
+
+		if (++ticks % (1000 / APDS9960_EXPORTER_TICK_MS))
+			return;
+
+		exp.update_full_scale();
+		if (file)
+			write_file(file, exp.page());
+	});
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	sigprocmask(SIG_BLOCK, &mask, NULL);
+	sfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	loop.add(sfd, EPOLLIN, [&loop](uint32_t) { loop.stop(); });
+
+	ret = loop.run();
+
+err:
+	if (ret)
+		fprintf(stderr, "apds9960-exporter: %s\n", strerror(-ret));
+	if (lfd >= 0) {
+		close(lfd);
+		unlink(listen_path);
+	}
+
+	return ret ? 1 : 0;
+}
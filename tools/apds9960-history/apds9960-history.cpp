@@ -0,0 +1,132 @@
+/*
+ * apds9960-history - load recordings into a long-term history store and
+ * answer range queries from it.
+ *
+ *   apds9960-history import <store> <recording> [integration_us [gain]]
+ *   apds9960-history query <store> <t0> <t1> [max_points]
+ *
+ * The store holds illuminance in milli-lux, converted from the clear, red,
+ * green and blue counts of the recording with the integration time and
+ * gain it was taken at (the driver defaults unless given). Timestamps are
+ * the IIO timestamps of the recording, in nanoseconds.
+ */
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "../libapds9960/convert.h"
+#include "../libapds9960/history.h"
+#include "../libapds9960/record.h"
+
+using namespace apds9960;
+
+/* ATIME 0xff (one 2.78 ms cycle) and 1x gain, as set up at probe */
+#define APDS9960_HIST_DEFAULT_ATIME_US	2780
+#define APDS9960_HIST_DEFAULT_GAIN	1
+
+static int import(const char *store, const char *path,
+		  unsigned int atime_us, unsigned int gain)
+{
+	std::vector<uint32_t> mlux;
+	std::vector<int32_t> cct;
+	convert_params p;
+	record_reader r;
+	crgb_block blk;
+	history h;
+	batch b;
+	std::size_t i;
+	int ret;
+
+	ret = convert_prepare(p, atime_us, gain);
+	if (ret)
+		return ret;
+
+	ret = r.open(path);
+	if (ret)
+		return ret;
+
+	if (r.layout().timestamp_channel() < 0)
+		return -EINVAL;
+
+	ret = h.open(store);
+	if (ret)
+		return ret;
+
+	while ((ret = r.next(b)) > 0) {
+		blk.clear();
+		ret = blk.append(b);
+		if (ret)
+			return ret;
+
+		mlux.resize(blk.size());
+		cct.resize(blk.size());
+		convert_batch(p, blk.c.data(), blk.r.data(), blk.g.data(),
+			      blk.b.data(), mlux.data(), cct.data(),
+			      blk.size());
+
+		i = 0;
+		for (sample s : b) {
+			ret = h.append(s.timestamp(), mlux[i++]);
+			if (ret)
+				return ret;
+		}
+	}
+
+	return ret;
+}
+
+static int query(const char *store, long long t0, long long t1,
+		 unsigned long max_points)
+{
+	std::vector<hist_summary> out;
+	history h;
+	int ret;
+
+	ret = h.open(store);
+	if (ret)
+		return ret;
+
+	ret = h.query(t0, t1, max_points, out);
+	if (ret < 0)
+		return ret;
+
+	printf("first_ts,last_ts,count,min,mean,max\n");
+	for (const hist_summary &s : out)
+		printf("%lld,%lld,%llu,%lld,%lld,%lld\n",
+		       (long long)s.first_ts, (long long)s.last_ts,
+		       (unsigned long long)s.count, (long long)s.min,
+		       (long long)s.mean(), (long long)s.max);
+
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	int ret;
+
+	if (argc >= 4 && !strcmp(argv[1], "import")) {
+		ret = import(argv[2], argv[3],
+			     argc > 4 ? strtoul(argv[4], NULL, 0) :
+					APDS9960_HIST_DEFAULT_ATIME_US,
+			     argc > 5 ? strtoul(argv[5], NULL, 0) :
+					APDS9960_HIST_DEFAULT_GAIN);
+	} else if (argc >= 5 && !strcmp(argv[1], "query")) {
+		ret = query(argv[2], strtoll(argv[3], NULL, 0),
+			    strtoll(argv[4], NULL, 0),
+			    argc > 5 ? strtoul(argv[5], NULL, 0) : 1000);
+	} else {
+		fprintf(stderr,
+			"Usage: %s import <store> <recording> [integration_us [gain]]\n"
+			"       %s query <store> <t0> <t1> [max_points]\n",
+			argv[0], argv[0]);
+		return 1;
+	}
+
+	if (ret < 0) {
+		fprintf(stderr, "%s: %s\n", argv[1], strerror(-ret));
+		return 1;
+	}
+
+	return 0;
+}
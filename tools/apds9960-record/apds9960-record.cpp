@@ -0,0 +1,149 @@
+/*
+ * apds9960-record - capture the apds9960 stream into the compact chunked
+ * recording format (see record.h), or print a recording back as CSV.
+ *
+ * Samples come straight from the IIO buffer, or from apds9960d when -s is
+ * given so that recording does not take the buffer away from other users.
+ */
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <getopt.h>
+
+#include "../libapds9960/device.h"
+#include "../libapds9960/record.h"
+#include "../libapds9960/shm_ring.h"
+
+using namespace apds9960;
+
+static volatile sig_atomic_t stop;
+
+static void on_signal(int sig)
+{
+	(void)sig;
+	stop = 1;
+}
+
+static int print_csv(const char *path)
+{
+	record_reader r;
+	batch b;
+	int ret;
+
+	ret = r.open(path);
+	if (ret)
+		return ret;
+
+	for (std::size_t i = 0; i < r.layout().num_channels(); i++)
+		printf("%s%s", i ? "," : "", r.layout().channel(i).name.c_str());
+	printf("\n");
+
+	while ((ret = r.next(b)) > 0) {
+		for (sample s : b) {
+			for (std::size_t i = 0; i < r.layout().num_channels(); i++)
+				printf("%s%lld", i ? "," : "",
+				       (long long)s.value(i));
+			printf("\n");
+		}
+	}
+
+	return ret;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [-d iio_dir | -s socket] [-c chunk] [-n samples] -o file\n"
+		"       %s -p file\n", prog, prog);
+}
+
+int main(int argc, char **argv)
+{
+	const char *out = NULL, *sock = NULL, *dev_dir = "";
+	unsigned long long limit = 0, total = 0;
+	unsigned int chunk = 4096;
+	record_writer w;
+	shm_consumer shm;
+	device_config cfg;
+	device dev;
+	batch b;
+	int opt, ret;
+
+	while ((opt = getopt(argc, argv, "d:s:c:n:o:p:h")) != -1) {
+		switch (opt) {
+		case 'd':
+			dev_dir = optarg;
+			break;
+		case 's':
+			sock = optarg;
+			break;
+		case 'c':
+			chunk = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			limit = strtoull(optarg, NULL, 0);
+			break;
+		case 'o':
+			out = optarg;
+			break;
+		case 'p':
+			ret = print_csv(optarg);
+			if (ret < 0)
+				fprintf(stderr, "%s: %s\n", optarg,
+					strerror(-ret));
+			return ret < 0;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	if (!out) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+
+	ret = sock ? shm.connect(sock) : dev.open(cfg, dev_dir);
+	if (ret) {
+		fprintf(stderr, "Failed to open source: %s\n", strerror(-ret));
+		return 1;
+	}
+
+	ret = w.open(out, sock ? shm.layout() : dev.layout(), chunk);
+	if (ret) {
+		fprintf(stderr, "%s: %s\n", out, strerror(-ret));
+		return 1;
+	}
+
+	while (!stop && (!limit || total < limit)) {
+		ret = sock ? shm.read(b, 256, 1000) : dev.read(b);
+		if (ret == -EINTR || ret == 0)
+			continue;
+		if (ret < 0)
+			break;
+
+		ret = w.write(b);
+		if (ret)
+			break;
+		total += b.size();
+	}
+
+	if (ret < 0 && ret != -EINTR)
+		fprintf(stderr, "Recording stopped: %s\n", strerror(-ret));
+
+	ret = w.close();
+	if (ret) {
+		fprintf(stderr, "%s: %s\n", out, strerror(-ret));
+		return 1;
+	}
+
+	fprintf(stderr, "%llu samples, %llu bytes\n", total,
+		(unsigned long long)w.bytes_written());
+
+	return 0;
+}
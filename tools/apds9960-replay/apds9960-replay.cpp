@@ -0,0 +1,315 @@
+/*
+ * apds9960-replay - play a recording back to the normal consumers, or
+ * compare two recordings.
+ *
+ *   apds9960-replay [-x speed] [-l] [-s socket] recording
+ *	Serve the recording on an apds9960d style socket, paced by its own
+ *	timestamps (-x 10 is ten times real time, -x 0 as fast as possible).
+ *	Consumers built on shm_consumer, apds9960-record -s included, attach
+ *	to it exactly as they would to the live daemon. The samples bypass
+ *	the driver, so only consumer-side processing is reproduced.
+ *
+ *   apds9960-replay -r /dev/i2c-N [-a addr] [-g pull | -T trigger_now]
+ *		     [-x speed] [-l] recording
+ *	Feed the recording to the real driver instead, through the registers
+ *	of an i2c-stub chip (see reg_replay.h). With -g the interrupt is a
+ *	gpio-sim line wired to the client, driven through the line's 'pull'
+ *	attribute; each sample then waits for the driver's AICLEAR, so -x 0
+ *	runs as fast as the driver keeps up. With -T the driver runs off a
+ *	sysfs trigger (kfifo_mode=0) that is fired after every sample.
+ *	Capture the driver's buffer with apds9960-record meanwhile and diff
+ *	the result against the original with -c.
+ *
+ *   apds9960-replay -r /dev/i2c-N [-a addr] -i
+ *	Load the power-on registers (ID, STATUS, data) so the driver can
+ *	be bound to the stub:
+ *	  modprobe i2c-stub chip_addr=0x39
+ *	  apds9960-replay -r /dev/i2c-N -i
+ *	  echo apds9960 0x39 > /sys/bus/i2c/devices/i2c-N/new_device
+ *
+ *   apds9960-replay -c [-t tolerance] original other
+ *	Diff two recordings, e.g. a capture against its replayed re-capture.
+ */
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <getopt.h>
+#include <unistd.h>
+
+#include "../libapds9960/reg_replay.h"
+#include "../libapds9960/replay.h"
+#include "../libapds9960/shm_ring.h"
+
+using namespace apds9960;
+
+#define APDS9960_REPLAY_SOCKET	"/run/apds9960-replay.sock"
+
+static replay *active;
+
+static void on_signal(int sig)
+{
+	(void)sig;
+	if (active)
+		active->stop();
+}
+
+static int compare(const char *a, const char *b, long long tolerance)
+{
+	record_reader ra, rb;
+	diff_result res;
+	int ret;
+
+	ret = ra.open(a);
+	if (!ret)
+		ret = rb.open(b);
+	if (!ret)
+		ret = replay_diff(ra, rb, tolerance, res);
+	if (ret)
+		return ret;
+
+	printf("compared %llu, mismatched %llu\n",
+	       (unsigned long long)res.compared,
+	       (unsigned long long)res.mismatched);
+	if (res.first_sample >= 0)
+		printf("first mismatch at sample %lld%s%s\n",
+		       (long long)res.first_sample,
+		       res.first_channel >= 0 ? ", channel " : "",
+		       res.first_channel >= 0 ?
+		       ra.layout().channel(res.first_channel).name.c_str() : "");
+
+	return res.mismatched ? 1 : 0;
+}
+
+static int write_attr(const char *path, const char *val)
+{
+	FILE *f = fopen(path, "w");
+	int ret = 0;
+
+	if (!f)
+		return -errno;
+	if (fputs(val, f) == EOF)
+		ret = -errno;
+	if (fclose(f) && !ret)
+		ret = -errno;
+
+	return ret;
+}
+
+static reg_target stub_target(i2c_stub &stub)
+{
+	reg_target t;
+
+	t.read = [&stub](uint8_t reg, uint8_t &val) {
+		return stub.read(reg, val);
+	};
+	t.write = [&stub](uint8_t reg, uint8_t val) {
+		return stub.write(reg, val);
+	};
+
+	return t;
+}
+
+/* Drive the driver through the stub's registers instead of the ring */
+static int replay_registers(replay &rp, const replay_config &cfg,
+			    i2c_stub &stub, const scan_layout &layout,
+			    const char *pull, const char *trigger)
+{
+	reg_target t = stub_target(stub);
+	int ret;
+
+	/* The line is active low, IRQF_TRIGGER_FALLING in the driver */
+	if (pull)
+		t.irq = [pull](bool asserted) {
+			return write_attr(pull, asserted ? "pull-down" :
+							   "pull-up");
+		};
+	if (trigger)
+		t.trigger = [trigger]() {
+			/* The poll runs from irq_work, give it time to read */
+			int ret = write_attr(trigger, "1");
+
+			usleep(1000);
+			return ret;
+		};
+
+	register_replay chip(t);
+
+	ret = chip.setup(layout);
+	if (ret)
+		return ret;
+
+	ret = rp.run(cfg, [&chip](const batch &b) {
+		return chip.present(b);
+	});
+
+	fprintf(stderr, "%llu cycles, %llu interrupts, %llu not acknowledged\n",
+		(unsigned long long)chip.cycles(),
+		(unsigned long long)chip.interrupts(),
+		(unsigned long long)chip.missed_acks());
+
+	return ret;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [-x speed] [-l] [-s socket] recording\n"
+		"       %s -r i2c-dev [-a addr] [-g pull | -T trigger_now]"
+		" [-x speed] [-l] recording\n"
+		"       %s -r i2c-dev [-a addr] -i\n"
+		"       %s -c [-t tolerance] original other\n",
+		prog, prog, prog, prog);
+}
+
+int main(int argc, char **argv)
+{
+	const char *sock = APDS9960_REPLAY_SOCKET;
+	const char *i2c = NULL, *pull = NULL, *trigger = NULL;
+	unsigned int addr = 0x39;
+	long long tolerance = 0;
+	bool diff = false, init = false;
+	i2c_stub stub;
+	replay_config cfg;
+	shm_producer ring;
+	record_reader r;
+	int opt, ret, lfd;
+
+	while ((opt = getopt(argc, argv, "x:ls:ct:r:a:g:T:ih")) != -1) {
+		switch (opt) {
+		case 'x':
+			cfg.speed = strtod(optarg, NULL);
+			break;
+		case 'l':
+			cfg.loop = true;
+			break;
+		case 's':
+			sock = optarg;
+			break;
+		case 'c':
+			diff = true;
+			break;
+		case 't':
+			tolerance = strtoll(optarg, NULL, 0);
+			break;
+		case 'r':
+			i2c = optarg;
+			break;
+		case 'a':
+			addr = strtoul(optarg, NULL, 0);
+			break;
+		case 'g':
+			pull = optarg;
+			break;
+		case 'T':
+			trigger = optarg;
+			break;
+		case 'i':
+			init = true;
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	if (diff) {
+		if (argc - optind != 2) {
+			usage(argv[0]);
+			return 1;
+		}
+		ret = compare(argv[optind], argv[optind + 1], tolerance);
+		if (ret < 0)
+			fprintf(stderr, "compare: %s\n", strerror(-ret));
+		return ret ? 1 : 0;
+	}
+
+	if (i2c) {
+		ret = stub.open(i2c, addr);
+		if (ret) {
+			fprintf(stderr, "%s: %s\n", i2c, strerror(-ret));
+			return 1;
+		}
+	}
+
+	if (init) {
+		if (!i2c) {
+			usage(argv[0]);
+			return 1;
+		}
+
+		ret = register_replay(stub_target(stub)).reset();
+		if (ret)
+			fprintf(stderr, "%s: %s\n", i2c, strerror(-ret));
+		return ret ? 1 : 0;
+	}
+
+	if (argc - optind != 1 || (pull && trigger) ||
+	    (i2c && !pull && !trigger)) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	ret = r.open(argv[optind]);
+	if (ret) {
+		fprintf(stderr, "%s: %s\n", argv[optind], strerror(-ret));
+		return 1;
+	}
+
+	replay rp(r);
+
+	active = &rp;
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+
+	if (i2c) {
+		ret = replay_registers(rp, cfg, stub, r.layout(), pull,
+				       trigger);
+		fprintf(stderr, "replayed %llu samples\n",
+			(unsigned long long)rp.samples());
+		if (ret) {
+			fprintf(stderr, "replay: %s\n", strerror(-ret));
+			return 1;
+		}
+		return 0;
+	}
+
+	ret = ring.create(r.layout(), 4096);
+	if (ret) {
+		fprintf(stderr, "%s: %s\n", argv[optind], strerror(-ret));
+		return 1;
+	}
+
+	lfd = ring.listen(sock);
+	if (lfd < 0) {
+		fprintf(stderr, "Failed to listen on %s: %s\n", sock,
+			strerror(-lfd));
+		return 1;
+	}
+
+	/* Give consumers two seconds to attach before samples start */
+	for (int i = 0; i < 20; i++) {
+		ring.accept_consumers(lfd);
+		usleep(100000);
+	}
+
+	ret = rp.run(cfg, [&ring, lfd](const batch &b) {
+		ring.accept_consumers(lfd);
+		ring.publish(b);
+		return 0;
+	});
+
+	fprintf(stderr, "replayed %llu samples\n",
+		(unsigned long long)rp.samples());
+
+	unlink(sock);
+	close(lfd);
+
+	if (ret) {
+		fprintf(stderr, "replay: %s\n", strerror(-ret));
+		return 1;
+	}
+
+	return 0;
+}
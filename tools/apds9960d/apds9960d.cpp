@@ -0,0 +1,144 @@
+/*
+ * apds9960d - own the apds9960 IIO buffer and fan it out to any number of
+ * local consumers through a shared memory ring.
+ *
+ * Consumers connect to the Unix socket, receive a read-only fd of the
+ * ring's memfd over SCM_RIGHTS and from then on read at memory speed
+ * without talking to the daemon again (see shm_consumer in libapds9960).
+ * The socket is mode 0660, so -g picks the group allowed to read.
+ */
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <getopt.h>
+#include <grp.h>
+#include <sys/signalfd.h>
+#include <unistd.h>
+
+#include "../libapds9960/device.h"
+#include "../libapds9960/event_loop.h"
+#include "../libapds9960/shm_ring.h"
+#include "../libapds9960/stream.h"
+
+using namespace apds9960;
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [-d iio_dir] [-s socket] [-g group] [-n slots]"
+		" [-w watermark]\n",
+		prog);
+}
+
+int main(int argc, char **argv)
+{
+	const char *sock_path = APDS9960_SHM_SOCKET;
+	std::string dev_dir;
+	unsigned int nr_slots = 4096;
+	gid_t gid = (gid_t)-1;
+	struct group *gr;
+	device_config cfg;
+	shm_producer ring;
+	event_loop loop;
+	stream st;
+	stream_handlers h;
+	device dev;
+	sigset_t mask;
+	int opt, ret, lfd, sfd;
+
+	cfg.nonblock = true;
+
+	while ((opt = getopt(argc, argv, "d:s:g:n:w:h")) != -1) {
+		switch (opt) {
+		case 'd':
+			dev_dir = optarg;
+			break;
+		case 's':
+			sock_path = optarg;
+			break;
+		case 'g':
+			gr = getgrnam(optarg);
+			if (!gr) {
+				fprintf(stderr, "Unknown group %s\n", optarg);
+				return 1;
+			}
+			gid = gr->gr_gid;
+			break;
+		case 'n':
+			nr_slots = strtoul(optarg, NULL, 0);
+			break;
+		case 'w':
+			cfg.watermark = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	ret = dev.open(cfg, dev_dir);
+	if (ret) {
+		fprintf(stderr, "Failed to open device: %s\n", strerror(-ret));
+		return 1;
+	}
+
+	ret = ring.create(dev.layout(), nr_slots);
+	if (ret) {
+		fprintf(stderr, "Failed to create ring: %s\n", strerror(-ret));
+		return 1;
+	}
+
+	lfd = ring.listen(sock_path, 0660, gid);
+	if (lfd < 0) {
+		fprintf(stderr, "Failed to listen on %s: %s\n", sock_path,
+			strerror(-lfd));
+		return 1;
+	}
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	sigprocmask(SIG_BLOCK, &mask, NULL);
+	sfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+
+	ret = loop.init();
+	if (ret)
+		goto out;
+
+	loop.add(sfd, EPOLLIN, [&loop](uint32_t) { loop.stop(); });
+
+	loop.add(lfd, EPOLLIN, [&ring, lfd](uint32_t) {
+		ring.accept_consumers(lfd);
+	});
+
+	h.on_batch = [&ring](const batch &b) { ring.publish(b); };
+	/* Holding the event fd is ours alone, so count them for consumers */
+	h.on_event = [&ring](span<const struct iio_event_data> evs) {
+		ring.count_events(evs.size());
+	};
+	h.on_error = [&loop](int err) {
+		fprintf(stderr, "Buffer read failed: %s\n", strerror(-err));
+		loop.stop();
+	};
+
+	ret = st.attach(loop, dev, h);
+	if (ret)
+		goto out;
+
+	/* Pick up anything queued before the fd was added to epoll */
+	st.drain_buffer();
+
+	ret = loop.run();
+
+out:
+	if (ret)
+		fprintf(stderr, "apds9960d: %s\n", strerror(-ret));
+	st.detach();
+	unlink(sock_path);
+	close(lfd);
+	close(sfd);
+
+	return ret ? 1 : 0;
+}
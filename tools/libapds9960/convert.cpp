@@ -0,0 +1,269 @@
+#include "convert.h"
+
+#include <cerrno>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+/*
+ * The NEON kernel has not been checked against convert_one() on real
+ * hardware yet, so it stays out unless asked for with -DAPDS9960_NEON.
+ */
+#if defined(__aarch64__) && defined(APDS9960_NEON)
+#define APDS9960_HAVE_NEON
+#include <arm_neon.h>
+#endif
+
+namespace apds9960 {
+
+#define APDS9960_COEF_MAX	8191
+
+int convert_prepare(convert_params &p, unsigned int atime_us,
+		    unsigned int gain)
+{
+	uint64_t mult;
+
+	if (!atime_us || !gain)
+		return -EINVAL;
+	if (p.r_coef < -APDS9960_COEF_MAX || p.r_coef > APDS9960_COEF_MAX ||
+	    p.g_coef < -APDS9960_COEF_MAX || p.g_coef > APDS9960_COEF_MAX ||
+	    p.b_coef < -APDS9960_COEF_MAX || p.b_coef > APDS9960_COEF_MAX ||
+	    p.ct_coef < -APDS9960_COEF_MAX || p.ct_coef > APDS9960_COEF_MAX)
+		return -ERANGE;
+
+	/* milli-lux = G'' (milli) * GA (milli) * DF / (ATIME_us * AGAIN) */
+	mult = ((uint64_t)p.ga_df << 16) / ((uint64_t)atime_us * gain);
+	if (mult > UINT32_MAX)
+		return -ERANGE;
+	p.lux_mult = mult;
+
+	return 0;
+}
+
+static void convert_batch_scalar(const convert_params &p, const uint16_t *c,
+				 const uint16_t *r, const uint16_t *g,
+				 const uint16_t *b, uint32_t *mlux,
+				 int32_t *cct, std::size_t n)
+{
+	for (std::size_t i = 0; i < n; i++)
+		convert_one(p, c[i], r[i], g[i], b[i], &mlux[i], &cct[i]);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/*
+ * Integer division has no AVX2 instruction, so CCT divides in double
+ * precision: the dividend stays below 2^29 and the divisor below 2^16,
+ * which leaves the truncated double quotient exactly equal to the integer
+ * one. The same holds for the NEON path.
+ */
+__attribute__((target("avx2")))
+static void convert_batch_avx2(const convert_params &p, const uint16_t *c,
+			       const uint16_t *r, const uint16_t *g,
+			       const uint16_t *b, uint32_t *mlux,
+			       int32_t *cct, std::size_t n)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i rc = _mm256_set1_epi32(p.r_coef);
+	const __m256i gc = _mm256_set1_epi32(p.g_coef);
+	const __m256i bc = _mm256_set1_epi32(p.b_coef);
+	const __m256i ctc = _mm256_set1_epi32(p.ct_coef);
+	const __m256i cto = _mm256_set1_epi32(p.ct_offset);
+	const __m256i mult = _mm256_set1_epi32(p.lux_mult);
+	const __m256i sat = _mm256_set1_epi64x(UINT32_MAX);
+	std::size_t i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		__m256i vc = _mm256_cvtepu16_epi32(
+			_mm_loadu_si128((const __m128i *)(c + i)));
+		__m256i vr = _mm256_cvtepu16_epi32(
+			_mm_loadu_si128((const __m128i *)(r + i)));
+		__m256i vg = _mm256_cvtepu16_epi32(
+			_mm_loadu_si128((const __m128i *)(g + i)));
+		__m256i vb = _mm256_cvtepu16_epi32(
+			_mm_loadu_si128((const __m128i *)(b + i)));
+		__m256i ir, g2, lo, hi, nz;
+		__m256d qa, qb;
+		__m128i qlo, qhi;
+
+		ir = _mm256_sub_epi32(_mm256_add_epi32(_mm256_add_epi32(vr, vg),
+						       vb), vc);
+		ir = _mm256_srli_epi32(_mm256_max_epi32(ir, zero), 1);
+		vr = _mm256_max_epi32(_mm256_sub_epi32(vr, ir), zero);
+		vg = _mm256_max_epi32(_mm256_sub_epi32(vg, ir), zero);
+		vb = _mm256_max_epi32(_mm256_sub_epi32(vb, ir), zero);
+
+		g2 = _mm256_add_epi32(_mm256_add_epi32(
+				_mm256_mullo_epi32(vr, rc),
+				_mm256_mullo_epi32(vg, gc)),
+				_mm256_mullo_epi32(vb, bc));
+		g2 = _mm256_max_epi32(g2, zero);
+
+		/* 32x32->64 multiply of even and odd lanes, >> 16, saturate */
+		lo = _mm256_srli_epi64(_mm256_mul_epu32(g2, mult), 16);
+		hi = _mm256_srli_epi64(_mm256_mul_epu32(
+				_mm256_srli_epi64(g2, 32), mult), 16);
+		lo = _mm256_blendv_epi8(lo, sat, _mm256_cmpgt_epi64(lo, sat));
+		hi = _mm256_blendv_epi8(hi, sat, _mm256_cmpgt_epi64(hi, sat));
+		_mm256_storeu_si256((__m256i *)(mlux + i),
+				    _mm256_blend_epi32(lo,
+					_mm256_slli_epi64(hi, 32), 0xaa));
+
+		lo = _mm256_mullo_epi32(vb, ctc);
+		qa = _mm256_div_pd(
+			_mm256_cvtepi32_pd(_mm256_castsi256_si128(lo)),
+			_mm256_cvtepi32_pd(_mm256_castsi256_si128(vr)));
+		qb = _mm256_div_pd(
+			_mm256_cvtepi32_pd(_mm256_extracti128_si256(lo, 1)),
+			_mm256_cvtepi32_pd(_mm256_extracti128_si256(vr, 1)));
+		qlo = _mm256_cvttpd_epi32(qa);
+		qhi = _mm256_cvttpd_epi32(qb);
+
+		hi = _mm256_add_epi32(_mm256_set_m128i(qhi, qlo), cto);
+		nz = _mm256_cmpgt_epi32(vr, zero);
+		_mm256_storeu_si256((__m256i *)(cct + i),
+				    _mm256_and_si256(hi, nz));
+	}
+
+	convert_batch_scalar(p, c + i, r + i, g + i, b + i, mlux + i, cct + i,
+			     n - i);
+}
+#endif
+
+#if defined(APDS9960_HAVE_NEON)
+static void convert_batch_neon(const convert_params &p, const uint16_t *c,
+			       const uint16_t *r, const uint16_t *g,
+			       const uint16_t *b, uint32_t *mlux,
+			       int32_t *cct, std::size_t n)
+{
+	const int32x4_t zero = vdupq_n_s32(0);
+	const uint32x2_t mult = vdup_n_u32(p.lux_mult);
+	std::size_t i;
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		int32x4_t vc = vreinterpretq_s32_u32(vmovl_u16(vld1_u16(c + i)));
+		int32x4_t vr = vreinterpretq_s32_u32(vmovl_u16(vld1_u16(r + i)));
+		int32x4_t vg = vreinterpretq_s32_u32(vmovl_u16(vld1_u16(g + i)));
+		int32x4_t vb = vreinterpretq_s32_u32(vmovl_u16(vld1_u16(b + i)));
+		int32x4_t ir, g2, num, q;
+		uint32x4_t u;
+		float64x2_t qa, qb;
+
+		ir = vsubq_s32(vaddq_s32(vaddq_s32(vr, vg), vb), vc);
+		ir = vshrq_n_s32(vmaxq_s32(ir, zero), 1);
+		vr = vmaxq_s32(vsubq_s32(vr, ir), zero);
+		vg = vmaxq_s32(vsubq_s32(vg, ir), zero);
+		vb = vmaxq_s32(vsubq_s32(vb, ir), zero);
+
+		g2 = vmulq_n_s32(vr, p.r_coef);
+		g2 = vmlaq_n_s32(g2, vg, p.g_coef);
+		g2 = vmlaq_n_s32(g2, vb, p.b_coef);
+		u = vreinterpretq_u32_s32(vmaxq_s32(g2, zero));
+
+		/* Saturating narrow gives the clamp to UINT32_MAX for free */
+		vst1q_u32(mlux + i, vcombine_u32(
+			vqmovn_u64(vshrq_n_u64(vmull_u32(vget_low_u32(u),
+							 mult), 16)),
+			vqmovn_u64(vshrq_n_u64(vmull_u32(vget_high_u32(u),
+							 mult), 16))));
+
+		num = vmulq_n_s32(vb, p.ct_coef);
+		qa = vdivq_f64(vcvtq_f64_s64(vmovl_s32(vget_low_s32(num))),
+			       vcvtq_f64_s64(vmovl_s32(vget_low_s32(vr))));
+		qb = vdivq_f64(vcvtq_f64_s64(vmovl_s32(vget_high_s32(num))),
+			       vcvtq_f64_s64(vmovl_s32(vget_high_s32(vr))));
+		q = vcombine_s32(vmovn_s64(vcvtq_s64_f64(qa)),
+				 vmovn_s64(vcvtq_s64_f64(qb)));
+		q = vaddq_s32(q, vdupq_n_s32(p.ct_offset));
+		vst1q_s32(cct + i, vreinterpretq_s32_u32(vandq_u32(
+			vreinterpretq_u32_s32(q), vcgtq_s32(vr, zero))));
+	}
+
+	convert_batch_scalar(p, c + i, r + i, g + i, b + i, mlux + i, cct + i,
+			     n - i);
+}
+#endif
+
+using convert_fn = void (*)(const convert_params &, const uint16_t *,
+			    const uint16_t *, const uint16_t *,
+			    const uint16_t *, uint32_t *, int32_t *,
+			    std::size_t);
+
+static convert_fn convert_select(const char **name)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	/* May run before the compiler's own cpu model constructor */
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		*name = "avx2";
+		return convert_batch_avx2;
+	}
+#endif
+#if defined(APDS9960_HAVE_NEON)
+	*name = "neon";
+	return convert_batch_neon;
+#endif
+	*name = "scalar";
+	return convert_batch_scalar;
+}
+
+/* Picked on first use, so static constructors elsewhere can convert too */
+struct convert_kernel {
+	const char *name;
+	convert_fn fn;
+
+	convert_kernel() { fn = convert_select(&name); }
+};
+
+static const convert_kernel &convert_kernel_get()
+{
+	static const convert_kernel k;
+
+	return k;
+}
+
+void convert_batch(const convert_params &p, const uint16_t *c,
+		   const uint16_t *r, const uint16_t *g, const uint16_t *b,
+		   uint32_t *mlux, int32_t *cct, std::size_t n)
+{
+	convert_kernel_get().fn(p, c, r, g, b, mlux, cct, n);
+}
+
+const char *convert_impl()
+{
+	return convert_kernel_get().name;
+}
+
+void crgb_block::clear()
+{
+	c.clear();
+	r.clear();
+	g.clear();
+	b.clear();
+}
+
+int crgb_block::append(const batch &bt)
+{
+	const scan_layout *l = bt.layout();
+	int ic, ir, ig, ib;
+
+	if (!l)
+		return 0;
+
+	ic = l->find("in_intensity_clear");
+	ir = l->find("in_intensity_red");
+	ig = l->find("in_intensity_green");
+	ib = l->find("in_intensity_blue");
+	if (ic < 0 || ir < 0 || ig < 0 || ib < 0)
+		return -ENOENT;
+
+	for (sample s : bt) {
+		c.push_back(s.value(ic));
+		r.push_back(s.value(ir));
+		g.push_back(s.value(ig));
+		b.push_back(s.value(ib));
+	}
+
+	return 0;
+}
+
+} /* namespace apds9960 */
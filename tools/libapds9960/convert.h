@@ -0,0 +1,95 @@
+#ifndef _APDS9960_CONVERT_H_
+#define _APDS9960_CONVERT_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "scan.h"
+
+namespace apds9960 {
+
+/*
+ * CRGB to illuminance and colour temperature, following the Avago/TAOS
+ * DN40 method:
+ *
+ *   IR = (R + G + B - C) / 2,  X' = X - IR
+ *   lux = (Rc R' + Gc G' + Bc B') * GA * DF / (ATIME_ms * AGAIN)
+ *   CCT = CTc * B' / R' + CToff
+ *
+ * in integer arithmetic only, so the same definition can run in the driver.
+ * Negative IR and negative compensated channels clamp to 0. Coefficients
+ * are in milli units and must stay within +-8191, which keeps every
+ * intermediate product in range.
+ */
+struct convert_params {
+	int32_t r_coef = 136;
+	int32_t g_coef = 1000;
+	int32_t b_coef = -444;
+	int32_t ct_coef = 3810;
+	int32_t ct_offset = 1391;
+	/* Glass attenuation (milli) times device factor */
+	uint32_t ga_df = 1000 * 310;
+
+	/* Q16 milli-lux per milli-count, see convert_prepare() */
+	uint32_t lux_mult = 0;
+};
+
+/* Fold integration time and gain into lux_mult; call after any change */
+int convert_prepare(convert_params &p, unsigned int atime_us,
+		    unsigned int gain);
+
+static inline uint32_t convert_ir(uint32_t c, uint32_t r, uint32_t g,
+				  uint32_t b)
+{
+	int32_t x = (int32_t)(r + g + b) - (int32_t)c;
+
+	return x > 0 ? x / 2 : 0;
+}
+
+static inline uint32_t convert_sub_ir(uint32_t v, uint32_t ir)
+{
+	return v > ir ? v - ir : 0;
+}
+
+/* Reference per-sample path; the batch kernels match it bit for bit */
+static inline void convert_one(const convert_params &p, uint32_t c,
+			       uint32_t r, uint32_t g, uint32_t b,
+			       uint32_t *mlux, int32_t *cct)
+{
+	uint32_t ir = convert_ir(c, r, g, b);
+	int32_t rp = convert_sub_ir(r, ir);
+	int32_t gp = convert_sub_ir(g, ir);
+	int32_t bp = convert_sub_ir(b, ir);
+	int32_t g2 = p.r_coef * rp + p.g_coef * gp + p.b_coef * bp;
+	uint64_t lux;
+
+	lux = g2 > 0 ? ((uint64_t)g2 * p.lux_mult) >> 16 : 0;
+	*mlux = lux > UINT32_MAX ? UINT32_MAX : lux;
+	*cct = rp ? p.ct_coef * bp / rp + p.ct_offset : 0;
+}
+
+/*
+ * Batch conversion over structure-of-arrays input. Picks AVX2 at first use
+ * when the CPU has it, or NEON on arm64 builds with APDS9960_NEON defined,
+ * and falls back to convert_one() otherwise.
+ */
+void convert_batch(const convert_params &p, const uint16_t *c,
+		   const uint16_t *r, const uint16_t *g, const uint16_t *b,
+		   uint32_t *mlux, int32_t *cct, std::size_t n);
+
+/* Name of the kernel convert_batch() dispatches to */
+const char *convert_impl();
+
+/* Deinterleave the clear/red/green/blue channels of batches into SoA form */
+struct crgb_block {
+	std::vector<uint16_t> c, r, g, b;
+
+	void clear();
+	int append(const batch &bt);
+	std::size_t size() const { return c.size(); }
+};
+
+} /* namespace apds9960 */
+
+#endif /* _APDS9960_CONVERT_H_ */
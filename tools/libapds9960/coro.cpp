@@ -0,0 +1,60 @@
+#include "coro.h"
+
+#include <cerrno>
+#include <cstdint>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+namespace apds9960 {
+
+sleep_for::~sleep_for()
+{
+	if (fd_ < 0)
+		return;
+
+	loop_.remove(fd_);
+	close(fd_);
+}
+
+bool sleep_for::await_suspend(std::coroutine_handle<> h)
+{
+	struct itimerspec its = {};
+	int fd;
+
+	its.it_value.tv_sec = d_.count() / 1000000000;
+	its.it_value.tv_nsec = d_.count() % 1000000000;
+
+	fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (fd < 0) {
+		err_ = -errno;
+		return false;
+	}
+
+	if (timerfd_settime(fd, 0, &its, nullptr)) {
+		err_ = -errno;
+		close(fd);
+		return false;
+	}
+
+	err_ = loop_.add(fd, EPOLLIN, [this, fd, h](uint32_t) {
+		uint64_t ticks;
+
+		if (read(fd, &ticks, sizeof(ticks)) < 0 && errno == EAGAIN)
+			return;
+
+		loop_.remove(fd);
+		close(fd);
+		fd_ = -1;
+		h.resume();
+	});
+	if (err_) {
+		close(fd);
+		return false;
+	}
+
+	fd_ = fd;
+
+	return true;
+}
+
+} /* namespace apds9960 */
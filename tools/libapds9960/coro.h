@@ -0,0 +1,142 @@
+#ifndef _APDS9960_CORO_H_
+#define _APDS9960_CORO_H_
+
+#if __cplusplus < 202002L
+#error "coro.h needs C++20"
+#endif
+
+#include <chrono>
+#include <coroutine>
+#include <exception>
+#include <utility>
+
+#include "event_loop.h"
+
+namespace apds9960 {
+
+template <typename T>
+class task;
+
+namespace detail {
+
+struct promise_base {
+	std::coroutine_handle<> cont;
+
+	struct final_awaiter {
+		bool await_ready() noexcept { return false; }
+
+		template <typename P>
+		std::coroutine_handle<>
+		await_suspend(std::coroutine_handle<P> h) noexcept
+		{
+			std::coroutine_handle<> c = h.promise().cont;
+
+			return c ? c : std::noop_coroutine();
+		}
+
+		void await_resume() noexcept {}
+	};
+
+	std::suspend_always initial_suspend() noexcept { return {}; }
+	final_awaiter final_suspend() noexcept { return {}; }
+	/* The library reports errors by value, an escaping exception is a bug */
+	void unhandled_exception() noexcept { std::terminate(); }
+};
+
+template <typename T>
+struct promise : promise_base {
+	T value;
+
+	task<T> get_return_object() noexcept;
+	void return_value(T v) noexcept { value = std::move(v); }
+	T result() { return std::move(value); }
+};
+
+template <>
+struct promise<void> : promise_base {
+	task<void> get_return_object() noexcept;
+	void return_void() noexcept {}
+	void result() {}
+};
+
+} /* namespace detail */
+
+/*
+ * Lazily started coroutine. Awaiting it runs it to completion and resumes
+ * the awaiter by symmetric transfer; the outermost task is kicked off with
+ * start() and then advanced by the event_loop its awaitables park on.
+ */
+template <typename T = void>
+class task {
+public:
+	using promise_type = detail::promise<T>;
+	using handle = std::coroutine_handle<promise_type>;
+
+	explicit task(handle h) noexcept : h_(h) {}
+	task(task &&o) noexcept : h_(std::exchange(o.h_, nullptr)) {}
+	task(const task &) = delete;
+	task &operator=(const task &) = delete;
+	~task()
+	{
+		if (h_)
+			h_.destroy();
+	}
+
+	void start() { h_.resume(); }
+	bool done() const { return !h_ || h_.done(); }
+
+	bool await_ready() const noexcept { return false; }
+
+	std::coroutine_handle<> await_suspend(std::coroutine_handle<> c) noexcept
+	{
+		h_.promise().cont = c;
+		return h_;
+	}
+
+	T await_resume() { return h_.promise().result(); }
+
+private:
+	handle h_;
+};
+
+namespace detail {
+
+template <typename T>
+inline task<T> promise<T>::get_return_object() noexcept
+{
+	return task<T>(std::coroutine_handle<promise<T>>::from_promise(*this));
+}
+
+inline task<void> promise<void>::get_return_object() noexcept
+{
+	return task<void>(
+		std::coroutine_handle<promise<void>>::from_promise(*this));
+}
+
+} /* namespace detail */
+
+/* co_await sleep_for(loop, 20ms): a one-shot timerfd parked on the loop */
+class sleep_for {
+public:
+	sleep_for(event_loop &loop, std::chrono::nanoseconds d)
+		: loop_(loop), d_(d) {}
+	sleep_for(const sleep_for &) = delete;
+	sleep_for &operator=(const sleep_for &) = delete;
+	/* Destroying a coroutine parked here must not leave the timer armed */
+	~sleep_for();
+
+	bool await_ready() const noexcept { return d_.count() <= 0; }
+	bool await_suspend(std::coroutine_handle<> h);
+	/* 0, or a negative errno if the timer could not be armed */
+	int await_resume() const noexcept { return err_; }
+
+private:
+	event_loop &loop_;
+	std::chrono::nanoseconds d_;
+	int fd_ = -1;
+	int err_ = 0;
+};
+
+} /* namespace apds9960 */
+
+#endif /* _APDS9960_CORO_H_ */
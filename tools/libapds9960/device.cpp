@@ -0,0 +1,183 @@
+#include "device.h"
+#include "sysfs.h"
+
+#include <cerrno>
+#include <dirent.h>
+#include <fcntl.h>
+#include <linux/iio/events.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+namespace apds9960 {
+
+int device::find(std::string &dev_dir, const char *name, unsigned int n)
+{
+	struct dirent *ent;
+	int ret = -ENODEV;
+	DIR *dp;
+
+	dp = opendir(APDS9960_IIO_SYSFS);
+	if (!dp)
+		return -errno;
+
+	while ((ent = readdir(dp))) {
+		std::string dir = std::string(APDS9960_IIO_SYSFS "/") +
+				  ent->d_name;
+		std::string val;
+
+		if (std::string(ent->d_name).compare(0, 9, "iio:device"))
+			continue;
+		if (sysfs_read(dir + "/name", val) || val != name)
+			continue;
+		if (n--)
+			continue;
+
+		dev_dir = dir;
+		ret = 0;
+		break;
+	}
+	closedir(dp);
+
+	return ret;
+}
+
+int device::enable_scan_elements()
+{
+	const std::string dir = dir_ + "/scan_elements/";
+	struct dirent *ent;
+	int ret = 0;
+	DIR *dp;
+
+	dp = opendir(dir.c_str());
+	if (!dp)
+		return -errno;
+
+	while ((ent = readdir(dp))) {
+		std::string en = ent->d_name;
+
+		if (en.size() <= 3 || en.compare(en.size() - 3, 3, "_en"))
+			continue;
+
+		ret = sysfs_write_int(dir + en, 1);
+		if (ret)
+			break;
+	}
+	closedir(dp);
+
+	return ret;
+}
+
+int device::open(const device_config &cfg, const std::string &dev_dir)
+{
+	int ret;
+
+	close();
+
+	cfg_ = cfg;
+	dir_ = dev_dir;
+	if (dir_.empty()) {
+		ret = find(dir_);
+		if (ret)
+			return ret;
+	}
+	node_ = cfg_.dev_node.empty() ?
+		"/dev/" + dir_.substr(dir_.rfind('/') + 1) : cfg_.dev_node;
+
+	/* The scan layout can only change while the buffer is disabled */
+	ret = sysfs_write_int(dir_ + "/buffer/enable", 0);
+	if (ret)
+		return ret;
+
+	if (cfg_.enable_all) {
+		ret = enable_scan_elements();
+		if (ret)
+			return ret;
+	}
+
+	ret = layout_.load(dir_);
+	if (ret)
+		return ret;
+
+	ret = sysfs_write_int(dir_ + "/buffer/length", cfg_.buffer_length);
+	if (ret)
+		return ret;
+
+	ret = sysfs_write_int(dir_ + "/buffer/watermark", cfg_.watermark);
+	if (ret)
+		return ret;
+
+	buf_.resize((std::size_t)cfg_.read_scans * layout_.scan_bytes());
+
+	fd_ = ::open(node_.c_str(), O_RDONLY | O_CLOEXEC |
+		     (cfg_.nonblock ? O_NONBLOCK : 0));
+	if (fd_ < 0)
+		return -errno;
+
+	ret = sysfs_write_int(dir_ + "/buffer/enable", 1);
+	if (ret) {
+		::close(fd_);
+		fd_ = -1;
+	}
+
+	return ret;
+}
+
+int device::event_fd()
+{
+	int fd;
+
+	if (event_fd_ >= 0)
+		return event_fd_;
+	if (fd_ < 0)
+		return -EBADF;
+
+	if (ioctl(fd_, IIO_GET_EVENT_FD_IOCTL, &fd) < 0)
+		return -errno;
+
+	/* The IIO core hands the fd out with O_CLOEXEC but blocking */
+	if (cfg_.nonblock &&
+	    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK)) {
+		int ret = -errno;
+
+		::close(fd);
+		return ret;
+	}
+
+	event_fd_ = fd;
+
+	return event_fd_;
+}
+
+void device::close()
+{
+	if (event_fd_ >= 0) {
+		::close(event_fd_);
+		event_fd_ = -1;
+	}
+
+	if (fd_ < 0)
+		return;
+
+	sysfs_write_int(dir_ + "/buffer/enable", 0);
+	::close(fd_);
+	fd_ = -1;
+}
+
+int device::read(batch &out)
+{
+	ssize_t len;
+
+	do {
+		len = ::read(fd_, buf_.data(), buf_.size());
+	} while (len < 0 && errno == EINTR);
+
+	if (len < 0)
+		return -errno;
+
+	/* The IIO core only ever returns whole scans */
+	out = batch(&layout_, span<const uint8_t>(buf_.data(), len));
+
+	return out.size();
+}
+
+} /* namespace apds9960 */
@@ -0,0 +1,78 @@
+#ifndef _APDS9960_DEVICE_H_
+#define _APDS9960_DEVICE_H_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "scan.h"
+
+namespace apds9960 {
+
+#define APDS9960_IIO_NAME	"apds9960"
+#define APDS9960_IIO_SYSFS	"/sys/bus/iio/devices"
+
+struct device_config {
+	/* Kernel buffer length and watermark, in scans */
+	unsigned int buffer_length = 1024;
+	unsigned int watermark = 64;
+	/* Scans fetched by a single read() of the char device */
+	unsigned int read_scans = 256;
+	/* Enable every scan element, otherwise keep the current selection */
+	bool enable_all = true;
+	/* Open the buffer (and event) fds with O_NONBLOCK for event loops */
+	bool nonblock = false;
+	/* Character device to read, /dev/<sysfs dir name> when empty */
+	std::string dev_node;
+};
+
+/*
+ * Owns the IIO buffer of one apds9960 instance. The scan layout is parsed
+ * once in open(); read() then fills a single block and hands out a batch of
+ * sample views over it, so nothing is allocated or copied per sample.
+ */
+class device {
+public:
+	device() = default;
+	device(const device &) = delete;
+	device &operator=(const device &) = delete;
+	~device() { close(); }
+
+	/* Locate the n-th IIO device whose name attribute matches 'name' */
+	static int find(std::string &dev_dir, const char *name = APDS9960_IIO_NAME,
+			unsigned int n = 0);
+
+	int open(const device_config &cfg = device_config(),
+		 const std::string &dev_dir = std::string());
+	void close();
+
+	/*
+	 * Returns the number of scans in 'out', or a negative errno. With
+	 * nonblock set an empty buffer yields -EAGAIN.
+	 */
+	int read(batch &out);
+
+	/* The IIO event fd, created on first use via IIO_GET_EVENT_FD_IOCTL */
+	int event_fd();
+
+	int buffer_fd() const { return fd_; }
+	const std::string &dir() const { return dir_; }
+	const std::string &dev_node() const { return node_; }
+	const scan_layout &layout() const { return layout_; }
+	const device_config &config() const { return cfg_; }
+
+private:
+	int enable_scan_elements();
+
+	std::string dir_;
+	std::string node_;
+	device_config cfg_;
+	scan_layout layout_;
+	std::vector<uint8_t> buf_;
+	int fd_ = -1;
+	int event_fd_ = -1;
+};
+
+} /* namespace apds9960 */
+
+#endif /* _APDS9960_DEVICE_H_ */
@@ -0,0 +1,109 @@
+#include "event_loop.h"
+
+#include <cerrno>
+#include <unistd.h>
+
+namespace apds9960 {
+
+#define APDS9960_MAX_EPOLL_EVENTS	64
+
+event_loop::~event_loop()
+{
+	if (epfd_ >= 0)
+		close(epfd_);
+}
+
+int event_loop::init()
+{
+	if (epfd_ >= 0)
+		return 0;
+
+	epfd_ = epoll_create1(EPOLL_CLOEXEC);
+
+	return epfd_ < 0 ? -errno : 0;
+}
+
+int event_loop::add(int fd, uint32_t events, handler h)
+{
+	std::unique_ptr<entry> e(new entry{ fd, false, std::move(h) });
+	struct epoll_event ev = {};
+
+	if (entries_.count(fd))
+		return -EEXIST;
+
+	ev.events = events;
+	ev.data.ptr = e.get();
+	if (epoll_ctl(epfd_, EPOLL_CTL_ADD, fd, &ev))
+		return -errno;
+
+	entries_[fd] = std::move(e);
+
+	return 0;
+}
+
+int event_loop::modify(int fd, uint32_t events)
+{
+	auto it = entries_.find(fd);
+	struct epoll_event ev = {};
+
+	if (it == entries_.end())
+		return -ENOENT;
+
+	ev.events = events;
+	ev.data.ptr = it->second.get();
+
+	return epoll_ctl(epfd_, EPOLL_CTL_MOD, fd, &ev) ? -errno : 0;
+}
+
+int event_loop::remove(int fd)
+{
+	auto it = entries_.find(fd);
+
+	if (it == entries_.end())
+		return -ENOENT;
+
+	epoll_ctl(epfd_, EPOLL_CTL_DEL, fd, nullptr);
+
+	/*
+	 * Events for it may still be pending in the current dispatch round and
+	 * the handler may be the one calling us, so only free it afterwards.
+	 */
+	it->second->dead = true;
+	removed_.push_back(std::move(it->second));
+	entries_.erase(it);
+
+	return 0;
+}
+
+int event_loop::run_once(int timeout_ms)
+{
+	struct epoll_event evs[APDS9960_MAX_EPOLL_EVENTS];
+	int n;
+
+	n = epoll_wait(epfd_, evs, APDS9960_MAX_EPOLL_EVENTS, timeout_ms);
+	if (n < 0)
+		return errno == EINTR ? 0 : -errno;
+
+	for (int i = 0; i < n; i++) {
+		entry *e = static_cast<entry *>(evs[i].data.ptr);
+
+		if (!e->dead)
+			e->h(evs[i].events);
+	}
+	removed_.clear();
+
+	return n;
+}
+
+int event_loop::run()
+{
+	int ret = 0;
+
+	stop_ = false;
+	while (!stop_ && ret >= 0)
+		ret = run_once(-1);
+
+	return ret < 0 ? ret : 0;
+}
+
+} /* namespace apds9960 */
@@ -0,0 +1,56 @@
+#ifndef _APDS9960_EVENT_LOOP_H_
+#define _APDS9960_EVENT_LOOP_H_
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#include <sys/epoll.h>
+
+namespace apds9960 {
+
+/*
+ * Thin single-threaded epoll loop. Callers register their fds with whatever
+ * flags they need; the sensor sources use EPOLLET and drain to EAGAIN.
+ */
+class event_loop {
+public:
+	using handler = std::function<void(uint32_t events)>;
+
+	event_loop() = default;
+	event_loop(const event_loop &) = delete;
+	event_loop &operator=(const event_loop &) = delete;
+	~event_loop();
+
+	int init();
+
+	int add(int fd, uint32_t events, handler h);
+	int modify(int fd, uint32_t events);
+	int remove(int fd);
+
+	/* Wait up to timeout_ms and dispatch; returns events handled or -errno */
+	int run_once(int timeout_ms);
+	int run();
+	void stop() { stop_ = true; }
+
+	/* The epoll fd itself, so this loop can be nested in another one */
+	int fd() const { return epfd_; }
+
+private:
+	struct entry {
+		int fd;
+		bool dead;
+		handler h;
+	};
+
+	std::unordered_map<int, std::unique_ptr<entry>> entries_;
+	std::vector<std::unique_ptr<entry>> removed_;
+	int epfd_ = -1;
+	bool stop_ = false;
+};
+
+} /* namespace apds9960 */
+
+#endif /* _APDS9960_EVENT_LOOP_H_ */
@@ -0,0 +1,384 @@
+#include "history.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace apds9960 {
+
+#define APDS9960_HIST_HDR_SIZE	4096
+
+struct hist_file_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t fanout;
+	uint32_t nr_levels;
+	uint64_t capacity;
+	uint64_t count;
+	int64_t first_ts;
+	int64_t last_ts;
+	uint64_t level_off[APDS9960_HIST_MAX_LEVELS];
+};
+
+struct history::segment {
+	unsigned int seq;
+	int fd = -1;
+	std::size_t len = 0;
+	uint8_t *map = nullptr;
+	hist_file_header *hdr;
+	hist_point *points;
+	hist_summary *levels[APDS9960_HIST_MAX_LEVELS];
+
+	~segment()
+	{
+		if (map)
+			munmap(map, len);
+		if (fd >= 0)
+			::close(fd);
+	}
+};
+
+history::history() = default;
+
+history::~history()
+{
+	close();
+}
+
+static uint64_t level_buckets(uint64_t capacity, unsigned int fanout,
+			      unsigned int level)
+{
+	while (level--)
+		capacity = (capacity + fanout - 1) / fanout;
+
+	return capacity;
+}
+
+int history::open_segment(unsigned int seq, bool create)
+{
+	std::unique_ptr<segment> seg(new segment);
+	hist_file_header hdr = {};
+	char name[32];
+	std::string path;
+	uint64_t off;
+	unsigned int k;
+	struct stat st;
+	ssize_t len;
+	int ret;
+
+	seg->seq = seq;
+	snprintf(name, sizeof(name), "/seg-%08u.hist", seq);
+	path = dir_ + name;
+
+	if (create) {
+		hdr.magic = APDS9960_HIST_MAGIC;
+		hdr.version = APDS9960_HIST_VERSION;
+		hdr.fanout = opts_.fanout;
+		hdr.capacity = opts_.segment_points;
+
+		off = APDS9960_HIST_HDR_SIZE;
+		hdr.level_off[0] = off;
+		off += hdr.capacity * sizeof(hist_point);
+		for (k = 1; k < APDS9960_HIST_MAX_LEVELS; k++) {
+			uint64_t n = level_buckets(hdr.capacity, hdr.fanout, k);
+
+			/* Keep page-aligned levels so a query maps few pages */
+			off = (off + 4095) & ~4095ULL;
+			hdr.level_off[k] = off;
+			off += n * sizeof(hist_summary);
+			if (n == 1)
+				break;
+		}
+		hdr.nr_levels = std::min<unsigned int>(k + 1,
+					APDS9960_HIST_MAX_LEVELS);
+
+		seg->fd = ::open(path.c_str(),
+				 O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+		if (seg->fd < 0)
+			return -errno;
+
+		/* Sparse: pages only get allocated as points arrive */
+		if (ftruncate(seg->fd, off)) {
+			ret = -errno;
+			goto err;
+		}
+
+		len = pwrite(seg->fd, &hdr, sizeof(hdr), 0);
+		if (len != sizeof(hdr)) {
+			ret = len < 0 ? -errno : -EIO;
+			goto err;
+		}
+	} else {
+		seg->fd = ::open(path.c_str(), O_RDWR | O_CLOEXEC);
+		if (seg->fd < 0)
+			return -errno;
+	}
+
+	if (fstat(seg->fd, &st)) {
+		ret = -errno;
+		goto err;
+	}
+
+	seg->len = st.st_size;
+	seg->map = static_cast<uint8_t *>(mmap(nullptr, seg->len,
+					       PROT_READ | PROT_WRITE,
+					       MAP_SHARED, seg->fd, 0));
+	if (seg->map == MAP_FAILED) {
+		seg->map = nullptr;
+		ret = -errno;
+		goto err;
+	}
+
+	seg->hdr = reinterpret_cast<hist_file_header *>(seg->map);
+	if (seg->len < APDS9960_HIST_HDR_SIZE ||
+	    seg->hdr->magic != APDS9960_HIST_MAGIC ||
+	    seg->hdr->version != APDS9960_HIST_VERSION ||
+	    !seg->hdr->nr_levels ||
+	    seg->hdr->nr_levels > APDS9960_HIST_MAX_LEVELS ||
+	    seg->hdr->fanout < 2 ||
+	    seg->hdr->level_off[seg->hdr->nr_levels - 1] +
+	    sizeof(hist_summary) > seg->len) {
+		ret = -EBADMSG;
+		goto err;
+	}
+
+	seg->points = reinterpret_cast<hist_point *>(seg->map +
+						     seg->hdr->level_off[0]);
+	seg->levels[0] = nullptr;
+	for (k = 1; k < seg->hdr->nr_levels; k++)
+		seg->levels[k] = reinterpret_cast<hist_summary *>(
+			seg->map + seg->hdr->level_off[k]);
+
+	segs_.push_back(std::move(seg));
+
+	return 0;
+
+err:
+	/* Don't leave a half-made segment behind for the next open() */
+	if (create)
+		unlink(path.c_str());
+	return ret;
+}
+
+int history::open(const std::string &dir, const history_options &opts)
+{
+	std::vector<unsigned int> seqs;
+	struct dirent *ent;
+	DIR *dp;
+	int ret;
+
+	close();
+
+	if (opts.fanout < 2 || opts.segment_points < opts.fanout)
+		return -EINVAL;
+
+	dir_ = dir;
+	opts_ = opts;
+
+	if (mkdir(dir.c_str(), 0755) && errno != EEXIST)
+		return -errno;
+
+	dp = opendir(dir.c_str());
+	if (!dp)
+		return -errno;
+	while ((ent = readdir(dp))) {
+		unsigned int seq;
+
+		if (sscanf(ent->d_name, "seg-%08u.hist", &seq) == 1)
+			seqs.push_back(seq);
+	}
+	closedir(dp);
+
+	std::sort(seqs.begin(), seqs.end());
+	for (unsigned int seq : seqs) {
+		ret = open_segment(seq, false);
+		if (ret) {
+			close();
+			return ret;
+		}
+	}
+
+	return 0;
+}
+
+void history::close()
+{
+	segs_.clear();
+}
+
+int history::append(int64_t ts, int64_t value)
+{
+	segment *seg;
+	hist_file_header *hdr;
+	uint64_t i, div;
+	unsigned int k;
+	int ret;
+
+	/* The newest point may sit at the end of the previous segment */
+	if (!segs_.empty() && segs_.back()->hdr->count &&
+	    ts < segs_.back()->hdr->last_ts)
+		return -EINVAL;
+
+	if (segs_.empty() ||
+	    segs_.back()->hdr->count == segs_.back()->hdr->capacity) {
+		unsigned int seq = segs_.empty() ? 0 : segs_.back()->seq + 1;
+
+		ret = open_segment(seq, true);
+		if (ret)
+			return ret;
+	}
+
+	seg = segs_.back().get();
+	hdr = seg->hdr;
+	i = hdr->count;
+
+	seg->points[i].ts = ts;
+	seg->points[i].value = value;
+
+	/* Fold the point into the one open bucket of every level */
+	for (k = 1, div = hdr->fanout; k < hdr->nr_levels;
+	     k++, div *= hdr->fanout) {
+		hist_summary &b = seg->levels[k][i / div];
+
+		if (i % div == 0) {
+			b.first_ts = ts;
+			b.min = value;
+			b.max = value;
+			b.sum = 0;
+			b.count = 0;
+		}
+		b.last_ts = ts;
+		b.min = std::min(b.min, value);
+		b.max = std::max(b.max, value);
+		b.sum += value;
+		b.count++;
+	}
+
+	if (!i)
+		hdr->first_ts = ts;
+	hdr->last_ts = ts;
+	__atomic_store_n(&hdr->count, i + 1, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+uint64_t history::size() const
+{
+	uint64_t n = 0;
+
+	for (const auto &seg : segs_)
+		n += seg->hdr->count;
+
+	return n;
+}
+
+void history::query_segment(const segment &seg, int64_t t0, int64_t t1,
+			    std::size_t max_points,
+			    std::vector<hist_summary> &out) const
+{
+	const hist_file_header *hdr = seg.hdr;
+	const hist_point *pts = seg.points;
+	uint64_t count = __atomic_load_n(&hdr->count, __ATOMIC_ACQUIRE);
+	uint64_t i0, i1, div = 1, b;
+	unsigned int k;
+
+	i0 = std::lower_bound(pts, pts + count, t0,
+			      [](const hist_point &p, int64_t t) {
+				      return p.ts < t;
+			      }) - pts;
+	i1 = std::lower_bound(pts + i0, pts + count, t1,
+			      [](const hist_point &p, int64_t t) {
+				      return p.ts < t;
+			      }) - pts;
+	if (i0 >= i1)
+		return;
+
+	/* Finest level that fits the budget, or the top one */
+	for (k = 0; k + 1 < hdr->nr_levels; k++, div *= hdr->fanout)
+		if ((i1 - 1) / div - i0 / div + 1 <= max_points)
+			break;
+
+	if (!k) {
+		for (b = i0; b < i1; b++)
+			out.push_back(hist_summary{ pts[b].ts, pts[b].ts,
+						    pts[b].value, pts[b].value,
+						    pts[b].value, 1 });
+		return;
+	}
+
+	for (b = i0 / div; b <= (i1 - 1) / div; b++)
+		out.push_back(seg.levels[k][b]);
+}
+
+/* Merge runs of neighbouring summaries until at most max_points are left */
+static void fold_summaries(std::vector<hist_summary> &v,
+			   std::size_t max_points)
+{
+	std::size_t per, i, j, k;
+
+	if (v.size() <= max_points)
+		return;
+
+	per = (v.size() + max_points - 1) / max_points;
+	for (i = 0, j = 0; i < v.size(); i += per, j++) {
+		hist_summary s = v[i];
+
+		for (k = i + 1; k < std::min(i + per, v.size()); k++) {
+			s.last_ts = v[k].last_ts;
+			s.min = std::min(s.min, v[k].min);
+			s.max = std::max(s.max, v[k].max);
+			s.sum += v[k].sum;
+			s.count += v[k].count;
+		}
+		v[j] = s;
+	}
+	v.resize(j);
+}
+
+int history::query(int64_t t0, int64_t t1, std::size_t max_points,
+		   std::vector<hist_summary> &out) const
+{
+	std::size_t left = max_points;
+	uint64_t total = 0;
+
+	out.clear();
+	if (t0 >= t1 || !max_points)
+		return -EINVAL;
+
+	for (const auto &seg : segs_)
+		if (seg->hdr->count && seg->hdr->last_ts >= t0 &&
+		    seg->hdr->first_ts < t1)
+			total += seg->hdr->count;
+
+	/*
+	 * Share the budget between segments by how full they are, handing
+	 * each what is left of it so rounding does not add up past it.
+	 */
+	for (const auto &seg : segs_) {
+		std::size_t n;
+
+		if (!seg->hdr->count || seg->hdr->last_ts < t0 ||
+		    seg->hdr->first_ts >= t1)
+			continue;
+
+		n = std::max<uint64_t>(1, left * seg->hdr->count / total);
+		left -= std::min(n, left);
+		total -= seg->hdr->count;
+		query_segment(*seg, t0, t1, n, out);
+	}
+
+	/*
+	 * More segments than points, or a top level still too fine for its
+	 * share, can overshoot; merge neighbours to stay within the budget.
+	 */
+	fold_summaries(out, max_points);
+
+	return out.size();
+}
+
+} /* namespace apds9960 */
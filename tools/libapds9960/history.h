@@ -0,0 +1,85 @@
+#ifndef _APDS9960_HISTORY_H_
+#define _APDS9960_HISTORY_H_
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace apds9960 {
+
+#define APDS9960_HIST_MAGIC		0x48363941	/* "A96H" */
+#define APDS9960_HIST_VERSION		1
+#define APDS9960_HIST_MAX_LEVELS	8
+
+struct hist_point {
+	int64_t ts;
+	int64_t value;
+};
+
+/* One summary bucket; level 0 buckets are single points */
+struct hist_summary {
+	int64_t first_ts;
+	int64_t last_ts;
+	int64_t min;
+	int64_t max;
+	int64_t sum;
+	uint64_t count;
+
+	int64_t mean() const { return count ? sum / (int64_t)count : 0; }
+};
+
+struct history_options {
+	/* Raw points per segment file */
+	unsigned int segment_points = 1 << 20;
+	unsigned int fanout = 16;
+};
+
+/*
+ * Append-only store for one series (say lux of one unit) kept in
+ * memory-mapped segment files. Each segment holds a fixed number of raw
+ * points plus a pyramid of summary levels, every level 'fanout' times
+ * coarser than the one below, all updated in place as points are
+ * appended. A query binary-searches the raw timestamps for its range and
+ * then reads just the buckets of the coarsest level that still gives the
+ * requested resolution, so it touches O(log n) pages plus its output.
+ */
+class history {
+public:
+	history();
+	history(const history &) = delete;
+	history &operator=(const history &) = delete;
+	~history();
+
+	int open(const std::string &dir, const history_options &opts = history_options());
+	void close();
+
+	/* Timestamps must not go backwards */
+	int append(int64_t ts, int64_t value);
+
+	/*
+	 * Summaries covering [t0, t1) with at most max_points entries,
+	 * each at least as fine as needed. Buckets straddling t0 or t1 are
+	 * returned whole.
+	 */
+	int query(int64_t t0, int64_t t1, std::size_t max_points,
+		  std::vector<hist_summary> &out) const;
+
+	uint64_t size() const;
+
+private:
+	struct segment;
+
+	int open_segment(unsigned int seq, bool create);
+	void query_segment(const segment &seg, int64_t t0, int64_t t1,
+			   std::size_t max_points,
+			   std::vector<hist_summary> &out) const;
+
+	std::string dir_;
+	history_options opts_;
+	std::vector<std::unique_ptr<segment>> segs_;
+};
+
+} /* namespace apds9960 */
+
+#endif /* _APDS9960_HISTORY_H_ */
@@ -0,0 +1,125 @@
+#include "metrics.h"
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+
+namespace apds9960 {
+
+void agg_bucket::reset(int64_t e)
+{
+	epoch = e;
+	count = 0;
+	sum = 0;
+	min = INT64_MAX;
+	max = INT64_MIN;
+	saturated = 0;
+	events = 0;
+}
+
+void agg_bucket::merge(const agg_bucket &o)
+{
+	count += o.count;
+	sum += o.sum;
+	min = std::min(min, o.min);
+	max = std::max(max, o.max);
+	saturated += o.saturated;
+	events += o.events;
+}
+
+rolling_window::rolling_window(int64_t bucket_ns, unsigned int nr_buckets)
+	: bucket_ns_(bucket_ns), buckets_(nr_buckets)
+{
+	for (agg_bucket &b : buckets_)
+		b.reset(-1);
+}
+
+agg_bucket &rolling_window::bucket(int64_t now)
+{
+	int64_t e = now / bucket_ns_;
+	agg_bucket &b = buckets_[e % buckets_.size()];
+
+	/* A bucket left over from a previous lap of the ring starts afresh */
+	if (b.epoch != e)
+		b.reset(e);
+
+	return b;
+}
+
+void rolling_window::add(int64_t now, int64_t value, bool saturated)
+{
+	agg_bucket &b = bucket(now);
+
+	b.count++;
+	b.sum += value;
+	b.min = std::min(b.min, value);
+	b.max = std::max(b.max, value);
+	b.saturated += saturated;
+}
+
+void rolling_window::add_event(int64_t now, uint64_t n)
+{
+	bucket(now).events += n;
+}
+
+agg_bucket rolling_window::total(int64_t now) const
+{
+	int64_t e = now / bucket_ns_;
+	agg_bucket t;
+
+	t.reset(e);
+	for (const agg_bucket &b : buckets_)
+		if (b.epoch > e - (int64_t)buckets_.size() && b.epoch <= e)
+			t.merge(b);
+
+	return t;
+}
+
+void metric_windows::expose(std::string &out, const std::string &name,
+			    int64_t now) const
+{
+	static const char *const labels[] = { "1s", "1m", "1h" };
+	const rolling_window *ws[] = { &w1s, &w1m, &w1h };
+	char line[256];
+
+	for (int i = 0; i < 3; i++) {
+		agg_bucket t = ws[i]->total(now);
+
+		snprintf(line, sizeof(line),
+			 "%s_count{window=\"%s\"} %" PRIu64 "\n",
+			 name.c_str(), labels[i], t.count);
+		out += line;
+
+		if (!t.count)
+			continue;
+
+		snprintf(line, sizeof(line),
+			 "%s_mean{window=\"%s\"} %.3f\n"
+			 "%s_min{window=\"%s\"} %" PRId64 "\n"
+			 "%s_max{window=\"%s\"} %" PRId64 "\n"
+			 "%s_saturation_ratio{window=\"%s\"} %.4f\n",
+			 name.c_str(), labels[i], (double)t.sum / t.count,
+			 name.c_str(), labels[i], t.min,
+			 name.c_str(), labels[i], t.max,
+			 name.c_str(), labels[i],
+			 (double)t.saturated / t.count);
+		out += line;
+	}
+}
+
+void metric_windows::expose_events(std::string &out, const std::string &name,
+				   int64_t now) const
+{
+	static const char *const labels[] = { "1s", "1m", "1h" };
+	const rolling_window *ws[] = { &w1s, &w1m, &w1h };
+	char line[128];
+
+	for (int i = 0; i < 3; i++) {
+		snprintf(line, sizeof(line),
+			 "%s_events{window=\"%s\"} %" PRIu64 "\n",
+			 name.c_str(), labels[i], ws[i]->total(now).events);
+		out += line;
+	}
+}
+
+} /* namespace apds9960 */
@@ -0,0 +1,76 @@
+#ifndef _APDS9960_METRICS_H_
+#define _APDS9960_METRICS_H_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace apds9960 {
+
+struct agg_bucket {
+	int64_t epoch;
+	uint64_t count;
+	int64_t sum;
+	int64_t min;
+	int64_t max;
+	uint64_t saturated;
+	uint64_t events;
+
+	void reset(int64_t e);
+	void merge(const agg_bucket &o);
+};
+
+/*
+ * Fixed ring of time buckets. add() touches one bucket, and reading the
+ * window folds a constant number of them, so the cost of serving the
+ * aggregate does not grow with the sample rate.
+ */
+class rolling_window {
+public:
+	rolling_window(int64_t bucket_ns, unsigned int nr_buckets);
+
+	void add(int64_t now, int64_t value, bool saturated);
+	void add_event(int64_t now, uint64_t n = 1);
+
+	/* Aggregate over the last nr_buckets * bucket_ns up to 'now' */
+	agg_bucket total(int64_t now) const;
+
+	int64_t span_ns() const { return bucket_ns_ * buckets_.size(); }
+
+private:
+	agg_bucket &bucket(int64_t now);
+
+	int64_t bucket_ns_;
+	std::vector<agg_bucket> buckets_;
+};
+
+/* The 1 s / 1 min / 1 h windows kept for every exported series */
+struct metric_windows {
+	rolling_window w1s{ 100000000, 10 };
+	rolling_window w1m{ 1000000000, 60 };
+	rolling_window w1h{ 60000000000LL, 60 };
+
+	void add(int64_t now, int64_t value, bool saturated)
+	{
+		w1s.add(now, value, saturated);
+		w1m.add(now, value, saturated);
+		w1h.add(now, value, saturated);
+	}
+
+	void add_event(int64_t now, uint64_t n = 1)
+	{
+		w1s.add_event(now, n);
+		w1m.add_event(now, n);
+		w1h.add_event(now, n);
+	}
+
+	/* Prometheus text exposition lines for one series */
+	void expose(std::string &out, const std::string &name,
+		    int64_t now) const;
+	void expose_events(std::string &out, const std::string &name,
+			   int64_t now) const;
+};
+
+} /* namespace apds9960 */
+
+#endif /* _APDS9960_METRICS_H_ */
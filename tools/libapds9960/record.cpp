@@ -0,0 +1,558 @@
+#include "record.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace apds9960 {
+
+#define APDS9960_REC_CHUNK_HDR	32
+#define APDS9960_REC_FOOTER	12
+#define APDS9960_REC_INDEX_ENT	28
+
+uint32_t crc32(uint32_t crc, const void *buf, std::size_t len)
+{
+	static uint32_t table[256];
+	const uint8_t *p = static_cast<const uint8_t *>(buf);
+
+	if (!table[1]) {
+		for (uint32_t i = 0; i < 256; i++) {
+			uint32_t c = i;
+
+			for (int k = 0; k < 8; k++)
+				c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+			table[i] = c;
+		}
+	}
+
+	crc = ~crc;
+	while (len--)
+		crc = table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+
+	return ~crc;
+}
+
+static void put_le(std::vector<uint8_t> &b, uint64_t v, unsigned int bytes)
+{
+	while (bytes--) {
+		b.push_back(v & 0xff);
+		v >>= 8;
+	}
+}
+
+static uint64_t get_le(const uint8_t *p, unsigned int bytes)
+{
+	uint64_t v = 0;
+
+	while (bytes--)
+		v = (v << 8) | p[bytes];
+
+	return v;
+}
+
+static void put_varint(std::vector<uint8_t> &b, int64_t sv)
+{
+	/* Zig-zag first so small negative deltas stay short too */
+	uint64_t v = ((uint64_t)sv << 1) ^ (uint64_t)(sv >> 63);
+
+	while (v >= 0x80) {
+		b.push_back(v | 0x80);
+		v >>= 7;
+	}
+	b.push_back(v);
+}
+
+static int get_varint(const uint8_t *&p, const uint8_t *end, int64_t &sv)
+{
+	uint64_t v = 0;
+	unsigned int shift = 0;
+
+	do {
+		if (p == end || shift > 63)
+			return -EBADMSG;
+		v |= (uint64_t)(*p & 0x7f) << shift;
+		shift += 7;
+	} while (*p++ & 0x80);
+
+	sv = (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+
+	return 0;
+}
+
+static int pread_all(int fd, void *buf, std::size_t len, uint64_t off)
+{
+	uint8_t *p = static_cast<uint8_t *>(buf);
+	ssize_t n;
+
+	while (len) {
+		n = pread(fd, p, len, off);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return -errno;
+		if (!n)
+			return -ENODATA;
+		p += n;
+		off += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+/* Chunk CRC: the header up to the CRC field, then the payload */
+static uint32_t chunk_crc(const uint8_t *hdr, const uint8_t *payload,
+			  std::size_t len)
+{
+	return crc32(crc32(0, hdr, APDS9960_REC_CHUNK_HDR - 4), payload, len);
+}
+
+int record_writer::write_all(const void *buf, std::size_t len)
+{
+	const uint8_t *p = static_cast<const uint8_t *>(buf);
+	ssize_t n;
+
+	while (len) {
+		n = ::write(fd_, p, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return -errno;
+		p += n;
+		len -= n;
+		offset_ += n;
+	}
+
+	return 0;
+}
+
+int record_writer::open(const std::string &path, const scan_layout &layout,
+			unsigned int chunk_samples)
+{
+	std::vector<uint8_t> hdr;
+	int ret;
+
+	close();
+
+	if (!chunk_samples || layout.num_channels() > 0xffff)
+		return -EINVAL;
+
+	fd_ = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+		     0644);
+	if (fd_ < 0)
+		return -errno;
+
+	layout_ = &layout;
+	chunk_samples_ = chunk_samples;
+	offset_ = 0;
+	index_.clear();
+	prev_.assign(layout.num_channels(), 0);
+	nr_samples_ = 0;
+
+	put_le(hdr, APDS9960_REC_MAGIC, 4);
+	put_le(hdr, APDS9960_REC_VERSION, 2);
+	put_le(hdr, layout.num_channels(), 2);
+	for (std::size_t i = 0; i < layout.num_channels(); i++) {
+		const scan_channel &ch = layout.channel(i);
+		std::string type = scan_layout::type_string(ch);
+		std::size_t len = std::min<std::size_t>(ch.name.size(), 255);
+
+		hdr.push_back(len);
+		hdr.insert(hdr.end(), ch.name.begin(), ch.name.begin() + len);
+		hdr.push_back(type.size());
+		hdr.insert(hdr.end(), type.begin(), type.end());
+		put_varint(hdr, ch.index);
+	}
+	put_le(hdr, crc32(0, hdr.data(), hdr.size()), 4);
+
+	ret = write_all(hdr.data(), hdr.size());
+	if (ret) {
+		::close(fd_);
+		fd_ = -1;
+	}
+
+	return ret;
+}
+
+int record_writer::write(const batch &b)
+{
+	const int ts_chan = layout_->timestamp_channel();
+	const std::size_t nr = layout_->num_channels();
+	int ret;
+
+	for (sample s : b) {
+		if (!nr_samples_) {
+			first_ts_ = s.timestamp();
+			prev_ts_ = first_ts_;
+			prev_delta_ = 0;
+			std::fill(prev_.begin(), prev_.end(), 0);
+		}
+
+		if (ts_chan >= 0) {
+			int64_t ts = s.timestamp();
+			int64_t delta = ts - prev_ts_;
+
+			put_varint(payload_, delta - prev_delta_);
+			prev_delta_ = nr_samples_ ? delta : 0;
+			prev_ts_ = ts;
+		}
+
+		for (std::size_t i = 0; i < nr; i++) {
+			const scan_channel &ch = layout_->channel(i);
+
+			if ((int)i == ts_chan)
+				continue;
+
+			/* Repeats are coded against the previous element */
+			for (unsigned int r = 0; r < ch.repeat; r++) {
+				int64_t v = s.value(i, r);
+
+				put_varint(payload_, v - prev_[i]);
+				prev_[i] = v;
+			}
+		}
+
+		if (++nr_samples_ == chunk_samples_) {
+			ret = flush_chunk();
+			if (ret)
+				return ret;
+		}
+	}
+
+	return 0;
+}
+
+int record_writer::flush_chunk()
+{
+	std::vector<uint8_t> hdr;
+	record_chunk c;
+	int ret;
+
+	if (!nr_samples_)
+		return 0;
+
+	c.offset = offset_;
+	c.first_ts = first_ts_;
+	c.last_ts = prev_ts_;
+	c.nr_samples = nr_samples_;
+
+	put_le(hdr, APDS9960_REC_CHUNK_MAGIC, 4);
+	put_le(hdr, nr_samples_, 4);
+	put_le(hdr, payload_.size(), 4);
+	put_le(hdr, first_ts_, 8);
+	put_le(hdr, prev_ts_, 8);
+	put_le(hdr, chunk_crc(hdr.data(), payload_.data(), payload_.size()),
+	       4);
+
+	ret = write_all(hdr.data(), hdr.size());
+	if (!ret)
+		ret = write_all(payload_.data(), payload_.size());
+	if (ret)
+		return ret;
+
+	index_.push_back(c);
+	payload_.clear();
+	nr_samples_ = 0;
+
+	return 0;
+}
+
+int record_writer::close()
+{
+	std::vector<uint8_t> idx;
+	uint64_t idx_off;
+	int ret;
+
+	if (fd_ < 0)
+		return 0;
+
+	ret = flush_chunk();
+	if (ret)
+		goto out;
+
+	idx_off = offset_;
+	put_le(idx, APDS9960_REC_INDEX_MAGIC, 4);
+	put_le(idx, index_.size(), 4);
+	for (const record_chunk &c : index_) {
+		put_le(idx, c.offset, 8);
+		put_le(idx, c.first_ts, 8);
+		put_le(idx, c.last_ts, 8);
+		put_le(idx, c.nr_samples, 4);
+	}
+	put_le(idx, crc32(0, idx.data() + 8, idx.size() - 8), 4);
+	put_le(idx, idx_off, 8);
+	put_le(idx, APDS9960_REC_END_MAGIC, 4);
+
+	ret = write_all(idx.data(), idx.size());
+
+out:
+	if (::close(fd_) && !ret)
+		ret = -errno;
+	fd_ = -1;
+
+	return ret;
+}
+
+int record_reader::open(const std::string &path)
+{
+	uint8_t buf[4096];
+	const uint8_t *p, *end;
+	unsigned int nr;
+	struct stat st;
+	std::size_t len;
+	int ret;
+
+	close();
+
+	fd_ = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd_ < 0)
+		return -errno;
+
+	if (fstat(fd_, &st)) {
+		ret = -errno;
+		goto err;
+	}
+
+	len = std::min<uint64_t>(sizeof(buf), st.st_size);
+	ret = pread_all(fd_, buf, len, 0);
+	if (ret)
+		goto err;
+
+	ret = -EBADMSG;
+	if (len < 12 || get_le(buf, 4) != APDS9960_REC_MAGIC ||
+	    get_le(buf + 4, 2) != APDS9960_REC_VERSION)
+		goto err;
+
+	nr = get_le(buf + 6, 2);
+	p = buf + 8;
+	end = buf + len;
+	for (unsigned int i = 0; i < nr; i++) {
+		std::string name, type;
+		int64_t index;
+
+		if (p == end || end - p < 1 + *p + 1)
+			goto err;
+		name.assign((const char *)p + 1, *p);
+		p += 1 + *p;
+		if (end - p < 1 + *p)
+			goto err;
+		type.assign((const char *)p + 1, *p);
+		p += 1 + *p;
+		if (get_varint(p, end, index) ||
+		    layout_.add(name, index, type))
+			goto err;
+	}
+	if (end - p < 4 || get_le(p, 4) != crc32(0, buf, p - buf))
+		goto err;
+	layout_.compile();
+	data_start_ = p + 4 - buf;
+
+	ret = load_index();
+	if (ret)
+		ret = scan_chunks();
+	if (ret)
+		goto err;
+
+	return 0;
+
+err:
+	close();
+	return ret;
+}
+
+void record_reader::close()
+{
+	if (fd_ >= 0)
+		::close(fd_);
+	fd_ = -1;
+
+	layout_ = scan_layout();
+	index_.clear();
+	next_ = 0;
+}
+
+int record_reader::load_index()
+{
+	uint8_t foot[APDS9960_REC_FOOTER];
+	std::vector<uint8_t> idx;
+	uint64_t off, size;
+	struct stat st;
+	uint32_t nr;
+	int ret;
+
+	if (fstat(fd_, &st))
+		return -errno;
+	size = st.st_size;
+	if (size < data_start_ + APDS9960_REC_FOOTER + 12)
+		return -ENODATA;
+
+	ret = pread_all(fd_, foot, sizeof(foot), size - sizeof(foot));
+	if (ret)
+		return ret;
+	if (get_le(foot + 8, 4) != APDS9960_REC_END_MAGIC)
+		return -ENODATA;
+
+	off = get_le(foot, 8);
+	if (off < data_start_ || off > size - APDS9960_REC_FOOTER - 12)
+		return -EBADMSG;
+
+	idx.resize(size - APDS9960_REC_FOOTER - off);
+	ret = pread_all(fd_, idx.data(), idx.size(), off);
+	if (ret)
+		return ret;
+
+	nr = get_le(idx.data() + 4, 4);
+	if (get_le(idx.data(), 4) != APDS9960_REC_INDEX_MAGIC ||
+	    idx.size() != 12 + (uint64_t)nr * APDS9960_REC_INDEX_ENT ||
+	    get_le(idx.data() + idx.size() - 4, 4) !=
+	    crc32(0, idx.data() + 8, idx.size() - 12))
+		return -EBADMSG;
+
+	for (uint32_t i = 0; i < nr; i++) {
+		const uint8_t *e = idx.data() + 8 + i * APDS9960_REC_INDEX_ENT;
+
+		index_.push_back(record_chunk{ get_le(e, 8),
+					       (int64_t)get_le(e + 8, 8),
+					       (int64_t)get_le(e + 16, 8),
+					       (uint32_t)get_le(e + 24, 4) });
+	}
+
+	return 0;
+}
+
+int record_reader::scan_chunks()
+{
+	uint8_t hdr[APDS9960_REC_CHUNK_HDR];
+	uint64_t off = data_start_;
+	struct stat st;
+
+	if (fstat(fd_, &st))
+		return -errno;
+
+	/* No usable index: walk the chunks and keep every intact one */
+	index_.clear();
+	while (!pread_all(fd_, hdr, sizeof(hdr), off)) {
+		uint32_t len = get_le(hdr + 8, 4);
+
+		/* Bound the length before trusting it with an allocation */
+		if (get_le(hdr, 4) != APDS9960_REC_CHUNK_MAGIC ||
+		    off + sizeof(hdr) + len > (uint64_t)st.st_size)
+			break;
+
+		payload_.resize(len);
+		if (pread_all(fd_, payload_.data(), len, off + sizeof(hdr)) ||
+		    chunk_crc(hdr, payload_.data(), len) !=
+			    get_le(hdr + 28, 4))
+			break;
+
+		index_.push_back(record_chunk{ off, (int64_t)get_le(hdr + 12, 8),
+					       (int64_t)get_le(hdr + 20, 8),
+					       (uint32_t)get_le(hdr + 4, 4) });
+		off += sizeof(hdr) + len;
+	}
+
+	return 0;
+}
+
+int record_reader::decode(const uint8_t *p, std::size_t len,
+			  uint32_t nr_samples, int64_t first_ts)
+{
+	const std::size_t sz = layout_.scan_bytes();
+	const std::size_t nr = layout_.num_channels();
+	const int ts_chan = layout_.timestamp_channel();
+	const uint8_t *end = p + len;
+	std::vector<int64_t> prev(nr, 0);
+	int64_t ts = first_ts, delta = 0, d;
+	int ret;
+
+	scans_.assign((std::size_t)nr_samples * sz, 0);
+
+	for (uint32_t n = 0; n < nr_samples; n++) {
+		uint8_t *scan = &scans_[n * sz];
+
+		if (ts_chan >= 0) {
+			ret = get_varint(p, end, d);
+			if (ret)
+				return ret;
+			delta += d;
+			ts += delta;
+			layout_.encode(scan, ts_chan, ts);
+		}
+
+		for (std::size_t i = 0; i < nr; i++) {
+			if ((int)i == ts_chan)
+				continue;
+
+			for (unsigned int r = 0; r < layout_.channel(i).repeat;
+			     r++) {
+				ret = get_varint(p, end, d);
+				if (ret)
+					return ret;
+				prev[i] += d;
+				layout_.encode(scan, i, prev[i], r);
+			}
+		}
+	}
+
+	return p == end ? 0 : -EBADMSG;
+}
+
+int record_reader::read_chunk(std::size_t idx, batch &out)
+{
+	uint8_t hdr[APDS9960_REC_CHUNK_HDR];
+	const record_chunk &c = index_.at(idx);
+	struct stat st;
+	uint32_t len;
+	int ret;
+
+	ret = pread_all(fd_, hdr, sizeof(hdr), c.offset);
+	if (ret)
+		return ret;
+	if (fstat(fd_, &st))
+		return -errno;
+
+	len = get_le(hdr + 8, 4);
+	if (get_le(hdr, 4) != APDS9960_REC_CHUNK_MAGIC ||
+	    get_le(hdr + 4, 4) != c.nr_samples ||
+	    c.offset + sizeof(hdr) + len > (uint64_t)st.st_size)
+		return -EBADMSG;
+
+	payload_.resize(len);
+	ret = pread_all(fd_, payload_.data(), len, c.offset + sizeof(hdr));
+	if (ret)
+		return ret;
+	if (chunk_crc(hdr, payload_.data(), len) != get_le(hdr + 28, 4))
+		return -EBADMSG;
+
+	ret = decode(payload_.data(), len, c.nr_samples,
+		     get_le(hdr + 12, 8));
+	if (ret)
+		return ret;
+
+	out = batch(&layout_, span<const uint8_t>(scans_.data(),
+						  scans_.size()));
+
+	return out.size();
+}
+
+int record_reader::next(batch &out)
+{
+	if (next_ >= index_.size())
+		return 0;
+
+	return read_chunk(next_++, out);
+}
+
+std::size_t record_reader::seek_chunk(int64_t ts) const
+{
+	auto it = std::lower_bound(index_.begin(), index_.end(), ts,
+				   [](const record_chunk &c, int64_t t) {
+					   return c.last_ts < t;
+				   });
+
+	return it - index_.begin();
+}
+
+} /* namespace apds9960 */
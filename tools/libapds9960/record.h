@@ -0,0 +1,121 @@
+#ifndef _APDS9960_RECORD_H_
+#define _APDS9960_RECORD_H_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "scan.h"
+
+namespace apds9960 {
+
+/*
+ * Recording file layout, all integers little endian:
+ *
+ *   header:  "A96R" u16 version u16 nr_channels
+ *            nr_channels x (u8 len, name, u8 len, type, zigzag index)
+ *            u32 crc32 of the above
+ *   chunk:   "A96C" u32 nr_samples u32 payload_len
+ *            s64 first_ts s64 last_ts u32 crc32
+ *            payload
+ *            where the crc32 covers the 28 header bytes before it and
+ *            then the payload, so a damaged length or count is caught
+ *   index:   "A96I" u32 nr_chunks
+ *            nr_chunks x (u64 offset s64 first_ts s64 last_ts u32 nr_samples)
+ *            u32 crc32 of the entries
+ *   footer:  u64 index offset "A96E"
+ *
+ * A payload holds, per sample, the timestamp as a zig-zag varint
+ * delta-of-delta followed by every other channel (and repeat) as a zig-zag
+ * varint delta against the previous sample. The first sample of a chunk is
+ * coded against zero so chunks decode on their own.
+ *
+ * A file without index and footer (e.g. the recorder was killed) is still
+ * readable front to back; every complete chunk is checked by its CRC.
+ */
+#define APDS9960_REC_MAGIC		0x52363941	/* "A96R" */
+#define APDS9960_REC_CHUNK_MAGIC	0x43363941	/* "A96C" */
+#define APDS9960_REC_INDEX_MAGIC	0x49363941	/* "A96I" */
+#define APDS9960_REC_END_MAGIC		0x45363941	/* "A96E" */
+#define APDS9960_REC_VERSION		2
+
+uint32_t crc32(uint32_t crc, const void *buf, std::size_t len);
+
+struct record_chunk {
+	uint64_t offset;
+	int64_t first_ts;
+	int64_t last_ts;
+	uint32_t nr_samples;
+};
+
+class record_writer {
+public:
+	record_writer() = default;
+	record_writer(const record_writer &) = delete;
+	record_writer &operator=(const record_writer &) = delete;
+	~record_writer() { close(); }
+
+	int open(const std::string &path, const scan_layout &layout,
+		 unsigned int chunk_samples = 4096);
+	int write(const batch &b);
+	/* Flush the last chunk and write index and footer */
+	int close();
+
+	uint64_t bytes_written() const { return offset_; }
+
+private:
+	int flush_chunk();
+	int write_all(const void *buf, std::size_t len);
+
+	const scan_layout *layout_ = nullptr;
+	std::vector<uint8_t> payload_;
+	std::vector<int64_t> prev_;
+	std::vector<record_chunk> index_;
+	unsigned int chunk_samples_ = 0;
+	uint32_t nr_samples_ = 0;
+	int64_t first_ts_ = 0;
+	int64_t prev_ts_ = 0;
+	int64_t prev_delta_ = 0;
+	uint64_t offset_ = 0;
+	int fd_ = -1;
+};
+
+class record_reader {
+public:
+	record_reader() = default;
+	record_reader(const record_reader &) = delete;
+	record_reader &operator=(const record_reader &) = delete;
+	~record_reader() { close(); }
+
+	int open(const std::string &path);
+	void close();
+
+	const scan_layout &layout() const { return layout_; }
+	const std::vector<record_chunk> &chunks() const { return index_; }
+
+	/* Decode one chunk into raw scans and return them as a batch */
+	int read_chunk(std::size_t idx, batch &out);
+	/* Sequential access, returns 0 at the end of the recording */
+	int next(batch &out);
+
+	/* First chunk that may contain samples at or after ts */
+	std::size_t seek_chunk(int64_t ts) const;
+
+private:
+	int load_index();
+	int scan_chunks();
+	int decode(const uint8_t *p, std::size_t len, uint32_t nr_samples,
+		   int64_t first_ts);
+
+	scan_layout layout_;
+	std::vector<record_chunk> index_;
+	std::vector<uint8_t> payload_;
+	std::vector<uint8_t> scans_;
+	std::size_t next_ = 0;
+	uint64_t data_start_ = 0;
+	int fd_ = -1;
+};
+
+} /* namespace apds9960 */
+
+#endif /* _APDS9960_RECORD_H_ */
@@ -0,0 +1,365 @@
+#include "reg_replay.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <fcntl.h>
+#include <linux/i2c-dev.h>
+#include <linux/i2c.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
+
+namespace apds9960 {
+
+/* The registers the emulation touches, as in the driver */
+#define REG_ENABLE		0x80
+#define REG_ENABLE_PON		0x01
+#define REG_ENABLE_AEN		0x02
+#define REG_ENABLE_PEN		0x04
+#define REG_ENABLE_AIEN		0x10
+#define REG_ENABLE_PIEN		0x20
+#define REG_ATIME		0x81
+#define REG_AILTL		0x84
+#define REG_AIHTL		0x86
+#define REG_PILT		0x89
+#define REG_PIHT		0x8b
+#define REG_PERS		0x8c
+#define REG_CONFIG_2		0x90
+#define REG_CONFIG_2_CPSIEN	0x40
+#define REG_ID			0x92
+#define REG_STATUS		0x93
+#define REG_STATUS_AVALID	0x01
+#define REG_STATUS_PVALID	0x02
+#define REG_STATUS_AINT		0x10
+#define REG_STATUS_PINT		0x20
+#define REG_STATUS_CPSAT	0x80
+#define REG_STATUS_NON_GESTURE	0xf0
+#define REG_CDATAL		0x94
+#define REG_PDATA		0x9c
+#define REG_CONFIG_3		0x9f
+#define REG_CONFIG_3_SAI	0x10
+#define REG_AICLEAR		0xe7
+
+#define APDS9960_ID		0xab
+
+int i2c_stub::open(const std::string &dev, unsigned int addr)
+{
+	close();
+
+	fd_ = ::open(dev.c_str(), O_RDWR | O_CLOEXEC);
+	if (fd_ < 0)
+		return -errno;
+
+	if (ioctl(fd_, I2C_SLAVE_FORCE, addr) < 0) {
+		int ret = -errno;
+
+		close();
+		return ret;
+	}
+
+	return 0;
+}
+
+void i2c_stub::close()
+{
+	if (fd_ >= 0)
+		::close(fd_);
+	fd_ = -1;
+}
+
+int i2c_stub::read(uint8_t reg, uint8_t &val)
+{
+	union i2c_smbus_data data;
+	struct i2c_smbus_ioctl_data args = {
+		I2C_SMBUS_READ, reg, I2C_SMBUS_BYTE_DATA, &data,
+	};
+
+	if (ioctl(fd_, I2C_SMBUS, &args) < 0)
+		return -errno;
+	val = data.byte;
+
+	return 0;
+}
+
+int i2c_stub::write(uint8_t reg, uint8_t val)
+{
+	union i2c_smbus_data data;
+	struct i2c_smbus_ioctl_data args = {
+		I2C_SMBUS_WRITE, reg, I2C_SMBUS_BYTE_DATA, &data,
+	};
+
+	data.byte = val;
+
+	return ioctl(fd_, I2C_SMBUS, &args) < 0 ? -errno : 0;
+}
+
+static int64_t now_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int register_replay::setup(const scan_layout &layout)
+{
+	static const char *const names[] = {
+		"in_intensity_clear", "in_intensity_red",
+		"in_intensity_green", "in_intensity_blue", "in_proximity",
+	};
+	bool any = false;
+
+	for (int i = 0; i < 5; i++) {
+		chan_[i] = layout.find(names[i]);
+		any |= chan_[i] >= 0;
+	}
+
+	return any ? 0 : -EINVAL;
+}
+
+int register_replay::reset()
+{
+	int ret;
+
+	if (asserted_ && t_.irq) {
+		ret = t_.irq(false);
+		if (ret)
+			return ret;
+	}
+
+	status_ = 0;
+	asserted_ = false;
+	als_count_ = 0;
+	prox_count_ = 0;
+
+	ret = t_.write(REG_ID, APDS9960_ID);
+	if (!ret)
+		ret = t_.write(REG_STATUS, 0);
+	if (!ret)
+		ret = t_.write(REG_AICLEAR, 0);
+	for (int i = 0; i < 4 && !ret; i++)
+		ret = write_le16(REG_CDATAL + 2 * i, 0);
+	if (!ret)
+		ret = t_.write(REG_PDATA, 0);
+
+	return ret;
+}
+
+int register_replay::read_le16(uint8_t reg, unsigned int &val)
+{
+	uint8_t lo, hi;
+	int ret;
+
+	ret = t_.read(reg, lo);
+	if (!ret)
+		ret = t_.read(reg + 1, hi);
+	if (!ret)
+		val = lo | hi << 8;
+
+	return ret;
+}
+
+int register_replay::write_le16(uint8_t reg, unsigned int val)
+{
+	int ret;
+
+	ret = t_.write(reg, val & 0xff);
+	if (!ret)
+		ret = t_.write(reg + 1, val >> 8);
+
+	return ret;
+}
+
+/* AICLEAR is write-only on the chip; in the stub it keeps what was written */
+int register_replay::check_ack(bool &acked)
+{
+	uint8_t v;
+	int ret;
+
+	acked = false;
+
+	ret = t_.read(REG_AICLEAR, v);
+	if (ret || !v)
+		return ret;
+
+	acked = true;
+	status_ &= ~REG_STATUS_NON_GESTURE;
+
+	ret = t_.write(REG_AICLEAR, 0);
+	if (!ret)
+		ret = t_.write(REG_STATUS, status_);
+	if (!ret && asserted_) {
+		asserted_ = false;
+		if (t_.irq)
+			ret = t_.irq(false);
+	}
+
+	return ret;
+}
+
+/* Pull the line and give the driver the timeout to acknowledge it */
+int register_replay::raise()
+{
+	const int64_t end = now_ns() + (int64_t)cfg_.ack_timeout_ms * 1000000;
+	bool acked;
+	int ret;
+
+	ret = t_.irq(true);
+	if (ret)
+		return ret;
+	asserted_ = true;
+	interrupts_++;
+
+	for (;;) {
+		ret = check_ack(acked);
+		if (ret || acked)
+			return ret;
+		if (now_ns() >= end)
+			break;
+		usleep(50);
+	}
+
+	/* Like the chip, keep it latched until the driver gets to it */
+	missed_acks_++;
+
+	return 0;
+}
+
+/* APERS 0 fires every cycle, 1-3 after as many, then in steps of five */
+static unsigned int als_persistence(unsigned int apers)
+{
+	return apers <= 3 ? apers : 5 * (apers - 3);
+}
+
+int register_replay::present(const sample &s)
+{
+	uint8_t enable, config_3, pers, v;
+	bool acked, fire = false;
+	unsigned int lo, hi;
+	int ret;
+
+	cycles_++;
+
+	if (status_ & REG_STATUS_NON_GESTURE) {
+		ret = check_ack(acked);
+		if (ret)
+			return ret;
+	}
+
+	ret = t_.read(REG_ENABLE, enable);
+	if (!ret)
+		ret = t_.read(REG_CONFIG_3, config_3);
+	if (!ret)
+		ret = t_.read(REG_PERS, pers);
+	if (ret)
+		return ret;
+
+	/* Powered down, or asleep after an interrupt with SAI: no cycle */
+	if (!(enable & REG_ENABLE_PON) ||
+	    ((config_3 & REG_CONFIG_3_SAI) &&
+	     (status_ & REG_STATUS_NON_GESTURE)))
+		return 0;
+
+	if (enable & REG_ENABLE_AEN) {
+		int64_t full, clear = 0;
+		bool out;
+
+		ret = t_.read(REG_ATIME, v);
+		if (ret)
+			return ret;
+		full = std::min(65535, 1025 * (256 - v));
+
+		for (int i = 0; i < 4; i++) {
+			int64_t val = chan_[i] < 0 ? 0 : s.value(chan_[i]);
+
+			val = std::clamp<int64_t>(val, 0, full);
+			if (!i)
+				clear = val;
+			ret = write_le16(REG_CDATAL + 2 * i, val);
+			if (ret)
+				return ret;
+		}
+
+		status_ |= REG_STATUS_AVALID;
+		if (chan_[0] >= 0 && clear >= full)
+			status_ |= REG_STATUS_CPSAT;
+
+		ret = read_le16(REG_AILTL, lo);
+		if (!ret)
+			ret = read_le16(REG_AIHTL, hi);
+		if (ret)
+			return ret;
+
+		out = clear < lo || clear > hi;
+		als_count_ = out ? als_count_ + 1 : 0;
+		if (!(pers & 0x0f) ||
+		    (out && als_count_ >= als_persistence(pers & 0x0f)))
+			status_ |= REG_STATUS_AINT;
+	}
+
+	if (enable & REG_ENABLE_PEN) {
+		int64_t prox = chan_[4] < 0 ? 0 : s.value(chan_[4]);
+		bool out;
+
+		prox = std::clamp<int64_t>(prox, 0, 255);
+		ret = t_.write(REG_PDATA, prox);
+		if (ret)
+			return ret;
+
+		status_ |= REG_STATUS_PVALID;
+
+		ret = t_.read(REG_PILT, v);
+		lo = v;
+		if (!ret)
+			ret = t_.read(REG_PIHT, v);
+		hi = v;
+		if (ret)
+			return ret;
+
+		out = prox < lo || prox > hi;
+		prox_count_ = out ? prox_count_ + 1 : 0;
+		if (!(pers >> 4) || (out && prox_count_ >= (pers >> 4u)))
+			status_ |= REG_STATUS_PINT;
+	}
+
+	ret = t_.write(REG_STATUS, status_);
+	if (ret)
+		return ret;
+
+	if (t_.irq && !asserted_) {
+		ret = t_.read(REG_CONFIG_2, v);
+		if (ret)
+			return ret;
+
+		fire = ((status_ & REG_STATUS_AINT) &&
+			(enable & REG_ENABLE_AIEN)) ||
+		       ((status_ & REG_STATUS_PINT) &&
+			(enable & REG_ENABLE_PIEN)) ||
+		       ((status_ & REG_STATUS_CPSAT) &&
+			(v & REG_CONFIG_2_CPSIEN));
+	}
+
+	if (fire) {
+		ret = raise();
+		if (ret)
+			return ret;
+	}
+
+	return t_.trigger ? t_.trigger() : 0;
+}
+
+int register_replay::present(const batch &b)
+{
+	int ret;
+
+	for (sample s : b) {
+		ret = present(s);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+} /* namespace apds9960 */
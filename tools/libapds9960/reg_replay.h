@@ -0,0 +1,115 @@
+#ifndef _APDS9960_REG_REPLAY_H_
+#define _APDS9960_REG_REPLAY_H_
+
+#include <cstdint>
+#include <functional>
+#include <string>
+
+#include "scan.h"
+
+namespace apds9960 {
+
+/*
+ * Register file and interrupt line of an emulated chip. read and write
+ * return 0 or a negative errno. irq is optional: it asserts (true) or
+ * releases (false) the interrupt line. trigger is optional as well and is
+ * called after every cycle, for a driver running off an IIO trigger
+ * instead of the interrupt.
+ */
+struct reg_target {
+	std::function<int(uint8_t reg, uint8_t &val)> read;
+	std::function<int(uint8_t reg, uint8_t val)> write;
+	std::function<int(bool asserted)> irq;
+	std::function<int()> trigger;
+};
+
+/*
+ * An i2c-stub chip, the register file the real driver gets bound to:
+ *
+ *   modprobe i2c-stub chip_addr=0x39
+ *   echo apds9960 0x39 > /sys/bus/i2c/devices/i2c-N/new_device
+ *
+ * The driver owns the address, so it is accessed with I2C_SLAVE_FORCE.
+ */
+class i2c_stub {
+public:
+	i2c_stub() = default;
+	i2c_stub(const i2c_stub &) = delete;
+	i2c_stub &operator=(const i2c_stub &) = delete;
+	~i2c_stub() { close(); }
+
+	int open(const std::string &dev, unsigned int addr = 0x39);
+	void close();
+
+	int read(uint8_t reg, uint8_t &val);
+	int write(uint8_t reg, uint8_t val);
+
+private:
+	int fd_ = -1;
+};
+
+struct reg_replay_config {
+	/* How long the driver gets to write AICLEAR after an interrupt */
+	unsigned int ack_timeout_ms = 100;
+};
+
+/*
+ * Drives the chip side of the driver from a recording: every sample is one
+ * integration cycle. present() reads back what the driver configured
+ * (ENABLE, ATIME, thresholds, persistence, CONFIG_2/3), loads the data
+ * registers of the engines that are on, sets the VALID, INT and CPSAT bits
+ * in STATUS the way the chip would, and raises the interrupt line when an
+ * enabled interrupt fires. It then waits for the driver's AICLEAR before
+ * the next cycle, so the replay runs as fast as the driver keeps up and the
+ * driver's IRQ, AGC, event and buffer logic all see the recorded data.
+ *
+ * Not emulated: gesture, PGSAT (there is no analog model behind PDATA),
+ * PICLEAR/CICLEAR (the driver only uses AICLEAR) and gain. Values are
+ * loaded as recorded, so a gain or ATIME change by the driver does not
+ * rescale them; they are only clamped to the current full scale. Record
+ * with calibration and the low-pass filter off so that the buffer holds
+ * the register values.
+ */
+class register_replay {
+public:
+	register_replay(const reg_target &t, const reg_replay_config &cfg = {})
+		: t_(t), cfg_(cfg) {}
+
+	/* Map the recording's channels onto data registers */
+	int setup(const scan_layout &layout);
+	/* Power-on state: ID, STATUS and the data registers */
+	int reset();
+
+	int present(const sample &s);
+	int present(const batch &b);
+
+	uint64_t cycles() const { return cycles_; }
+	uint64_t interrupts() const { return interrupts_; }
+	/* Interrupts the driver had not acknowledged within the timeout */
+	uint64_t missed_acks() const { return missed_acks_; }
+	bool line_asserted() const { return asserted_; }
+
+private:
+	int read_le16(uint8_t reg, unsigned int &val);
+	int write_le16(uint8_t reg, unsigned int val);
+	int check_ack(bool &acked);
+	int raise();
+
+	reg_target t_;
+	reg_replay_config cfg_;
+
+	/* Recording channel for clear, red, green, blue, proximity or -1 */
+	int chan_[5] = { -1, -1, -1, -1, -1 };
+	uint8_t status_ = 0;
+	bool asserted_ = false;
+	unsigned int als_count_ = 0;
+	unsigned int prox_count_ = 0;
+
+	uint64_t cycles_ = 0;
+	uint64_t interrupts_ = 0;
+	uint64_t missed_acks_ = 0;
+};
+
+} /* namespace apds9960 */
+
+#endif /* _APDS9960_REG_REPLAY_H_ */
@@ -0,0 +1,175 @@
+#include "replay.h"
+
+#include <cerrno>
+#include <cstdlib>
+#include <string>
+#include <time.h>
+#include <vector>
+
+namespace apds9960 {
+
+static int64_t now_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* A signal that calls replay::stop() cuts the sleep short */
+static void sleep_until_ns(int64_t t, const volatile bool &stop)
+{
+	struct timespec ts;
+
+	ts.tv_sec = t / 1000000000;
+	ts.tv_nsec = t % 1000000000;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr) ==
+	       EINTR && !stop)
+		;
+}
+
+int replay::run(const replay_config &cfg, handler h)
+{
+	const int64_t period = (int64_t)cfg.min_period_us * 1000;
+	int64_t start = 0, base_ts = 0;
+	bool first = true;
+	std::size_t c = 0;
+	batch b;
+	int ret;
+
+	if (cfg.speed < 0)
+		return -EINVAL;
+
+	auto due = [&](std::size_t i) {
+		return start + (int64_t)((b[i].timestamp() - base_ts) /
+					 cfg.speed);
+	};
+
+	stop_ = false;
+	samples_ = 0;
+
+	while (!stop_) {
+		std::size_t i = 0, j;
+
+		if (c == r_.chunks().size()) {
+			if (!cfg.loop || !c)
+				return 0;
+			c = 0;
+			first = true;
+		}
+
+		ret = r_.read_chunk(c++, b);
+		if (ret < 0)
+			return ret;
+		if (b.empty())
+			continue;
+
+		if (first) {
+			start = now_ns();
+			base_ts = b[0].timestamp();
+			first = false;
+		}
+
+		while (i < b.size() && !stop_) {
+			if (cfg.speed == 0) {
+				j = b.size();
+			} else {
+				if (due(i) > now_ns()) {
+					sleep_until_ns(due(i), stop_);
+					if (stop_)
+						break;
+				}
+
+				/* Take along everything due before the next wakeup */
+				const int64_t horizon = now_ns() + period;
+
+				for (j = i + 1; j < b.size() && due(j) <= horizon; j++)
+					;
+			}
+
+			ret = h(batch(b.layout(), b.bytes().subspan(
+				i * b.layout()->scan_bytes(),
+				(j - i) * b.layout()->scan_bytes())));
+			if (ret)
+				return ret;
+
+			samples_ += j - i;
+			i = j;
+		}
+	}
+
+	return 0;
+}
+
+int replay_diff(record_reader &a, record_reader &b, int64_t tolerance,
+		diff_result &res)
+{
+	const scan_layout &la = a.layout(), &lb = b.layout();
+	std::vector<std::pair<std::size_t, std::size_t>> map;
+	std::size_t ca = 0, cb = 0, ia = 0, ib = 0;
+	batch ba, bb;
+	int ret;
+
+	res = diff_result{ 0, 0, -1, -1 };
+
+	for (std::size_t i = 0; i < la.num_channels(); i++) {
+		int j = lb.find(la.channel(i).name);
+
+		if ((int)i == la.timestamp_channel() || j < 0)
+			continue;
+		map.emplace_back(i, j);
+	}
+	if (map.empty())
+		return -EINVAL;
+
+	for (;;) {
+		if (ia == ba.size()) {
+			if (ca == a.chunks().size())
+				break;
+			ret = a.read_chunk(ca++, ba);
+			if (ret < 0)
+				return ret;
+			ia = 0;
+			continue;
+		}
+		if (ib == bb.size()) {
+			if (cb == b.chunks().size())
+				break;
+			ret = b.read_chunk(cb++, bb);
+			if (ret < 0)
+				return ret;
+			ib = 0;
+			continue;
+		}
+
+		sample sa = ba[ia++], sb = bb[ib++];
+		bool bad = false;
+
+		for (const auto &m : map) {
+			if (std::llabs(sa.value(m.first) - sb.value(m.second)) <=
+			    tolerance)
+				continue;
+			if (res.first_sample < 0) {
+				res.first_sample = res.compared;
+				res.first_channel = m.first;
+			}
+			bad = true;
+		}
+
+		res.mismatched += bad;
+		res.compared++;
+	}
+
+	/* Different lengths count as a mismatch of the tail */
+	if (ia != ba.size() || ib != bb.size() || ca != a.chunks().size() ||
+	    cb != b.chunks().size()) {
+		if (res.first_sample < 0)
+			res.first_sample = res.compared;
+		res.mismatched++;
+	}
+
+	return 0;
+}
+
+} /* namespace apds9960 */
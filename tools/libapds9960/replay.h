@@ -0,0 +1,66 @@
+#ifndef _APDS9960_REPLAY_H_
+#define _APDS9960_REPLAY_H_
+
+#include <cstdint>
+#include <functional>
+
+#include "record.h"
+
+namespace apds9960 {
+
+struct replay_config {
+	/* 1.0 is real time, 0 means as fast as possible */
+	double speed = 1.0;
+	/* Shortest sleep between deliveries; later samples are batched */
+	unsigned int min_period_us = 1000;
+	/* Restart from the first chunk when reaching the end */
+	bool loop = false;
+};
+
+/*
+ * Plays a recording back through the same batch interface the live device
+ * uses, spaced out by the recorded timestamps (scaled by 'speed'). Samples
+ * due within one wakeup are handed over as a single batch, so high speed
+ * factors cost few wakeups rather than one per sample.
+ *
+ * The handler decides where the samples go: publishing them feeds the
+ * consumers of the buffer only, while handing them to register_replay
+ * (reg_replay.h) replays them through the chip's registers and interrupt
+ * line, so the driver's IRQ, AGC, event and buffer logic runs on them.
+ */
+class replay {
+public:
+	using handler = std::function<int(const batch &b)>;
+
+	explicit replay(record_reader &r) : r_(r) {}
+
+	/* Returns 0 at the end, or the first non-zero value from the handler */
+	int run(const replay_config &cfg, handler h);
+	void stop() { stop_ = true; }
+
+	uint64_t samples() const { return samples_; }
+
+private:
+	record_reader &r_;
+	uint64_t samples_ = 0;
+	volatile bool stop_ = false;
+};
+
+struct diff_result {
+	uint64_t compared;
+	uint64_t mismatched;
+	/* Sample index and channel of the first mismatch, -1 if none */
+	int64_t first_sample;
+	int first_channel;
+};
+
+/*
+ * Compare two recordings channel by channel (matched by name), allowing
+ * each value to differ by up to 'tolerance'. Timestamps are ignored.
+ */
+int replay_diff(record_reader &a, record_reader &b, int64_t tolerance,
+		diff_result &res);
+
+} /* namespace apds9960 */
+
+#endif /* _APDS9960_REPLAY_H_ */
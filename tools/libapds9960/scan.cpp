@@ -0,0 +1,176 @@
+#include "scan.h"
+#include "sysfs.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <dirent.h>
+
+namespace apds9960 {
+
+int scan_layout::parse_type(const std::string &type, scan_channel &ch)
+{
+	char endian, sign;
+	unsigned int bits, storagebits, repeat = 1, shift = 0;
+	int n = -1;
+
+	if (sscanf(type.c_str(), "%ce:%c%u/%uX%u>>%u%n", &endian, &sign,
+		   &bits, &storagebits, &repeat, &shift, &n) != 6) {
+		repeat = 1;
+		if (sscanf(type.c_str(), "%ce:%c%u/%u>>%u%n", &endian, &sign,
+			   &bits, &storagebits, &shift, &n) != 5)
+			return -EINVAL;
+	}
+
+	/* sscanf() stops at the last field, whatever follows it */
+	if (n < 0 || (std::size_t)n != type.size())
+		return -EINVAL;
+
+	if ((endian != 'b' && endian != 'l') || (sign != 's' && sign != 'u'))
+		return -EINVAL;
+	if (storagebits != 8 && storagebits != 16 && storagebits != 32 &&
+	    storagebits != 64)
+		return -EINVAL;
+	if (!bits || bits + shift > storagebits || !repeat)
+		return -EINVAL;
+
+	ch.be = endian == 'b';
+	ch.is_signed = sign == 's';
+	ch.bits = bits;
+	ch.storagebits = storagebits;
+	ch.shift = shift;
+	ch.repeat = repeat;
+
+	return 0;
+}
+
+std::string scan_layout::type_string(const scan_channel &ch)
+{
+	char buf[48];
+
+	if (ch.repeat > 1)
+		snprintf(buf, sizeof(buf), "%ce:%c%u/%uX%u>>%u",
+			 ch.be ? 'b' : 'l', ch.is_signed ? 's' : 'u', ch.bits,
+			 ch.storagebits, ch.repeat, ch.shift);
+	else
+		snprintf(buf, sizeof(buf), "%ce:%c%u/%u>>%u",
+			 ch.be ? 'b' : 'l', ch.is_signed ? 's' : 'u', ch.bits,
+			 ch.storagebits, ch.shift);
+
+	return buf;
+}
+
+int scan_layout::add(const std::string &name, int index,
+		     const std::string &type)
+{
+	scan_channel ch = {};
+	int ret;
+
+	ret = parse_type(type, ch);
+	if (ret)
+		return ret;
+
+	ch.name = name;
+	ch.index = index;
+	channels_.push_back(ch);
+
+	return 0;
+}
+
+int scan_layout::load(const std::string &dev_dir)
+{
+	const std::string dir = dev_dir + "/scan_elements/";
+	struct dirent *ent;
+	DIR *dp;
+	int ret = 0;
+
+	channels_.clear();
+
+	dp = opendir(dir.c_str());
+	if (!dp)
+		return -errno;
+
+	while ((ent = readdir(dp))) {
+		std::string en = ent->d_name;
+		std::string name, type;
+		long long val, index;
+
+		if (en.size() <= 3 || en.compare(en.size() - 3, 3, "_en"))
+			continue;
+		name = en.substr(0, en.size() - 3);
+
+		ret = sysfs_read_int(dir + en, val);
+		if (ret)
+			break;
+		if (!val)
+			continue;
+
+		ret = sysfs_read_int(dir + name + "_index", index);
+		if (ret)
+			break;
+		ret = sysfs_read(dir + name + "_type", type);
+		if (ret)
+			break;
+
+		ret = add(name, index, type);
+		if (ret)
+			break;
+	}
+	closedir(dp);
+
+	if (ret)
+		return ret;
+	if (channels_.empty())
+		return -ENODATA;
+
+	compile();
+
+	return 0;
+}
+
+void scan_layout::compile()
+{
+	std::size_t bytes = 0, largest = 0;
+
+	std::sort(channels_.begin(), channels_.end(),
+		  [](const scan_channel &a, const scan_channel &b) {
+			  return a.index < b.index;
+		  });
+
+	/* Same packing rules as iio_compute_scan_bytes() in the IIO core */
+	ts_chan_ = -1;
+	for (std::size_t i = 0; i < channels_.size(); i++) {
+		scan_channel &ch = channels_[i];
+		std::size_t length;
+
+		ch.bytes = ch.storagebits / 8;
+		length = ch.bytes * ch.repeat;
+		bytes = (bytes + length - 1) / length * length;
+
+		ch.offset = bytes;
+		ch.mask = ch.bits == 64 ? ~0ULL : (1ULL << ch.bits) - 1;
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+		ch.swap = !ch.be && ch.bytes > 1;
+#else
+		ch.swap = ch.be && ch.bytes > 1;
+#endif
+		bytes += length;
+		largest = std::max(largest, length);
+
+		if (ch.name == "in_timestamp" || ch.name == "timestamp")
+			ts_chan_ = i;
+	}
+
+	scan_bytes_ = largest ? (bytes + largest - 1) / largest * largest : 0;
+}
+
+int scan_layout::find(const std::string &name) const
+{
+	for (std::size_t i = 0; i < channels_.size(); i++)
+		if (channels_[i].name == name)
+			return i;
+
+	return -ENOENT;
+}
+
+} /* namespace apds9960 */
@@ -0,0 +1,233 @@
+#ifndef _APDS9960_SCAN_H_
+#define _APDS9960_SCAN_H_
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "span.h"
+
+namespace apds9960 {
+
+/*
+ * One enabled scan element, as described by scan_elements/<name>_type.
+ * The fields after 'repeat' are derived once by scan_layout::compile() so
+ * that decoding a sample is a load, an optional byte swap, a shift and a
+ * mask with no string handling left in the hot path.
+ */
+struct scan_channel {
+	std::string name;
+	int index;
+	bool be;
+	bool is_signed;
+	unsigned int bits;
+	unsigned int storagebits;
+	unsigned int shift;
+	unsigned int repeat;
+
+	unsigned int offset;
+	unsigned int bytes;
+	bool swap;
+	uint64_t mask;
+};
+
+class scan_layout {
+public:
+	/* Parse "[be|le]:[s|u]bits/storagebits[Xrepeat]>>shift" */
+	static int parse_type(const std::string &type, scan_channel &ch);
+
+	/* Load the enabled elements from <dev_dir>/scan_elements */
+	int load(const std::string &dev_dir);
+
+	/* Add a channel by hand, e.g. when the layout comes from a file */
+	int add(const std::string &name, int index, const std::string &type);
+
+	/* Sort by index and compute offsets, masks and the scan size */
+	void compile();
+
+	std::size_t scan_bytes() const { return scan_bytes_; }
+	std::size_t num_channels() const { return channels_.size(); }
+	const scan_channel &channel(std::size_t i) const { return channels_[i]; }
+	int find(const std::string &name) const;
+	int timestamp_channel() const { return ts_chan_; }
+
+	/* Render a channel back into its sysfs type string */
+	static std::string type_string(const scan_channel &ch);
+
+	int64_t decode(const uint8_t *scan, std::size_t i,
+		       unsigned int rep = 0) const
+	{
+		const scan_channel &ch = channels_[i];
+		const uint8_t *p = scan + ch.offset + rep * ch.bytes;
+		uint64_t v;
+
+		switch (ch.bytes) {
+		case 1:
+			v = *p;
+			break;
+		case 2: {
+			uint16_t t;
+
+			memcpy(&t, p, 2);
+			v = ch.swap ? __builtin_bswap16(t) : t;
+			break;
+		}
+		case 4: {
+			uint32_t t;
+
+			memcpy(&t, p, 4);
+			v = ch.swap ? __builtin_bswap32(t) : t;
+			break;
+		}
+		default:
+			memcpy(&v, p, 8);
+			if (ch.swap)
+				v = __builtin_bswap64(v);
+			break;
+		}
+
+		v = (v >> ch.shift) & ch.mask;
+		if (ch.is_signed && ch.bits < 64)
+			return (int64_t)(v << (64 - ch.bits)) >> (64 - ch.bits);
+
+		return (int64_t)v;
+	}
+
+	/* Inverse of decode(), bits outside the channel are left alone */
+	void encode(uint8_t *scan, std::size_t i, int64_t val,
+		    unsigned int rep = 0) const
+	{
+		const scan_channel &ch = channels_[i];
+		uint8_t *p = scan + ch.offset + rep * ch.bytes;
+		uint64_t v = ((uint64_t)val & ch.mask) << ch.shift;
+		uint64_t m = ch.mask << ch.shift;
+
+		switch (ch.bytes) {
+		case 1:
+			*p = (*p & ~m) | v;
+			break;
+		case 2: {
+			uint16_t t;
+
+			memcpy(&t, p, 2);
+			if (ch.swap)
+				t = __builtin_bswap16(t);
+			t = (t & ~m) | v;
+			if (ch.swap)
+				t = __builtin_bswap16(t);
+			memcpy(p, &t, 2);
+			break;
+		}
+		case 4: {
+			uint32_t t;
+
+			memcpy(&t, p, 4);
+			if (ch.swap)
+				t = __builtin_bswap32(t);
+			t = (t & ~m) | v;
+			if (ch.swap)
+				t = __builtin_bswap32(t);
+			memcpy(p, &t, 4);
+			break;
+		}
+		default: {
+			uint64_t t;
+
+			memcpy(&t, p, 8);
+			if (ch.swap)
+				t = __builtin_bswap64(t);
+			t = (t & ~m) | v;
+			if (ch.swap)
+				t = __builtin_bswap64(t);
+			memcpy(p, &t, 8);
+			break;
+		}
+		}
+	}
+
+private:
+	std::vector<scan_channel> channels_;
+	std::size_t scan_bytes_ = 0;
+	int ts_chan_ = -1;
+};
+
+/*
+ * A view of one scan inside a read buffer. It does not own the bytes and is
+ * only valid until the buffer it points into is refilled.
+ */
+class sample {
+public:
+	sample(const scan_layout *layout, const uint8_t *raw)
+		: layout_(layout), raw_(raw) {}
+
+	int64_t value(std::size_t chan, unsigned int rep = 0) const
+	{
+		return layout_->decode(raw_, chan, rep);
+	}
+
+	int64_t timestamp() const
+	{
+		int ts = layout_->timestamp_channel();
+
+		return ts < 0 ? 0 : layout_->decode(raw_, ts);
+	}
+
+	span<const uint8_t> raw() const
+	{
+		return span<const uint8_t>(raw_, layout_->scan_bytes());
+	}
+
+	const scan_layout &layout() const { return *layout_; }
+
+private:
+	const scan_layout *layout_;
+	const uint8_t *raw_;
+};
+
+/* A run of consecutive scans, as returned by one read() of the buffer */
+class batch {
+public:
+	class iterator {
+	public:
+		iterator(const batch *b, std::size_t i) : b_(b), i_(i) {}
+
+		sample operator*() const { return (*b_)[i_]; }
+		iterator &operator++() { i_++; return *this; }
+		bool operator!=(const iterator &o) const { return i_ != o.i_; }
+
+	private:
+		const batch *b_;
+		std::size_t i_;
+	};
+
+	batch() : layout_(nullptr) {}
+	batch(const scan_layout *layout, span<const uint8_t> bytes)
+		: layout_(layout), bytes_(bytes) {}
+
+	std::size_t size() const
+	{
+		return layout_ ? bytes_.size() / layout_->scan_bytes() : 0;
+	}
+
+	bool empty() const { return size() == 0; }
+
+	sample operator[](std::size_t i) const
+	{
+		return sample(layout_, bytes_.data() + i * layout_->scan_bytes());
+	}
+
+	iterator begin() const { return iterator(this, 0); }
+	iterator end() const { return iterator(this, size()); }
+
+	span<const uint8_t> bytes() const { return bytes_; }
+	const scan_layout *layout() const { return layout_; }
+
+private:
+	const scan_layout *layout_;
+	span<const uint8_t> bytes_;
+};
+
+} /* namespace apds9960 */
+
+#endif /* _APDS9960_SCAN_H_ */
@@ -0,0 +1,171 @@
+#include "sensor.h"
+
+#include <cerrno>
+#include <cstring>
+
+namespace apds9960 {
+
+#define APDS9960_SENSOR_MIN_QUEUE	256
+
+int sensor::attach(event_loop &loop, device &dev)
+{
+	return stream_.attach(loop, dev, attach(loop, dev.layout()));
+}
+
+stream_handlers sensor::attach(event_loop &loop, const scan_layout &layout)
+{
+	stream_handlers h;
+
+	loop_ = &loop;
+	layout_ = &layout;
+	ring_.assign(APDS9960_SENSOR_MIN_QUEUE * layout_->scan_bytes(), 0);
+	head_ = 0;
+	count_ = 0;
+	events_.clear();
+	err_ = 0;
+
+	h.on_batch = [this](const batch &b) { push_batch(b); };
+	h.on_event = [this](span<const struct iio_event_data> evs) {
+		push_events(evs);
+	};
+	h.on_error = [this](int err) { fail(err); };
+
+	return h;
+}
+
+void sensor::flush()
+{
+	head_ = 0;
+	count_ = 0;
+	events_.clear();
+}
+
+void sensor::push_batch(const batch &b)
+{
+	const std::size_t sz = layout_->scan_bytes();
+	const std::size_t cap = ring_.size() / sz;
+	std::size_t n = b.size(), tail, first;
+	const uint8_t *src = b.bytes().data();
+	std::coroutine_handle<> h;
+
+	if (count_ + n > cap) {
+		std::size_t ncap = cap;
+		std::vector<uint8_t> nring;
+
+		while (ncap < count_ + n)
+			ncap *= 2;
+		nring.resize(ncap * sz);
+
+		/* Linearise the old contents at the start of the new ring */
+		first = std::min(count_, cap - head_);
+		memcpy(nring.data(), &ring_[head_ * sz], first * sz);
+		memcpy(nring.data() + first * sz, ring_.data(),
+		       (count_ - first) * sz);
+		ring_.swap(nring);
+		head_ = 0;
+	}
+
+	tail = (head_ + count_) % (ring_.size() / sz);
+	first = std::min(n, ring_.size() / sz - tail);
+	memcpy(&ring_[tail * sz], src, first * sz);
+	memcpy(ring_.data(), src + first * sz, (n - first) * sz);
+	count_ += n;
+
+	/* A resumed waiter may take more or queue up again, so recheck */
+	while (count_ && !sample_waiters_.empty()) {
+		h = sample_waiters_.front();
+		sample_waiters_.pop_front();
+		h.resume();
+	}
+}
+
+std::optional<sample> sensor::pop_sample()
+{
+	const std::size_t sz = layout_->scan_bytes();
+	std::size_t idx;
+
+	if (!count_)
+		return std::nullopt;
+
+	idx = head_;
+	head_ = (head_ + 1) % (ring_.size() / sz);
+	count_--;
+
+	/*
+	 * The slot is only reused or moved by push_batch(), which can not run
+	 * before the caller suspends again.
+	 */
+	return sample(layout_, &ring_[idx * sz]);
+}
+
+bool sensor::take_event(const event_filter &f,
+			std::optional<struct iio_event_data> &out)
+{
+	for (auto it = events_.begin(); it != events_.end(); ++it) {
+		if (f && !f(*it))
+			continue;
+
+		out = *it;
+		events_.erase(it);
+		return true;
+	}
+
+	return false;
+}
+
+void sensor::push_events(span<const struct iio_event_data> evs)
+{
+	std::size_t i = 0;
+
+	for (const struct iio_event_data &ev : evs)
+		events_.push_back(ev);
+
+	/*
+	 * Serve waiters oldest first. Resuming one can add or cancel others,
+	 * so start over after each.
+	 */
+	while (i < event_waiters_.size()) {
+		event_waiter w = event_waiters_[i];
+
+		if (!take_event(*w.filter, *w.out)) {
+			i++;
+			continue;
+		}
+
+		event_waiters_.erase(event_waiters_.begin() + i);
+		w.h.resume();
+		i = 0;
+	}
+}
+
+void sensor::cancel(std::coroutine_handle<> h)
+{
+	if (!h)
+		return;
+
+	std::erase(sample_waiters_, h);
+	std::erase_if(event_waiters_,
+		      [h](const event_waiter &w) { return w.h == h; });
+}
+
+void sensor::fail(int err)
+{
+	std::coroutine_handle<> h;
+
+	err_ = err;
+
+	/* Everybody wakes up to the error, and none of them waits again */
+	while (!sample_waiters_.empty()) {
+		h = sample_waiters_.front();
+		sample_waiters_.pop_front();
+		h.resume();
+	}
+
+	while (!event_waiters_.empty()) {
+		h = event_waiters_.front().h;
+		event_waiters_.pop_front();
+		h.resume();
+	}
+}
+
+} /* namespace apds9960 */
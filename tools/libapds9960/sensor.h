@@ -0,0 +1,149 @@
+#ifndef _APDS9960_SENSOR_H_
+#define _APDS9960_SENSOR_H_
+
+#include <coroutine>
+#include <deque>
+#include <functional>
+#include <optional>
+#include <vector>
+
+#include "coro.h"
+#include "stream.h"
+
+namespace apds9960 {
+
+using event_filter = std::function<bool(const struct iio_event_data &)>;
+
+/*
+ * Coroutine front end over stream. Every batch the loop drains is appended
+ * to an internal queue before any waiter is resumed, so samples that arrive
+ * while a coroutine is suspended elsewhere (say in sleep_for) are kept and
+ * handed out in order by later next_sample() calls.
+ *
+ * Any number of coroutines may wait at once. Each sample goes to exactly
+ * one of them, in the order they started waiting. An event goes to the
+ * longest waiting coroutine whose filter accepts it; events nobody accepts
+ * stay queued for later next_event() calls until flush().
+ *
+ * A sample returned by next_sample() points into that queue and stays valid
+ * until the coroutine suspends again, whatever it then awaits.
+ */
+class sensor {
+public:
+	class sample_awaiter {
+	public:
+		explicit sample_awaiter(sensor &s) : s_(s) {}
+		sample_awaiter(const sample_awaiter &) = delete;
+		sample_awaiter &operator=(const sample_awaiter &) = delete;
+		/* A coroutine destroyed while parked here leaves the queue */
+		~sample_awaiter() { s_.cancel(h_); }
+
+		bool await_ready() const noexcept { return s_.ready(); }
+		void await_suspend(std::coroutine_handle<> h)
+		{
+			h_ = h;
+			s_.sample_waiters_.push_back(h);
+		}
+		/* nullopt on a stream error, see sensor::error() */
+		std::optional<sample> await_resume()
+		{
+			h_ = nullptr;
+			return s_.pop_sample();
+		}
+
+	private:
+		sensor &s_;
+		std::coroutine_handle<> h_;
+	};
+
+	class event_awaiter {
+	public:
+		event_awaiter(sensor &s, event_filter f)
+			: s_(s), f_(std::move(f)) {}
+		event_awaiter(const event_awaiter &) = delete;
+		event_awaiter &operator=(const event_awaiter &) = delete;
+		~event_awaiter() { s_.cancel(h_); }
+
+		bool await_ready() { return s_.take_event(f_, ev_) || s_.err_; }
+		void await_suspend(std::coroutine_handle<> h)
+		{
+			h_ = h;
+			s_.event_waiters_.push_back({ h, &f_, &ev_ });
+		}
+		/* nullopt on a stream error, see sensor::error() */
+		std::optional<struct iio_event_data> await_resume()
+		{
+			h_ = nullptr;
+			return ev_;
+		}
+
+	private:
+		sensor &s_;
+		event_filter f_;
+		std::optional<struct iio_event_data> ev_;
+		std::coroutine_handle<> h_;
+	};
+
+	sensor() = default;
+	sensor(const sensor &) = delete;
+	sensor &operator=(const sensor &) = delete;
+
+	/* 'dev' must have been opened with device_config::nonblock set */
+	int attach(event_loop &loop, device &dev);
+	/*
+	 * Attach to some other source of scans in 'layout', e.g. a replayed
+	 * recording, which feeds the sensor through the returned handlers.
+	 */
+	stream_handlers attach(event_loop &loop, const scan_layout &layout);
+	void detach() { stream_.detach(); }
+
+	sample_awaiter next_sample() { return sample_awaiter(*this); }
+	event_awaiter next_event(event_filter f = nullptr)
+	{
+		return event_awaiter(*this, std::move(f));
+	}
+
+	/* Drop everything queued so far, e.g. before starting a capture */
+	void flush();
+
+	std::size_t queued() const { return count_; }
+	int error() const { return err_; }
+	event_loop &loop() const { return *loop_; }
+
+private:
+	struct event_waiter {
+		std::coroutine_handle<> h;
+		const event_filter *filter;
+		std::optional<struct iio_event_data> *out;
+	};
+
+	bool ready() const { return count_ || err_; }
+	std::optional<sample> pop_sample();
+	/* Move the oldest queued event 'f' accepts into 'out' */
+	bool take_event(const event_filter &f,
+			std::optional<struct iio_event_data> &out);
+	void cancel(std::coroutine_handle<> h);
+
+	void push_batch(const batch &b);
+	void push_events(span<const struct iio_event_data> evs);
+	void fail(int err);
+
+	stream stream_;
+	event_loop *loop_ = nullptr;
+	const scan_layout *layout_ = nullptr;
+
+	/* Ring of raw scans, grown by doubling when the consumer falls behind */
+	std::vector<uint8_t> ring_;
+	std::size_t head_ = 0;
+	std::size_t count_ = 0;
+
+	std::deque<struct iio_event_data> events_;
+
+	std::deque<std::coroutine_handle<>> sample_waiters_;
+	std::deque<event_waiter> event_waiters_;
+	int err_ = 0;
+};
+
+} /* namespace apds9960 */
+
+#endif /* _APDS9960_SENSOR_H_ */
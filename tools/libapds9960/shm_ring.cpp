@@ -0,0 +1,422 @@
+#include "shm_ring.h"
+
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+namespace apds9960 {
+
+static long futex(std::atomic<uint32_t> *uaddr, int op, uint32_t val,
+		  const struct timespec *ts)
+{
+	return syscall(SYS_futex, reinterpret_cast<uint32_t *>(uaddr), op, val,
+		       ts, nullptr, 0);
+}
+
+static std::size_t shm_slot_stride(const shm_header *hdr)
+{
+	return sizeof(shm_slot) + hdr->slot_bytes;
+}
+
+static shm_slot *shm_slot_at(const shm_header *hdr, uint8_t *slots,
+			     uint64_t seq)
+{
+	return reinterpret_cast<shm_slot *>(
+		slots + (seq & (hdr->nr_slots - 1)) * shm_slot_stride(hdr));
+}
+
+int shm_producer::create(const scan_layout &layout, unsigned int nr_slots)
+{
+	std::string self;
+	unsigned int n = 1;
+	std::size_t i;
+	int ret;
+
+	if (layout.num_channels() > APDS9960_SHM_MAX_CHANNELS || !nr_slots)
+		return -EINVAL;
+
+	destroy();
+
+	while (n < nr_slots)
+		n <<= 1;
+
+	fd_ = memfd_create("apds9960-ring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (fd_ < 0)
+		return -errno;
+
+	map_len_ = sizeof(shm_header) +
+		   (std::size_t)n * (sizeof(shm_slot) +
+				     ((layout.scan_bytes() + 7) & ~7UL));
+	if (ftruncate(fd_, map_len_) ||
+	    fcntl(fd_, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL))
+		goto err;
+
+	hdr_ = static_cast<shm_header *>(mmap(nullptr, map_len_,
+					      PROT_READ | PROT_WRITE,
+					      MAP_SHARED, fd_, 0));
+	if (hdr_ == MAP_FAILED) {
+		hdr_ = nullptr;
+		goto err;
+	}
+	slots_ = reinterpret_cast<uint8_t *>(hdr_ + 1);
+
+	/* memfd pages start zeroed, which is a valid empty ring */
+	hdr_->version = APDS9960_SHM_VERSION;
+	hdr_->scan_bytes = layout.scan_bytes();
+	hdr_->slot_bytes = (layout.scan_bytes() + 7) & ~7UL;
+	hdr_->nr_slots = n;
+	hdr_->nr_channels = layout.num_channels();
+	for (i = 0; i < layout.num_channels(); i++) {
+		const scan_channel &ch = layout.channel(i);
+		shm_channel &sc = hdr_->channels[i];
+
+		snprintf(sc.name, sizeof(sc.name), "%s", ch.name.c_str());
+		snprintf(sc.type, sizeof(sc.type), "%s",
+			 scan_layout::type_string(ch).c_str());
+		sc.index = ch.index;
+	}
+	std::atomic_thread_fence(std::memory_order_release);
+	hdr_->magic = APDS9960_SHM_MAGIC;
+
+	/*
+	 * Consumers get a read-only open file, and the inode loses its write
+	 * bits so that they can not reopen it read-write through /proc either
+	 * (short of being root or owning it).
+	 */
+	self = "/proc/self/fd/" + std::to_string(fd_);
+	ro_fd_ = open(self.c_str(), O_RDONLY | O_CLOEXEC);
+	if (ro_fd_ < 0 || fchmod(fd_, 0444))
+		goto err;
+
+	return 0;
+
+err:
+	ret = -errno;
+	destroy();
+	return ret;
+}
+
+void shm_producer::destroy()
+{
+	if (hdr_)
+		munmap(hdr_, map_len_);
+	if (fd_ >= 0)
+		close(fd_);
+	if (ro_fd_ >= 0)
+		close(ro_fd_);
+
+	hdr_ = nullptr;
+	slots_ = nullptr;
+	fd_ = -1;
+	ro_fd_ = -1;
+}
+
+void shm_producer::publish(const batch &b)
+{
+	uint64_t head = hdr_->head.load(std::memory_order_relaxed);
+
+	for (sample s : b) {
+		shm_slot *slot = shm_slot_at(hdr_, slots_, head);
+
+		/* Seqlock style: invalidate, copy, then stamp the new seq */
+		slot->seq.store(0, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+		memcpy(slot->data(), s.raw().data(), hdr_->scan_bytes);
+		slot->seq.store(head + 1, std::memory_order_release);
+		head++;
+	}
+
+	/* One publication and one wake-up per batch */
+	hdr_->head.store(head, std::memory_order_seq_cst);
+	hdr_->futex.fetch_add(1, std::memory_order_seq_cst);
+	futex(&hdr_->futex, FUTEX_WAKE, INT_MAX, nullptr);
+}
+
+void shm_producer::count_events(uint64_t n)
+{
+	hdr_->events.fetch_add(n, std::memory_order_relaxed);
+}
+
+static int send_memfd(int sock, int memfd)
+{
+	char cbuf[CMSG_SPACE(sizeof(int))] = {};
+	struct msghdr msg = {};
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	char byte = 0;
+
+	iov.iov_base = &byte;
+	iov.iov_len = 1;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &memfd, sizeof(int));
+
+	return sendmsg(sock, &msg, MSG_NOSIGNAL) < 0 ? -errno : 0;
+}
+
+int shm_producer::listen(const std::string &path, mode_t mode, gid_t gid)
+{
+	struct sockaddr_un addr = {};
+	int fd;
+
+	if (path.size() >= sizeof(addr.sun_path))
+		return -ENAMETOOLONG;
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -errno;
+
+	addr.sun_family = AF_UNIX;
+	memcpy(addr.sun_path, path.c_str(), path.size());
+	unlink(path.c_str());
+
+	/* Only who may connect can read the stream, so set that up first */
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+	    chmod(path.c_str(), mode) ||
+	    (gid != (gid_t)-1 && chown(path.c_str(), (uid_t)-1, gid)) ||
+	    ::listen(fd, 16)) {
+		int ret = -errno;
+
+		close(fd);
+		return ret;
+	}
+
+	return fd;
+}
+
+void shm_producer::accept_consumers(int lfd)
+{
+	int fd;
+
+	while ((fd = accept4(lfd, nullptr, nullptr, SOCK_CLOEXEC)) >= 0) {
+		send_memfd(fd, ro_fd_);
+		close(fd);
+	}
+}
+
+int shm_consumer::connect(const std::string &sock)
+{
+	struct sockaddr_un addr = {};
+	char cbuf[CMSG_SPACE(sizeof(int))];
+	struct msghdr msg = {};
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	char byte;
+	int fd, memfd = -1, ret;
+
+	if (sock.size() >= sizeof(addr.sun_path))
+		return -ENAMETOOLONG;
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -errno;
+
+	addr.sun_family = AF_UNIX;
+	memcpy(addr.sun_path, sock.c_str(), sock.size());
+	if (::connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+		ret = -errno;
+		close(fd);
+		return ret;
+	}
+
+	iov.iov_base = &byte;
+	iov.iov_len = 1;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+
+	if (recvmsg(fd, &msg, MSG_CMSG_CLOEXEC) <= 0) {
+		ret = -errno;
+		close(fd);
+		return ret ? ret : -ECONNRESET;
+	}
+	close(fd);
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg && cmsg->cmsg_level == SOL_SOCKET &&
+	    cmsg->cmsg_type == SCM_RIGHTS)
+		memcpy(&memfd, CMSG_DATA(cmsg), sizeof(memfd));
+	if (memfd < 0)
+		return -EPROTO;
+
+	/* On success the consumer owns the memfd */
+	ret = attach(memfd);
+	if (ret)
+		close(memfd);
+
+	return ret;
+}
+
+int shm_consumer::attach(int memfd)
+{
+	struct stat st;
+	uint32_t i;
+	int ret;
+
+	detach();
+
+	if (fstat(memfd, &st))
+		return -errno;
+	if ((std::size_t)st.st_size < sizeof(shm_header))
+		return -EINVAL;
+
+	map_len_ = st.st_size;
+	hdr_ = static_cast<shm_header *>(mmap(nullptr, map_len_, PROT_READ,
+					      MAP_SHARED, memfd, 0));
+	if (hdr_ == MAP_FAILED) {
+		hdr_ = nullptr;
+		return -errno;
+	}
+	slots_ = reinterpret_cast<uint8_t *>(hdr_ + 1);
+
+	ret = -EPROTO;
+	if (hdr_->magic != APDS9960_SHM_MAGIC ||
+	    hdr_->version != APDS9960_SHM_VERSION ||
+	    hdr_->nr_channels > APDS9960_SHM_MAX_CHANNELS)
+		goto err;
+
+	for (i = 0; i < hdr_->nr_channels; i++) {
+		const shm_channel &sc = hdr_->channels[i];
+
+		ret = layout_.add(std::string(sc.name, strnlen(sc.name,
+						sizeof(sc.name))),
+				  sc.index, std::string(sc.type, strnlen(sc.type,
+						sizeof(sc.type))));
+		if (ret)
+			goto err;
+	}
+	layout_.compile();
+
+	ret = -EPROTO;
+	if (layout_.scan_bytes() != hdr_->scan_bytes ||
+	    map_len_ < sizeof(shm_header) +
+		       (std::size_t)hdr_->nr_slots * shm_slot_stride(hdr_))
+		goto err;
+
+	/* Only what is published from now on */
+	cursor_ = hdr_->head.load(std::memory_order_acquire);
+	fd_ = memfd;
+
+	return 0;
+
+err:
+	detach();
+	return ret;
+}
+
+void shm_consumer::detach()
+{
+	if (hdr_)
+		munmap(hdr_, map_len_);
+	if (fd_ >= 0)
+		close(fd_);
+
+	hdr_ = nullptr;
+	slots_ = nullptr;
+	fd_ = -1;
+	layout_ = scan_layout();
+	overruns_ = 0;
+}
+
+uint64_t shm_consumer::overruns() const
+{
+	return overruns_;
+}
+
+uint64_t shm_consumer::events() const
+{
+	return hdr_ ? hdr_->events.load(std::memory_order_relaxed) : 0;
+}
+
+int shm_consumer::wait(int timeout_ms)
+{
+	struct timespec ts, *tsp = nullptr;
+	uint32_t seq;
+	int ret = 0;
+
+	if (timeout_ms >= 0) {
+		ts.tv_sec = timeout_ms / 1000;
+		ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+		tsp = &ts;
+	}
+
+	/*
+	 * Pairs with the head store / futex bump / wake in publish(). The
+	 * word is mapped read-only, which FUTEX_WAIT is fine with.
+	 */
+	seq = hdr_->futex.load(std::memory_order_seq_cst);
+	if (hdr_->head.load(std::memory_order_seq_cst) == cursor_ &&
+	    futex(&hdr_->futex, FUTEX_WAIT, seq, tsp) && errno == ETIMEDOUT)
+		ret = -ETIMEDOUT;
+
+	return ret;
+}
+
+int shm_consumer::read(batch &out, unsigned int max_scans, int timeout_ms)
+{
+	const std::size_t sz = hdr_->scan_bytes;
+	uint64_t head, seq;
+	std::size_t n = 0;
+
+	buf_.resize(max_scans * sz);
+
+	for (;;) {
+		head = hdr_->head.load(std::memory_order_acquire);
+		if (head != cursor_)
+			break;
+		if (!timeout_ms || wait(timeout_ms) == -ETIMEDOUT) {
+			out = batch(&layout_, span<const uint8_t>());
+			return 0;
+		}
+	}
+
+	/* Too far behind: skip to the oldest scan that is still there */
+	if (head - cursor_ > hdr_->nr_slots) {
+		overruns_ += head - hdr_->nr_slots - cursor_;
+		cursor_ = head - hdr_->nr_slots;
+	}
+
+	while (cursor_ != head && n < max_scans) {
+		shm_slot *slot = shm_slot_at(hdr_, slots_, cursor_);
+		uint8_t *dst = &buf_[n * sz];
+
+		seq = slot->seq.load(std::memory_order_acquire);
+		if (seq == cursor_ + 1) {
+			memcpy(dst, slot->data(), sz);
+			std::atomic_thread_fence(std::memory_order_acquire);
+			if (slot->seq.load(std::memory_order_relaxed) == seq) {
+				cursor_++;
+				n++;
+				continue;
+			}
+		}
+
+		/* The producer lapped us while we were copying this slot */
+		overruns_++;
+		cursor_++;
+	}
+
+	out = batch(&layout_, span<const uint8_t>(buf_.data(), n * sz));
+
+	return n;
+}
+
+} /* namespace apds9960 */
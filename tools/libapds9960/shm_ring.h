@@ -0,0 +1,141 @@
+#ifndef _APDS9960_SHM_RING_H_
+#define _APDS9960_SHM_RING_H_
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <sys/types.h>
+#include <vector>
+
+#include "scan.h"
+
+namespace apds9960 {
+
+#define APDS9960_SHM_MAGIC		0x53363941	/* "A96S" */
+#define APDS9960_SHM_VERSION		3
+#define APDS9960_SHM_MAX_CHANNELS	16
+#define APDS9960_SHM_SOCKET		"/run/apds9960d.sock"
+
+struct shm_channel {
+	char name[40];
+	char type[20];
+	int32_t index;
+};
+
+/*
+ * Start of the memfd region. It is followed by nr_slots slots of
+ * 8 + slot_bytes bytes each: a sequence word and one scan.
+ *
+ * Only the producer writes any of it. Consumers get a read-only fd and
+ * mapping, keep their cursor to themselves, and FUTEX_WAIT on a word they
+ * can not modify, so a broken consumer can not disturb the others.
+ */
+struct shm_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t scan_bytes;
+	uint32_t slot_bytes;
+	uint32_t nr_slots;
+	uint32_t nr_channels;
+	struct shm_channel channels[APDS9960_SHM_MAX_CHANNELS];
+
+	/* Next sequence number the producer will write */
+	alignas(64) std::atomic<uint64_t> head;
+	/* Bumped once per published batch; consumers FUTEX_WAIT on it */
+	alignas(64) std::atomic<uint32_t> futex;
+	/* IIO events the producer has read, for consumers to rate */
+	alignas(64) std::atomic<uint64_t> events;
+};
+
+struct shm_slot {
+	/* Sequence number + 1 of the scan held, 0 while being rewritten */
+	std::atomic<uint64_t> seq;
+
+	uint8_t *data() { return reinterpret_cast<uint8_t *>(this + 1); }
+};
+
+/*
+ * Single producer side. publish() never waits for anybody: a consumer that
+ * falls more than nr_slots behind simply loses the oldest scans and sees
+ * that reflected in its overrun counter. With no consumer state in shared
+ * memory, every batch costs one FUTEX_WAKE whether anybody waits or not.
+ */
+class shm_producer {
+public:
+	shm_producer() = default;
+	shm_producer(const shm_producer &) = delete;
+	shm_producer &operator=(const shm_producer &) = delete;
+	~shm_producer() { destroy(); }
+
+	/* nr_slots is rounded up to a power of two */
+	int create(const scan_layout &layout, unsigned int nr_slots);
+	void destroy();
+
+	void publish(const batch &b);
+	/* Account n IIO events read from the device */
+	void count_events(uint64_t n);
+
+	/*
+	 * Non-blocking listening socket that hands out the read-only fd.
+	 * The socket file gets 'mode', and group 'gid' unless that is -1.
+	 */
+	int listen(const std::string &path, mode_t mode = 0660,
+		   gid_t gid = (gid_t)-1);
+	/* Serve every pending connection on a socket from listen() */
+	void accept_consumers(int lfd);
+
+	int memfd() const { return fd_; }
+	/* The same memfd opened O_RDONLY, which is what consumers get */
+	int reader_fd() const { return ro_fd_; }
+	const shm_header *header() const { return hdr_; }
+
+private:
+	shm_header *hdr_ = nullptr;
+	uint8_t *slots_ = nullptr;
+	std::size_t map_len_ = 0;
+	int fd_ = -1;
+	int ro_fd_ = -1;
+};
+
+class shm_consumer {
+public:
+	shm_consumer() = default;
+	shm_consumer(const shm_consumer &) = delete;
+	shm_consumer &operator=(const shm_consumer &) = delete;
+	~shm_consumer() { detach(); }
+
+	/* Fetch the memfd from the daemon's socket and attach to it */
+	int connect(const std::string &sock = APDS9960_SHM_SOCKET);
+	/* Map 'memfd' read-only; it may be, and normally is, O_RDONLY */
+	int attach(int memfd);
+	void detach();
+
+	/*
+	 * Copy up to max_scans published scans into a private buffer and
+	 * return them as a batch. Waits up to timeout_ms (-1 forever) when
+	 * nothing new is available; returns 0 on timeout.
+	 */
+	int read(batch &out, unsigned int max_scans = 256, int timeout_ms = -1);
+
+	const scan_layout &layout() const { return layout_; }
+	/* Scans lost because the producer lapped this consumer */
+	uint64_t overruns() const;
+	/* Running count of IIO events seen by the producer */
+	uint64_t events() const;
+
+private:
+	int wait(int timeout_ms);
+
+	shm_header *hdr_ = nullptr;
+	uint8_t *slots_ = nullptr;
+	std::size_t map_len_ = 0;
+	scan_layout layout_;
+	std::vector<uint8_t> buf_;
+	uint64_t cursor_ = 0;
+	uint64_t overruns_ = 0;
+	int fd_ = -1;
+};
+
+} /* namespace apds9960 */
+
+#endif /* _APDS9960_SHM_RING_H_ */
@@ -0,0 +1,49 @@
+#ifndef _APDS9960_SPAN_H_
+#define _APDS9960_SPAN_H_
+
+#include <cstddef>
+
+#if __cplusplus >= 202002L && __has_include(<span>)
+#include <span>
+
+namespace apds9960 {
+template <typename T>
+using span = std::span<T>;
+}
+
+#else
+
+namespace apds9960 {
+
+/*
+ * Minimal stand-in for std::span so the library stays usable from C++17.
+ * Only the members the library itself relies on are provided.
+ */
+template <typename T>
+class span {
+public:
+	constexpr span() noexcept : ptr_(nullptr), len_(0) {}
+	constexpr span(T *ptr, std::size_t len) noexcept : ptr_(ptr), len_(len) {}
+
+	constexpr T *data() const noexcept { return ptr_; }
+	constexpr std::size_t size() const noexcept { return len_; }
+	constexpr bool empty() const noexcept { return len_ == 0; }
+	constexpr T &operator[](std::size_t i) const noexcept { return ptr_[i]; }
+	constexpr T *begin() const noexcept { return ptr_; }
+	constexpr T *end() const noexcept { return ptr_ + len_; }
+
+	constexpr span subspan(std::size_t off, std::size_t len) const noexcept
+	{
+		return span(ptr_ + off, len);
+	}
+
+private:
+	T *ptr_;
+	std::size_t len_;
+};
+
+} /* namespace apds9960 */
+
+#endif
+
+#endif /* _APDS9960_SPAN_H_ */
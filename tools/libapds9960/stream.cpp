@@ -0,0 +1,125 @@
+#include "stream.h"
+
+#include <cerrno>
+#include <unistd.h>
+
+namespace apds9960 {
+
+#define APDS9960_EVENTS_PER_READ	16
+
+int stream::attach(event_loop &loop, device &dev, stream_handlers h)
+{
+	int ret;
+
+	detach();
+
+	if (!dev.config().nonblock)
+		return -EINVAL;
+
+	loop_ = &loop;
+	dev_ = &dev;
+	h_ = std::move(h);
+
+	ret = loop.add(dev.buffer_fd(), EPOLLIN | EPOLLET,
+		       [this](uint32_t) { drain_buffer(); });
+	if (ret)
+		goto err;
+
+	if (h_.on_event) {
+		ret = dev.event_fd();
+		if (ret < 0)
+			goto err_buffer;
+		event_fd_ = ret;
+
+		ret = loop.add(event_fd_, EPOLLIN | EPOLLET,
+			       [this](uint32_t) { drain_events(); });
+		if (ret)
+			goto err_buffer;
+	}
+
+	return 0;
+
+err_buffer:
+	loop.remove(dev.buffer_fd());
+err:
+	event_fd_ = -1;
+	loop_ = nullptr;
+	dev_ = nullptr;
+	return ret;
+}
+
+void stream::detach()
+{
+	if (!loop_)
+		return;
+
+	loop_->remove(dev_->buffer_fd());
+	if (event_fd_ >= 0)
+		loop_->remove(event_fd_);
+
+	event_fd_ = -1;
+	loop_ = nullptr;
+	dev_ = nullptr;
+}
+
+int stream::drain_buffer()
+{
+	batch b;
+	int ret;
+
+	/*
+	 * Edge-triggered: keep going until the kernel says there is no more,
+	 * unless a handler detached us in the meantime.
+	 */
+	for (;;) {
+		if (!dev_)
+			return 0;
+
+		ret = dev_->read(b);
+		if (ret <= 0)
+			break;
+
+		if (h_.on_batch)
+			h_.on_batch(b);
+	}
+
+	if (ret == -EAGAIN)
+		return 0;
+
+	if (h_.on_error)
+		h_.on_error(ret ? ret : -EPIPE);
+
+	return ret ? ret : -EPIPE;
+}
+
+int stream::drain_events()
+{
+	struct iio_event_data evs[APDS9960_EVENTS_PER_READ];
+	ssize_t len;
+
+	for (;;) {
+		if (event_fd_ < 0)
+			return 0;
+
+		len = read(event_fd_, evs, sizeof(evs));
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN)
+				return 0;
+
+			len = -errno;
+			if (h_.on_error)
+				h_.on_error(len);
+			return len;
+		}
+
+		if (!len)
+			return 0;
+
+		h_.on_event(span<const struct iio_event_data>(evs,
+						len / sizeof(evs[0])));
+	}
+}
+
+} /* namespace apds9960 */
@@ -0,0 +1,76 @@
+#ifndef _APDS9960_STREAM_H_
+#define _APDS9960_STREAM_H_
+
+#include <cstdint>
+#include <functional>
+
+#include <linux/iio/events.h>
+
+#include "device.h"
+#include "event_loop.h"
+
+namespace apds9960 {
+
+struct stream_handlers {
+	/* Called once per read() while draining, never with an empty batch */
+	std::function<void(const batch &)> on_batch;
+	/* Called with every IIO event read in one go */
+	std::function<void(span<const struct iio_event_data>)> on_event;
+	/* A read failed with something other than -EAGAIN */
+	std::function<void(int err)> on_error;
+};
+
+/*
+ * Hooks an opened, non-blocking device into an event_loop. Both the buffer
+ * and the event fd are registered edge-triggered and drained completely on
+ * each wakeup, so one thread can serve this sensor next to other fds.
+ */
+class stream {
+public:
+	stream() = default;
+	stream(const stream &) = delete;
+	stream &operator=(const stream &) = delete;
+	~stream() { detach(); }
+
+	int attach(event_loop &loop, device &dev, stream_handlers h);
+	void detach();
+
+	/* Drain by hand, e.g. right after attach() or from a timer */
+	int drain_buffer();
+	int drain_events();
+
+private:
+	event_loop *loop_ = nullptr;
+	device *dev_ = nullptr;
+	stream_handlers h_;
+	int event_fd_ = -1;
+};
+
+static inline unsigned int iio_event_type(const struct iio_event_data &ev)
+{
+	return IIO_EVENT_CODE_EXTRACT_TYPE(ev.id);
+}
+
+static inline unsigned int iio_event_dir(const struct iio_event_data &ev)
+{
+	return IIO_EVENT_CODE_EXTRACT_DIR(ev.id);
+}
+
+static inline unsigned int iio_event_chan_type(const struct iio_event_data &ev)
+{
+	return IIO_EVENT_CODE_EXTRACT_CHAN_TYPE(ev.id);
+}
+
+static inline unsigned int iio_event_modifier(const struct iio_event_data &ev)
+{
+	return IIO_EVENT_CODE_EXTRACT_MODIFIER(ev.id);
+}
+
+static inline int iio_event_channel(const struct iio_event_data &ev)
+{
+	return IIO_EVENT_CODE_EXTRACT_CHAN(ev.id);
+}
+
+} /* namespace apds9960 */
+
+#endif /* _APDS9960_STREAM_H_ */
@@ -0,0 +1,78 @@
+#include "sysfs.h"
+
+#include <cerrno>
+#include <cstdlib>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace apds9960 {
+
+int sysfs_read(const std::string &path, std::string &val)
+{
+	char buf[256];
+	ssize_t len;
+	int fd;
+
+	fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+
+	len = read(fd, buf, sizeof(buf) - 1);
+	if (len < 0) {
+		len = -errno;
+		close(fd);
+		return len;
+	}
+	close(fd);
+
+	while (len > 0 && (buf[len - 1] == '\n' || buf[len - 1] == ' '))
+		len--;
+	val.assign(buf, len);
+
+	return 0;
+}
+
+int sysfs_read_int(const std::string &path, long long &val)
+{
+	std::string str;
+	char *end;
+	int ret;
+
+	ret = sysfs_read(path, str);
+	if (ret)
+		return ret;
+
+	errno = 0;
+	val = strtoll(str.c_str(), &end, 0);
+	if (errno || end == str.c_str())
+		return -EINVAL;
+
+	return 0;
+}
+
+int sysfs_write(const std::string &path, const std::string &val)
+{
+	ssize_t len;
+	int fd;
+
+	fd = open(path.c_str(), O_WRONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+
+	len = write(fd, val.data(), val.size());
+	if (len < 0) {
+		len = -errno;
+		close(fd);
+		return len;
+	}
+	close(fd);
+
+	return (size_t)len == val.size() ? 0 : -EIO;
+}
+
+int sysfs_write_int(const std::string &path, long long val)
+{
+	return sysfs_write(path, std::to_string(val));
+}
+
+} /* namespace apds9960 */
@@ -0,0 +1,16 @@
+#ifndef _APDS9960_SYSFS_H_
+#define _APDS9960_SYSFS_H_
+
+#include <string>
+
+namespace apds9960 {
+
+/* All helpers return 0 or a negative errno value, like the driver does. */
+int sysfs_read(const std::string &path, std::string &val);
+int sysfs_read_int(const std::string &path, long long &val);
+int sysfs_write(const std::string &path, const std::string &val);
+int sysfs_write_int(const std::string &path, long long val);
+
+} /* namespace apds9960 */
+
+#endif /* _APDS9960_SYSFS_H_ */
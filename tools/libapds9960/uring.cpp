@@ -0,0 +1,235 @@
+#include "uring.h"
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+namespace apds9960 {
+
+static int io_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned int to_submit,
+			  unsigned int min_complete, unsigned int flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+		       nullptr, 0);
+}
+
+static int io_uring_register(int fd, unsigned int opcode, const void *arg,
+			     unsigned int nr_args)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+int uring_reader::add(device &dev)
+{
+	if (fd_ >= 0)
+		return -EBUSY;
+	if (dev.buffer_fd() < 0 || dev.config().nonblock)
+		return -EINVAL;
+
+	devs_.push_back(&dev);
+
+	return devs_.size() - 1;
+}
+
+int uring_reader::map_rings(const struct io_uring_params &p)
+{
+	sq_len_ = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	cq_len_ = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		sq_len_ = cq_len_ = std::max(sq_len_, cq_len_);
+
+	sq_ptr_ = mmap(nullptr, sq_len_, PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQ_RING);
+	if (sq_ptr_ == MAP_FAILED) {
+		sq_ptr_ = nullptr;
+		return -errno;
+	}
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		cq_ptr_ = sq_ptr_;
+	} else {
+		cq_ptr_ = mmap(nullptr, cq_len_, PROT_READ | PROT_WRITE,
+			       MAP_SHARED | MAP_POPULATE, fd_,
+			       IORING_OFF_CQ_RING);
+		if (cq_ptr_ == MAP_FAILED) {
+			cq_ptr_ = nullptr;
+			return -errno;
+		}
+	}
+
+	sqes_len_ = p.sq_entries * sizeof(struct io_uring_sqe);
+	sqes_ = static_cast<struct io_uring_sqe *>(
+		mmap(nullptr, sqes_len_, PROT_READ | PROT_WRITE,
+		     MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQES));
+	if (sqes_ == MAP_FAILED) {
+		sqes_ = nullptr;
+		return -errno;
+	}
+
+	uint8_t *sq = static_cast<uint8_t *>(sq_ptr_);
+	uint8_t *cq = static_cast<uint8_t *>(cq_ptr_);
+
+	sq_head_ = reinterpret_cast<unsigned int *>(sq + p.sq_off.head);
+	sq_tail_ = reinterpret_cast<unsigned int *>(sq + p.sq_off.tail);
+	sq_mask_ = reinterpret_cast<unsigned int *>(sq + p.sq_off.ring_mask);
+	sq_array_ = reinterpret_cast<unsigned int *>(sq + p.sq_off.array);
+	cq_head_ = reinterpret_cast<unsigned int *>(cq + p.cq_off.head);
+	cq_tail_ = reinterpret_cast<unsigned int *>(cq + p.cq_off.tail);
+	cq_mask_ = reinterpret_cast<unsigned int *>(cq + p.cq_off.ring_mask);
+	cqes_ = reinterpret_cast<struct io_uring_cqe *>(cq + p.cq_off.cqes);
+
+	return 0;
+}
+
+int uring_reader::start(handler h, unsigned int reads_per_device)
+{
+	struct io_uring_params p = {};
+	std::vector<struct iovec> iov;
+	std::vector<int> fds;
+	std::size_t total = 0;
+	unsigned int i;
+	int ret;
+
+	if (devs_.empty() || !reads_per_device)
+		return -EINVAL;
+
+	stop();
+	h_ = std::move(h);
+
+	/* One registered buffer per outstanding read, carved from one block */
+	for (std::size_t d = 0; d < devs_.size(); d++) {
+		std::size_t len = (std::size_t)devs_[d]->config().read_scans *
+				  devs_[d]->layout().scan_bytes();
+
+		for (i = 0; i < reads_per_device; i++)
+			slots_.push_back(slot{ d, nullptr, len });
+		total += len * reads_per_device;
+		fds.push_back(devs_[d]->buffer_fd());
+	}
+	mem_.assign(total, 0);
+
+	total = 0;
+	for (slot &s : slots_) {
+		s.buf = mem_.data() + total;
+		total += s.len;
+		iov.push_back(iovec{ s.buf, s.len });
+	}
+
+	fd_ = io_uring_setup(slots_.size(), &p);
+	if (fd_ < 0) {
+		fd_ = -1;
+		return -errno;
+	}
+
+	ret = map_rings(p);
+	if (ret)
+		goto err;
+
+	if (io_uring_register(fd_, IORING_REGISTER_BUFFERS, iov.data(),
+			      iov.size()) ||
+	    io_uring_register(fd_, IORING_REGISTER_FILES, fds.data(),
+			      fds.size())) {
+		ret = -errno;
+		goto err;
+	}
+
+	for (i = 0; i < slots_.size(); i++)
+		queue_read(i);
+
+	return 0;
+
+err:
+	stop();
+	return ret;
+}
+
+void uring_reader::stop()
+{
+	if (sqes_)
+		munmap(sqes_, sqes_len_);
+	if (cq_ptr_ && cq_ptr_ != sq_ptr_)
+		munmap(cq_ptr_, cq_len_);
+	if (sq_ptr_)
+		munmap(sq_ptr_, sq_len_);
+	sqes_ = nullptr;
+	cq_ptr_ = nullptr;
+	sq_ptr_ = nullptr;
+
+	/* Closing the ring cancels whatever reads are still in flight */
+	if (fd_ >= 0)
+		close(fd_);
+	fd_ = -1;
+
+	slots_.clear();
+	mem_.clear();
+	to_submit_ = 0;
+}
+
+void uring_reader::queue_read(unsigned int idx)
+{
+	const slot &s = slots_[idx];
+	unsigned int tail = *sq_tail_;
+	unsigned int i = tail & *sq_mask_;
+	struct io_uring_sqe *sqe = &sqes_[i];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_READ_FIXED;
+	sqe->flags = IOSQE_FIXED_FILE;
+	sqe->fd = s.dev;
+	sqe->addr = (uintptr_t)s.buf;
+	sqe->len = s.len;
+	sqe->buf_index = idx;
+	sqe->user_data = idx;
+
+	sq_array_[i] = i;
+	__atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+	to_submit_++;
+}
+
+int uring_reader::run_once(unsigned int min_complete)
+{
+	unsigned int head, tail;
+	int ret, err = 0, n = 0;
+
+	ret = io_uring_enter(fd_, to_submit_, min_complete,
+			     IORING_ENTER_GETEVENTS);
+	if (ret < 0)
+		return errno == EINTR ? 0 : -errno;
+	to_submit_ -= ret;
+
+	head = *cq_head_;
+	tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+	for (; head != tail; head++, n++) {
+		const struct io_uring_cqe *cqe = &cqes_[head & *cq_mask_];
+		unsigned int idx = cqe->user_data;
+		const slot &s = slots_[idx];
+		int res = cqe->res;
+
+		if (res < 0 && res != -EINTR && res != -EAGAIN && !err)
+			err = res;
+
+		if (res > 0) {
+			const device &dev = *devs_[s.dev];
+
+			h_(s.dev, batch(&dev.layout(),
+					span<const uint8_t>(s.buf, res)));
+		}
+
+		/* The slot is free again once the handler has returned */
+		queue_read(idx);
+	}
+	__atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+
+	return err ? err : n;
+}
+
+} /* namespace apds9960 */
@@ -0,0 +1,88 @@
+#ifndef _APDS9960_URING_H_
+#define _APDS9960_URING_H_
+
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+#include <linux/io_uring.h>
+
+#include "device.h"
+
+namespace apds9960 {
+
+/*
+ * Bulk reader for many IIO buffers at once. Every device gets a few reads
+ * kept outstanding on an io_uring, using registered buffers and registered
+ * files, and completions are reaped and re-posted in the same
+ * io_uring_enter() call. With a sensible watermark on each device that is a
+ * handful of syscalls per second for the whole fixture.
+ *
+ * The devices must be opened blocking: an O_NONBLOCK fd makes io_uring
+ * complete empty reads with -EAGAIN instead of waiting for data.
+ *
+ * Blocking reads on one fd are served concurrently by io-wq workers and
+ * may complete in any order, so only a single read per device keeps
+ * batches in time order. Asking for more trades that for throughput.
+ */
+class uring_reader {
+public:
+	using handler = std::function<void(std::size_t dev, const batch &b)>;
+
+	uring_reader() = default;
+	uring_reader(const uring_reader &) = delete;
+	uring_reader &operator=(const uring_reader &) = delete;
+	~uring_reader() { stop(); }
+
+	/* Returns the index later passed to the handler, or -errno */
+	int add(device &dev);
+
+	int start(handler h, unsigned int reads_per_device = 1);
+	void stop();
+
+	/*
+	 * Submit pending reads and wait for at least min_complete of them,
+	 * then dispatch. Every completion is consumed and its read re-posted,
+	 * failed ones included; the first read error is returned after the
+	 * rest were dispatched. Otherwise returns the number of completions.
+	 */
+	int run_once(unsigned int min_complete = 1);
+
+private:
+	struct slot {
+		std::size_t dev;
+		uint8_t *buf;
+		std::size_t len;
+	};
+
+	void queue_read(unsigned int idx);
+	int map_rings(const struct io_uring_params &p);
+
+	std::vector<device *> devs_;
+	std::vector<slot> slots_;
+	std::vector<uint8_t> mem_;
+	handler h_;
+
+	int fd_ = -1;
+	unsigned int to_submit_ = 0;
+
+	void *sq_ptr_ = nullptr;
+	void *cq_ptr_ = nullptr;
+	std::size_t sq_len_ = 0;
+	std::size_t cq_len_ = 0;
+	struct io_uring_sqe *sqes_ = nullptr;
+	std::size_t sqes_len_ = 0;
+
+	unsigned int *sq_head_;
+	unsigned int *sq_tail_;
+	unsigned int *sq_mask_;
+	unsigned int *sq_array_;
+	unsigned int *cq_head_;
+	unsigned int *cq_tail_;
+	unsigned int *cq_mask_;
+	struct io_uring_cqe *cqes_;
+};
+
+} /* namespace apds9960 */
+
+#endif /* _APDS9960_URING_H_ */
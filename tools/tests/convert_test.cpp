@@ -0,0 +1,106 @@
+#include "convert.h"
+
+#include <random>
+#include <string>
+
+#include <gtest/gtest.h>
+
+using namespace apds9960;
+
+namespace {
+
+struct convert_case {
+	const char *name;
+	unsigned int atime_us;
+	unsigned int gain;
+	int32_t r_coef, g_coef, b_coef, ct_coef, ct_offset;
+};
+
+class convert_parity : public ::testing::TestWithParam<convert_case> {};
+
+/* Whatever kernel convert_batch() picked must match convert_one() exactly */
+TEST_P(convert_parity, matches_scalar)
+{
+	const convert_case &cc = GetParam();
+	const std::size_t n = 1 << 16;
+	std::vector<uint16_t> c(n), r(n), g(n), b(n);
+	std::vector<uint32_t> m1(n), m2(n);
+	std::vector<int32_t> t1(n), t2(n);
+	std::mt19937 rng(1);
+	convert_params p;
+
+	/* Random, plausible and rail-to-rail inputs */
+	for (std::size_t i = 0; i < n; i++) {
+		switch (rng() % 3) {
+		case 0:
+			c[i] = rng();
+			r[i] = rng();
+			g[i] = rng();
+			b[i] = rng();
+			break;
+		case 1:
+			c[i] = rng();
+			r[i] = c[i] / 3 + rng() % 100;
+			g[i] = c[i] / 3;
+			b[i] = c[i] / 4;
+			break;
+		default:
+			c[i] = rng() % 2 ? 65535 : 0;
+			r[i] = rng() % 3 ? 65535 : rng() % 5;
+			g[i] = rng() % 2 ? 65535 : 1;
+			b[i] = rng() % 2 ? 65535 : 0;
+			break;
+		}
+	}
+
+	p.r_coef = cc.r_coef;
+	p.g_coef = cc.g_coef;
+	p.b_coef = cc.b_coef;
+	p.ct_coef = cc.ct_coef;
+	p.ct_offset = cc.ct_offset;
+	ASSERT_EQ(convert_prepare(p, cc.atime_us, cc.gain), 0);
+
+	for (std::size_t i = 0; i < n; i++)
+		convert_one(p, c[i], r[i], g[i], b[i], &m1[i], &t1[i]);
+	convert_batch(p, c.data(), r.data(), g.data(), b.data(), m2.data(),
+		      t2.data(), n);
+
+	for (std::size_t i = 0; i < n; i++) {
+		ASSERT_EQ(m1[i], m2[i]) << convert_impl() << " at " << i;
+		ASSERT_EQ(t1[i], t2[i]) << convert_impl() << " at " << i;
+	}
+}
+
+/* An odd length exercises the scalar tail after the vector loop */
+TEST(convert, tail)
+{
+	const uint16_t c[] = {
+		100, 200, 300, 400, 500, 600, 700, 800, 900, 1000, 1100,
+	};
+	const std::size_t n = sizeof(c) / sizeof(c[0]);
+	uint32_t mlux[n], ref;
+	int32_t cct[n], cref;
+	convert_params p;
+
+	ASSERT_EQ(convert_prepare(p, 2780, 1), 0);
+	convert_batch(p, c, c, c, c, mlux, cct, n);
+	for (std::size_t i = 0; i < n; i++) {
+		convert_one(p, c[i], c[i], c[i], c[i], &ref, &cref);
+		EXPECT_EQ(mlux[i], ref);
+		EXPECT_EQ(cct[i], cref);
+	}
+}
+
+INSTANTIATE_TEST_SUITE_P(
+	configs, convert_parity,
+	::testing::Values(
+		convert_case{ "dn40", 2780, 1, 136, 1000, -444, 3810, 1391 },
+		convert_case{ "coef_max", 2780, 1, 8191, 8191, 8191, -8191, 0 },
+		convert_case{ "coef_min", 712000, 64, -8191, 1000, -8191, 8191,
+			      -5 },
+		convert_case{ "gain4", 10000, 4, 136, 1000, -444, 3810, 1391 }),
+	[](const ::testing::TestParamInfo<convert_case> &info) {
+		return std::string(info.param.name);
+	});
+
+} /* namespace */
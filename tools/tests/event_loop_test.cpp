@@ -0,0 +1,123 @@
+#include "event_loop.h"
+
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <gtest/gtest.h>
+
+using namespace apds9960;
+
+namespace {
+
+class event_loop_test : public ::testing::Test {
+protected:
+	void SetUp() override
+	{
+		ASSERT_EQ(loop.init(), 0);
+		ASSERT_EQ(pipe2(a, O_NONBLOCK | O_CLOEXEC), 0);
+		ASSERT_EQ(pipe2(b, O_NONBLOCK | O_CLOEXEC), 0);
+	}
+
+	void TearDown() override
+	{
+		for (int fd : { a[0], a[1], b[0], b[1] })
+			close(fd);
+	}
+
+	static void poke(int fd)
+	{
+		ASSERT_EQ(write(fd, "x", 1), 1);
+	}
+
+	static void drain(int fd)
+	{
+		char buf[16];
+
+		while (read(fd, buf, sizeof(buf)) > 0)
+			;
+	}
+
+	event_loop loop;
+	int a[2], b[2];
+};
+
+TEST_F(event_loop_test, dispatch)
+{
+	uint32_t seen = 0;
+	int calls = 0;
+
+	ASSERT_EQ(loop.add(a[0], EPOLLIN, [&](uint32_t ev) {
+		seen = ev;
+		calls++;
+	}), 0);
+	EXPECT_EQ(loop.add(a[0], EPOLLIN, [](uint32_t) {}), -EEXIST);
+
+	EXPECT_EQ(loop.run_once(0), 0);
+	EXPECT_EQ(calls, 0);
+
+	poke(a[1]);
+	EXPECT_EQ(loop.run_once(100), 1);
+	EXPECT_EQ(calls, 1);
+	EXPECT_TRUE(seen & EPOLLIN);
+}
+
+/* Edge-triggered fds report once per new arrival, not per pending byte */
+TEST_F(event_loop_test, edge_triggered)
+{
+	int calls = 0;
+
+	ASSERT_EQ(loop.add(a[0], EPOLLIN | EPOLLET,
+			   [&](uint32_t) { calls++; }), 0);
+
+	poke(a[1]);
+	EXPECT_EQ(loop.run_once(100), 1);
+	EXPECT_EQ(loop.run_once(0), 0);
+	EXPECT_EQ(calls, 1);
+
+	EXPECT_EQ(loop.modify(a[0], EPOLLIN), 0);
+	EXPECT_EQ(loop.run_once(0), 1);
+	EXPECT_EQ(calls, 2);
+	EXPECT_EQ(loop.modify(b[0], EPOLLIN), -ENOENT);
+}
+
+/* A handler may remove another fd whose event is already in this round */
+TEST_F(event_loop_test, remove_from_handler)
+{
+	int calls_a = 0, calls_b = 0;
+
+	ASSERT_EQ(loop.add(a[0], EPOLLIN, [&](uint32_t) {
+		calls_a++;
+		drain(a[0]);
+		loop.remove(b[0]);
+	}), 0);
+	ASSERT_EQ(loop.add(b[0], EPOLLIN, [&](uint32_t) {
+		calls_b++;
+		drain(b[0]);
+		loop.remove(a[0]);
+	}), 0);
+
+	poke(a[1]);
+	poke(b[1]);
+	EXPECT_EQ(loop.run_once(100), 2);
+	EXPECT_EQ(calls_a + calls_b, 1);
+
+	EXPECT_EQ(loop.run_once(0), 0);
+	EXPECT_EQ(loop.remove(a[0]) + loop.remove(b[0]), -ENOENT);
+}
+
+TEST_F(event_loop_test, stop)
+{
+	int calls = 0;
+
+	ASSERT_EQ(loop.add(a[0], EPOLLIN, [&](uint32_t) {
+		if (++calls == 3)
+			loop.stop();
+	}), 0);
+
+	poke(a[1]);
+	EXPECT_EQ(loop.run(), 0);
+	EXPECT_EQ(calls, 3);
+}
+
+} /* namespace */
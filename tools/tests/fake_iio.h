@@ -0,0 +1,61 @@
+#ifndef _APDS9960_TESTS_FAKE_IIO_H_
+#define _APDS9960_TESTS_FAKE_IIO_H_
+
+#include <fcntl.h>
+#include <fstream>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "tmpdir.h"
+
+/*
+ * Fake IIO device: a sysfs-like directory with the scan elements and buffer
+ * attributes device::open() touches, and a FIFO standing in for the
+ * character device. The write end is opened first so that a blocking open
+ * of the read side does not hang, and stays open so reads never see EOF.
+ */
+class fake_iio_test : public tmpdir_test {
+protected:
+	void TearDown() override
+	{
+		for (int fd : writers)
+			close(fd);
+		tmpdir_test::TearDown();
+	}
+
+	static void put(const std::string &path, const std::string &val)
+	{
+		std::ofstream(path) << val << "\n";
+	}
+
+	/* Returns the sysfs directory; the FIFO writer ends up in writers */
+	std::string make_device(const std::string &name)
+	{
+		std::string d = path(name), se = d + "/scan_elements/";
+		int fd;
+
+		mkdir(d.c_str(), 0755);
+		mkdir(se.c_str(), 0755);
+		mkdir((d + "/buffer").c_str(), 0755);
+
+		put(se + "in_intensity_clear_en", "0");
+		put(se + "in_intensity_clear_index", "0");
+		put(se + "in_intensity_clear_type", "le:u16/16>>0");
+		put(se + "in_timestamp_en", "0");
+		put(se + "in_timestamp_index", "1");
+		put(se + "in_timestamp_type", "le:s64/64>>0");
+		for (const char *attr : { "enable", "length", "watermark" })
+			put(d + "/buffer/" + attr, "0");
+
+		EXPECT_EQ(mkfifo((d + "/node").c_str(), 0600), 0);
+		fd = open((d + "/node").c_str(), O_RDWR | O_CLOEXEC);
+		EXPECT_GE(fd, 0);
+		writers.push_back(fd);
+
+		return d;
+	}
+
+	std::vector<int> writers;
+};
+
+#endif /* _APDS9960_TESTS_FAKE_IIO_H_ */
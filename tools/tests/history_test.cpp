@@ -0,0 +1,148 @@
+#include "history.h"
+
+#include <cerrno>
+
+#include "tmpdir.h"
+
+using namespace apds9960;
+
+namespace {
+
+class history_test : public tmpdir_test {
+protected:
+	void SetUp() override
+	{
+		tmpdir_test::SetUp();
+		opts.segment_points = 1 << 12;
+		opts.fanout = 4;
+	}
+
+	/* Points every 10 ns with a sawtooth of period 100 */
+	void fill(history &h, int n)
+	{
+		for (int i = 0; i < n; i++)
+			ASSERT_EQ(h.append(i * 10LL, i % 100), 0);
+	}
+
+	history_options opts;
+};
+
+TEST_F(history_test, raw_points)
+{
+	std::vector<hist_summary> v;
+	history h;
+
+	ASSERT_EQ(h.open(dir, opts), 0);
+	fill(h, 1000);
+
+	/* A narrow range within budget comes back point by point */
+	ASSERT_EQ(h.query(500, 600, 50, v), 10);
+	for (int i = 0; i < 10; i++) {
+		EXPECT_EQ(v[i].first_ts, 500 + i * 10);
+		EXPECT_EQ(v[i].count, 1u);
+		EXPECT_EQ(v[i].min, 50 + i);
+	}
+}
+
+TEST_F(history_test, pyramid)
+{
+	std::vector<hist_summary> v;
+	uint64_t count = 0;
+	int64_t prev = -1;
+	history h;
+	int n;
+
+	ASSERT_EQ(h.open(dir, opts), 0);
+	fill(h, 10000);
+	EXPECT_EQ(h.size(), 10000u);
+
+	n = h.query(0, 100000, 50, v);
+	ASSERT_GT(n, 0);
+	EXPECT_LE(n, 50);
+
+	/* Buckets are ordered, disjoint and cover every point once */
+	for (const auto &s : v) {
+		EXPECT_GT(s.first_ts, prev);
+		EXPECT_LE(s.first_ts, s.last_ts);
+		EXPECT_LE(s.min, s.max);
+		EXPECT_GE(s.mean(), s.min);
+		EXPECT_LE(s.mean(), s.max);
+		prev = s.last_ts;
+		count += s.count;
+	}
+	EXPECT_EQ(count, 10000u);
+
+	/* Whole sawtooth periods per bucket: full range, mean in the middle */
+	EXPECT_EQ(v[0].min, 0);
+	EXPECT_EQ(v[0].max, 99);
+}
+
+TEST_F(history_test, reopen)
+{
+	std::vector<hist_summary> v;
+	history h;
+
+	ASSERT_EQ(h.open(dir, opts), 0);
+	fill(h, 10000);
+	h.close();
+
+	ASSERT_EQ(h.open(dir, opts), 0);
+	EXPECT_EQ(h.size(), 10000u);
+	ASSERT_EQ(h.append(100000, 5), 0);
+	EXPECT_EQ(h.size(), 10001u);
+
+	ASSERT_EQ(h.query(100000, 100001, 10, v), 1);
+	EXPECT_EQ(v[0].max, 5);
+}
+
+/* Order is kept across the boundary to a fresh segment */
+TEST_F(history_test, backwards_across_segment)
+{
+	history h;
+
+	opts.segment_points = 16;
+	ASSERT_EQ(h.open(dir, opts), 0);
+	fill(h, 16);
+
+	EXPECT_EQ(h.append(5, 1), -EINVAL);
+	EXPECT_EQ(h.size(), 16u);
+	EXPECT_EQ(h.append(200, 1), 0);
+	EXPECT_EQ(h.size(), 17u);
+}
+
+/* Spread over more segments than points, the budget still holds */
+TEST_F(history_test, budget_across_segments)
+{
+	std::vector<hist_summary> v;
+	uint64_t count = 0;
+	int64_t prev = -1;
+	history h;
+
+	opts.segment_points = 16;
+	ASSERT_EQ(h.open(dir, opts), 0);
+	fill(h, 16 * 20);
+
+	for (std::size_t max : { 1, 3, 7, 19, 20, 21 }) {
+		ASSERT_GT(h.query(0, 100000, max, v), 0);
+		EXPECT_LE(v.size(), max);
+
+		count = 0;
+		prev = -1;
+		for (const auto &s : v) {
+			EXPECT_GT(s.first_ts, prev);
+			prev = s.last_ts;
+			count += s.count;
+		}
+		EXPECT_EQ(count, 16u * 20) << max;
+	}
+}
+
+TEST_F(history_test, bad_options)
+{
+	history h;
+
+	opts.fanout = 1;
+	EXPECT_EQ(h.open(dir, opts), -EINVAL);
+}
+
+} /* namespace */
@@ -0,0 +1,80 @@
+#include "metrics.h"
+
+#include <gtest/gtest.h>
+
+using namespace apds9960;
+
+namespace {
+
+/* 10 buckets of 100 ns: the window covers the last 1000 ns */
+class rolling_window_test : public ::testing::Test {
+protected:
+	rolling_window w{ 100, 10 };
+};
+
+TEST_F(rolling_window_test, aggregates)
+{
+	w.add(0, 5, false);
+	w.add(150, -3, false);
+	w.add(999, 10, true);
+	w.add_event(420);
+	w.add_event(420, 2);
+
+	agg_bucket t = w.total(999);
+
+	EXPECT_EQ(t.count, 3u);
+	EXPECT_EQ(t.sum, 12);
+	EXPECT_EQ(t.min, -3);
+	EXPECT_EQ(t.max, 10);
+	EXPECT_EQ(t.saturated, 1u);
+	EXPECT_EQ(t.events, 3u);
+}
+
+/* A bucket falls out of the window once its epoch is nr_buckets old */
+TEST_F(rolling_window_test, expiry)
+{
+	w.add(50, 1, false);
+	w.add(250, 2, false);
+
+	EXPECT_EQ(w.total(999).count, 2u);
+	EXPECT_EQ(w.total(1000).count, 1u);
+	EXPECT_EQ(w.total(1199).sum, 2);
+	EXPECT_EQ(w.total(1200).count, 0u);
+}
+
+/* Lapping the ring reuses a slot without carrying its old contents */
+TEST_F(rolling_window_test, lap)
+{
+	w.add(50, 1, false);
+	w.add_event(50);
+	w.add(1050, 7, false);
+
+	agg_bucket t = w.total(1050);
+
+	EXPECT_EQ(t.count, 1u);
+	EXPECT_EQ(t.sum, 7);
+	EXPECT_EQ(t.events, 0u);
+}
+
+/* Reading a window far in the past or future sees nothing stale */
+TEST_F(rolling_window_test, out_of_range)
+{
+	w.add(5000, 1, false);
+
+	EXPECT_EQ(w.total(100).count, 0u);
+	EXPECT_EQ(w.total(100000).count, 0u);
+}
+
+TEST(metric_windows_test, expose_events)
+{
+	metric_windows m;
+	std::string out;
+
+	m.add_event(1000000000LL, 4);
+	m.expose_events(out, "x", 1000000000LL);
+
+	EXPECT_NE(out.find("x_events{window=\"1s\"} 4"), std::string::npos)
+		<< out;
+}
+
+} /* namespace */
@@ -0,0 +1,128 @@
+#include "record.h"
+
+#include <cstring>
+#include <random>
+#include <unistd.h>
+
+#include "tmpdir.h"
+
+using namespace apds9960;
+
+namespace {
+
+class record_test : public tmpdir_test {
+protected:
+	void SetUp() override
+	{
+		static const char *const names[] = {
+			"in_intensity_clear", "in_intensity_red",
+			"in_intensity_green", "in_intensity_blue",
+			"in_proximity",
+		};
+		std::mt19937 rng(1);
+		int64_t ts = 1700000000000000000LL;
+		int c = 1000;
+
+		tmpdir_test::SetUp();
+
+		for (int i = 0; i < 5; i++)
+			layout.add(names[i], i,
+				   i == 4 ? "le:u8/8>>0" : "le:u16/16>>0");
+		layout.add("in_timestamp", 5, "le:s64/64>>0");
+		layout.compile();
+
+		/* A slowly drifting signal with a jittery 10 ms period */
+		raw.resize(nr_scans * layout.scan_bytes());
+		for (std::size_t i = 0; i < nr_scans; i++) {
+			uint8_t *s = &raw[i * layout.scan_bytes()];
+
+			c += rng() % 7 - 3;
+			ts += 10000000 + rng() % 2000;
+			layout.encode(s, 0, c);
+			layout.encode(s, 1, c / 3 + rng() % 3);
+			layout.encode(s, 2, c / 2);
+			layout.encode(s, 3, c / 4);
+			layout.encode(s, 4, rng() % 4);
+			layout.encode(s, 5, ts);
+		}
+		last_ts = ts;
+	}
+
+	batch all() const
+	{
+		return batch(&layout, span<const uint8_t>(raw.data(), raw.size()));
+	}
+
+	static constexpr std::size_t nr_scans = 20000;
+	scan_layout layout;
+	std::vector<uint8_t> raw;
+	int64_t last_ts;
+};
+
+TEST_F(record_test, round_trip)
+{
+	record_writer w;
+	record_reader r;
+	std::size_t off = 0;
+	batch b;
+	int ret;
+
+	ASSERT_EQ(w.open(path("t.rec"), layout, 4096), 0);
+	ASSERT_EQ(w.write(all()), 0);
+	ASSERT_EQ(w.close(), 0);
+
+	/* Delta coding has to beat the raw scans by a wide margin */
+	EXPECT_LT(w.bytes_written() * 3, raw.size());
+
+	ASSERT_EQ(r.open(path("t.rec")), 0);
+	EXPECT_EQ(r.layout().scan_bytes(), layout.scan_bytes());
+	EXPECT_EQ(r.chunks().size(), (nr_scans + 4095) / 4096);
+
+	while ((ret = r.next(b)) > 0) {
+		ASSERT_LE(off + b.bytes().size(), raw.size());
+		ASSERT_EQ(memcmp(b.bytes().data(), &raw[off], b.bytes().size()),
+			  0);
+		off += b.bytes().size();
+	}
+	EXPECT_EQ(ret, 0);
+	EXPECT_EQ(off, raw.size());
+}
+
+TEST_F(record_test, seek)
+{
+	record_writer w;
+	record_reader r;
+
+	ASSERT_EQ(w.open(path("t.rec"), layout, 4096), 0);
+	ASSERT_EQ(w.write(all()), 0);
+	ASSERT_EQ(w.close(), 0);
+
+	ASSERT_EQ(r.open(path("t.rec")), 0);
+	EXPECT_EQ(r.seek_chunk(0), 0u);
+	EXPECT_EQ(r.seek_chunk(last_ts), r.chunks().size() - 1);
+	EXPECT_EQ(r.seek_chunk(r.chunks()[2].first_ts), 2u);
+}
+
+/* A recorder killed mid-write leaves its complete chunks readable */
+TEST_F(record_test, truncated)
+{
+	record_writer w;
+	record_reader r;
+	uint64_t len;
+
+	ASSERT_EQ(w.open(path("t.rec"), layout, 4096), 0);
+	ASSERT_EQ(w.write(all()), 0);
+	ASSERT_EQ(w.close(), 0);
+	len = w.bytes_written();
+
+	ASSERT_EQ(truncate(path("t.rec").c_str(), len - 500), 0);
+	ASSERT_EQ(r.open(path("t.rec")), 0);
+	EXPECT_EQ(r.chunks().size(), nr_scans / 4096);
+}
+
+TEST(crc32, check_value)
+{
+	EXPECT_EQ(crc32(0, "123456789", 9), 0xcbf43926u);
+}
+
+} /* namespace */
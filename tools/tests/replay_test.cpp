@@ -0,0 +1,295 @@
+#include "replay.h"
+#include "reg_replay.h"
+
+#include <array>
+
+#include "tmpdir.h"
+
+using namespace apds9960;
+
+namespace {
+
+class replay_test : public tmpdir_test {
+protected:
+	void SetUp() override
+	{
+		tmpdir_test::SetUp();
+
+		layout.add("in_intensity_clear", 0, "le:u16/16>>0");
+		layout.add("in_intensity_red", 1, "le:u16/16>>0");
+		layout.add("in_proximity", 2, "le:u8/8>>0");
+		layout.add("in_timestamp", 3, "le:s64/64>>0");
+		layout.compile();
+	}
+
+	/* One scan per entry of clear, red = clear / 2, proximity */
+	std::vector<uint8_t> scans(const std::vector<int> &clear,
+				   const std::vector<int> &prox = {}) const
+	{
+		std::vector<uint8_t> raw(clear.size() * layout.scan_bytes());
+
+		for (std::size_t i = 0; i < clear.size(); i++) {
+			uint8_t *s = &raw[i * layout.scan_bytes()];
+
+			layout.encode(s, 0, clear[i]);
+			layout.encode(s, 1, clear[i] / 2);
+			layout.encode(s, 2, i < prox.size() ? prox[i] : 0);
+			layout.encode(s, 3, 1000000 * (int64_t)i);
+		}
+
+		return raw;
+	}
+
+	batch as_batch(const std::vector<uint8_t> &raw) const
+	{
+		return batch(&layout, span<const uint8_t>(raw.data(), raw.size()));
+	}
+
+	void write(const std::string &name, const std::vector<int> &clear)
+	{
+		record_writer w;
+		auto raw = scans(clear);
+
+		ASSERT_EQ(w.open(path(name), layout, 4), 0);
+		ASSERT_EQ(w.write(as_batch(raw)), 0);
+		ASSERT_EQ(w.close(), 0);
+	}
+
+	diff_result diff(const std::string &a, const std::string &b,
+			 int64_t tolerance)
+	{
+		record_reader ra, rb;
+		diff_result res{};
+
+		EXPECT_EQ(ra.open(path(a)), 0);
+		EXPECT_EQ(rb.open(path(b)), 0);
+		EXPECT_EQ(replay_diff(ra, rb, tolerance, res), 0);
+
+		return res;
+	}
+
+	scan_layout layout;
+};
+
+/* A register file with a driver that acknowledges every interrupt */
+struct fake_chip {
+	reg_target target()
+	{
+		return reg_target{
+			[this](uint8_t reg, uint8_t &val) {
+				val = regs[reg];
+				return 0;
+			},
+			[this](uint8_t reg, uint8_t val) {
+				regs[reg] = val;
+				return 0;
+			},
+			[this](bool asserted) {
+				line = asserted;
+				if (asserted) {
+					seen.push_back(regs[0x93]);
+					if (ack)
+						regs[0xe7] = 1;
+				}
+				return 0;
+			},
+			nullptr,
+		};
+	}
+
+	unsigned int data(uint8_t reg) const
+	{
+		return regs[reg] | regs[reg + 1] << 8;
+	}
+
+	std::array<uint8_t, 256> regs{};
+	std::vector<uint8_t> seen;
+	bool line = false;
+	bool ack = true;
+};
+
+} /* namespace */
+
+TEST_F(replay_test, diff_equal)
+{
+	write("a", { 1, 2, 3, 4, 5, 6, 7, 8, 9 });
+	write("b", { 1, 2, 3, 4, 5, 6, 7, 8, 9 });
+
+	diff_result res = diff("a", "b", 0);
+
+	EXPECT_EQ(res.compared, 9u);
+	EXPECT_EQ(res.mismatched, 0u);
+	EXPECT_EQ(res.first_sample, -1);
+}
+
+TEST_F(replay_test, diff_tolerance)
+{
+	write("a", { 10, 20, 30, 40 });
+	write("b", { 11, 20, 28, 40 });
+
+	EXPECT_EQ(diff("a", "b", 2).mismatched, 0u);
+
+	diff_result res = diff("a", "b", 1);
+
+	EXPECT_EQ(res.mismatched, 1u);
+	EXPECT_EQ(res.first_sample, 2);
+	EXPECT_EQ(res.first_channel, 0);
+}
+
+TEST_F(replay_test, diff_length)
+{
+	write("a", { 1, 2, 3, 4, 5, 6 });
+	write("b", { 1, 2, 3, 4, 5 });
+
+	diff_result res = diff("a", "b", 0);
+
+	EXPECT_EQ(res.compared, 5u);
+	EXPECT_EQ(res.mismatched, 1u);
+	EXPECT_EQ(res.first_sample, 5);
+}
+
+TEST_F(replay_test, powered_down)
+{
+	fake_chip chip;
+	register_replay rp(chip.target());
+	auto raw = scans({ 100, 200 });
+
+	ASSERT_EQ(rp.setup(layout), 0);
+	ASSERT_EQ(rp.reset(), 0);
+	EXPECT_EQ(chip.regs[0x92], 0xab);
+
+	ASSERT_EQ(rp.present(as_batch(raw)), 0);
+	EXPECT_EQ(chip.data(0x94), 0u);
+	EXPECT_EQ(chip.regs[0x93], 0);
+	EXPECT_EQ(rp.interrupts(), 0u);
+}
+
+TEST_F(replay_test, every_cycle)
+{
+	fake_chip chip;
+	register_replay rp(chip.target());
+	auto raw = scans({ 100, 200, 300 }, { 7, 8, 9 });
+
+	/* PON, AEN, PEN, AIEN with APERS 0: one interrupt per cycle */
+	chip.regs[0x80] = 0x17;
+	chip.regs[0x81] = 0xff;
+	chip.regs[0x8c] = 0x10;
+	chip.regs[0x8b] = 0xff;
+
+	ASSERT_EQ(rp.setup(layout), 0);
+	ASSERT_EQ(rp.present(as_batch(raw)), 0);
+
+	EXPECT_EQ(rp.interrupts(), 3u);
+	EXPECT_EQ(rp.missed_acks(), 0u);
+	EXPECT_FALSE(chip.line);
+	ASSERT_EQ(chip.seen.size(), 3u);
+	EXPECT_EQ(chip.seen[0], 0x13);
+
+	EXPECT_EQ(chip.data(0x94), 300u);
+	EXPECT_EQ(chip.data(0x96), 150u);
+	EXPECT_EQ(chip.data(0x98), 0u);
+	EXPECT_EQ(chip.regs[0x9c], 9);
+	/* The acknowledge clears the interrupt bits, VALID stays */
+	EXPECT_EQ(chip.regs[0x93], 0x03);
+	EXPECT_EQ(chip.regs[0xe7], 0);
+}
+
+TEST_F(replay_test, thresholds)
+{
+	fake_chip chip;
+	register_replay rp(chip.target());
+	auto raw = scans({ 100, 600, 100, 600, 600, 700, 100 });
+
+	/* ALS window 50..500, two cycles outside it to interrupt */
+	chip.regs[0x80] = 0x13;
+	chip.regs[0x81] = 0xff;
+	chip.regs[0x84] = 50;
+	chip.regs[0x86] = 500 & 0xff;
+	chip.regs[0x87] = 500 >> 8;
+	chip.regs[0x8c] = 0x02;
+
+	ASSERT_EQ(rp.setup(layout), 0);
+	ASSERT_EQ(rp.present(as_batch(raw)), 0);
+
+	/* Samples 4 and 5 are the second and third cycle out of range */
+	EXPECT_EQ(rp.interrupts(), 2u);
+	EXPECT_EQ(rp.cycles(), 7u);
+}
+
+TEST_F(replay_test, saturation)
+{
+	fake_chip chip;
+	register_replay rp(chip.target());
+	auto raw = scans({ 500, 2000 });
+
+	/* ATIME 0xff is one cycle, 1025 counts full scale; CPSIEN only */
+	chip.regs[0x80] = 0x03;
+	chip.regs[0x81] = 0xff;
+	chip.regs[0x90] = 0x40;
+
+	ASSERT_EQ(rp.setup(layout), 0);
+	ASSERT_EQ(rp.present(as_batch(raw)), 0);
+
+	EXPECT_EQ(rp.interrupts(), 1u);
+	ASSERT_EQ(chip.seen.size(), 1u);
+	EXPECT_TRUE(chip.seen[0] & 0x80);
+	EXPECT_EQ(chip.data(0x94), 1025u);
+}
+
+TEST_F(replay_test, missed_ack)
+{
+	fake_chip chip;
+	register_replay rp(chip.target(), reg_replay_config{ 1 });
+	auto raw = scans({ 100, 200, 300 });
+
+	chip.regs[0x80] = 0x13;
+	chip.regs[0x81] = 0xff;
+	chip.ack = false;
+
+	ASSERT_EQ(rp.setup(layout), 0);
+	ASSERT_EQ(rp.present(as_batch(raw)), 0);
+
+	/* The line stays down and no further edge is generated */
+	EXPECT_EQ(rp.interrupts(), 1u);
+	EXPECT_EQ(rp.missed_acks(), 1u);
+	EXPECT_TRUE(chip.line);
+	EXPECT_EQ(chip.data(0x94), 300u);
+
+	/* A late AICLEAR releases it before the next cycle */
+	chip.regs[0xe7] = 1;
+	chip.ack = true;
+	ASSERT_EQ(rp.present(as_batch(raw)), 0);
+	EXPECT_EQ(rp.interrupts(), 4u);
+	EXPECT_FALSE(chip.line);
+}
+
+TEST_F(replay_test, sleep_after_interrupt)
+{
+	fake_chip chip;
+	register_replay rp(chip.target(), reg_replay_config{ 1 });
+	auto raw = scans({ 100, 200, 300 });
+
+	/* With SAI the chip holds the first sample until the acknowledge */
+	chip.regs[0x80] = 0x13;
+	chip.regs[0x81] = 0xff;
+	chip.regs[0x9f] = 0x10;
+	chip.ack = false;
+
+	ASSERT_EQ(rp.setup(layout), 0);
+	ASSERT_EQ(rp.present(as_batch(raw)), 0);
+
+	EXPECT_EQ(rp.interrupts(), 1u);
+	EXPECT_EQ(chip.data(0x94), 100u);
+}
+
+TEST_F(replay_test, no_channels)
+{
+	fake_chip chip;
+	register_replay rp(chip.target());
+	scan_layout other;
+
+	other.add("in_timestamp", 0, "le:s64/64>>0");
+	other.compile();
+
+	EXPECT_EQ(rp.setup(other), -EINVAL);
+}
@@ -0,0 +1,144 @@
+#include "scan.h"
+
+#include <gtest/gtest.h>
+
+using namespace apds9960;
+
+namespace {
+
+TEST(parse_type, fields)
+{
+	scan_channel ch;
+
+	ASSERT_EQ(scan_layout::parse_type("be:s12/16X3>>4", ch), 0);
+	EXPECT_TRUE(ch.be);
+	EXPECT_TRUE(ch.is_signed);
+	EXPECT_EQ(ch.bits, 12u);
+	EXPECT_EQ(ch.storagebits, 16u);
+	EXPECT_EQ(ch.repeat, 3u);
+	EXPECT_EQ(ch.shift, 4u);
+	EXPECT_EQ(scan_layout::type_string(ch), "be:s12/16X3>>4");
+
+	ASSERT_EQ(scan_layout::parse_type("le:u8/8>>0", ch), 0);
+	EXPECT_FALSE(ch.be);
+	EXPECT_FALSE(ch.is_signed);
+	EXPECT_EQ(ch.repeat, 1u);
+	EXPECT_EQ(scan_layout::type_string(ch), "le:u8/8>>0");
+}
+
+TEST(parse_type, rejects)
+{
+	static const char *const bad[] = {
+		"",
+		"le:u16/16",		/* no shift */
+		"xe:u16/16>>0",		/* endianness */
+		"le:f16/16>>0",		/* sign */
+		"le:u12/12>>0",		/* storage size */
+		"le:u0/16>>0",		/* no bits */
+		"le:u16/16>>1",		/* does not fit */
+		"le:u8/8X0>>0",		/* no repeat */
+		"le:u16/16>>0junk",	/* trailing junk */
+		"le:u16/16X2>>0 x",
+		"le:u16/16>>0\n",
+	};
+	scan_channel ch;
+
+	for (const char *t : bad)
+		EXPECT_EQ(scan_layout::parse_type(t, ch), -EINVAL) << t;
+}
+
+class scan_layout_test : public ::testing::Test {
+protected:
+	/* Scans are built by hand, byte for byte as the kernel lays them out */
+	scan_layout l;
+	uint8_t scan[32] = {};
+};
+
+/* 12 bits left-justified by 4 in a little-endian word, sign extended */
+TEST_F(scan_layout_test, le_signed_shift)
+{
+	ASSERT_EQ(l.add("in_accel_x", 0, "le:s12/16>>4"), 0);
+	l.compile();
+
+	scan[0] = 0xf0;
+	scan[1] = 0xff;
+	EXPECT_EQ(l.decode(scan, 0), -1);
+
+	scan[0] = 0x0f;		/* below the shift, ignored */
+	scan[1] = 0x80;
+	EXPECT_EQ(l.decode(scan, 0), -2048);
+
+	scan[0] = 0xf0;
+	scan[1] = 0x7f;
+	EXPECT_EQ(l.decode(scan, 0), 2047);
+}
+
+TEST_F(scan_layout_test, be_unsigned)
+{
+	ASSERT_EQ(l.add("in_intensity_clear", 0, "be:u16/16>>0"), 0);
+	l.compile();
+
+	scan[0] = 0x12;
+	scan[1] = 0x34;
+	EXPECT_EQ(l.decode(scan, 0), 0x1234);
+}
+
+TEST_F(scan_layout_test, masks_bits_above)
+{
+	ASSERT_EQ(l.add("in_proximity", 0, "le:u10/32>>2"), 0);
+	l.compile();
+
+	scan[0] = 0xff;
+	scan[1] = 0xff;
+	scan[2] = 0xff;
+	scan[3] = 0xff;
+	EXPECT_EQ(l.decode(scan, 0), 0x3ff);
+}
+
+/* Each element is aligned to its own size, the scan to the largest */
+TEST_F(scan_layout_test, packing)
+{
+	ASSERT_EQ(l.add("in_timestamp", 3, "le:s64/64>>0"), 0);
+	ASSERT_EQ(l.add("in_intensity_clear", 0, "le:u16/16>>0"), 0);
+	ASSERT_EQ(l.add("in_proximity", 1, "le:u8/8>>0"), 0);
+	ASSERT_EQ(l.add("in_intensity_red", 2, "le:u16/16>>0"), 0);
+	l.compile();
+
+	EXPECT_EQ(l.channel(0).offset, 0u);
+	EXPECT_EQ(l.channel(1).offset, 2u);
+	EXPECT_EQ(l.channel(2).offset, 4u);
+	EXPECT_EQ(l.channel(3).offset, 8u);
+	EXPECT_EQ(l.scan_bytes(), 16u);
+	EXPECT_EQ(l.timestamp_channel(), 3);
+	EXPECT_EQ(l.find("in_proximity"), 1);
+	EXPECT_EQ(l.find("in_nothing"), -ENOENT);
+}
+
+TEST_F(scan_layout_test, repeat)
+{
+	ASSERT_EQ(l.add("in_proximity", 0, "le:u8/8>>0"), 0);
+	ASSERT_EQ(l.add("in_quat", 1, "be:s16/16X4>>0"), 0);
+	l.compile();
+
+	EXPECT_EQ(l.channel(1).offset, 8u);
+	EXPECT_EQ(l.scan_bytes(), 16u);
+
+	scan[14] = 0xff;
+	scan[15] = 0xfe;
+	EXPECT_EQ(l.decode(scan, 1, 3), -2);
+}
+
+/* encode() writes only the channel's bits and round-trips via decode() */
+TEST_F(scan_layout_test, encode)
+{
+	ASSERT_EQ(l.add("in_accel_x", 0, "be:s12/16>>4"), 0);
+	l.compile();
+
+	scan[1] = 0x0a;
+	l.encode(scan, 0, -5);
+	EXPECT_EQ(l.decode(scan, 0), -5);
+	EXPECT_EQ(scan[0], 0xff);
+	EXPECT_EQ(scan[1], 0xba);
+}
+
+} /* namespace */
@@ -0,0 +1,177 @@
+#include "sensor.h"
+
+#include <vector>
+
+#include <gtest/gtest.h>
+
+using namespace apds9960;
+
+namespace {
+
+class sensor_test : public ::testing::Test {
+protected:
+	void SetUp() override
+	{
+		layout.add("in_intensity_clear", 0, "le:u16/16>>0");
+		layout.add("in_timestamp", 1, "le:s64/64>>0");
+		layout.compile();
+
+		h = sens.attach(loop, layout);
+	}
+
+	/* Feed n scans carrying values first, first + 1, ... */
+	void push(int first, int n)
+	{
+		std::vector<uint8_t> buf(n * layout.scan_bytes());
+
+		for (int i = 0; i < n; i++) {
+			uint8_t *s = &buf[i * layout.scan_bytes()];
+
+			layout.encode(s, 0, first + i);
+			layout.encode(s, 1, first + i);
+		}
+		h.on_batch(batch(&layout, span<const uint8_t>(buf.data(),
+							       buf.size())));
+	}
+
+	void push_event(uint64_t id)
+	{
+		struct iio_event_data ev = {};
+
+		ev.id = id;
+		h.on_event(span<const struct iio_event_data>(&ev, 1));
+	}
+
+	scan_layout layout;
+	event_loop loop;
+	sensor sens;
+	stream_handlers h;
+};
+
+task<> take_samples(sensor &s, int n, std::vector<int64_t> &out)
+{
+	while (n--) {
+		std::optional<sample> v = co_await s.next_sample();
+
+		out.push_back(v ? v->value(0) : -1);
+	}
+}
+
+task<> take_event(sensor &s, event_filter f, std::vector<uint64_t> &out)
+{
+	std::optional<struct iio_event_data> ev;
+
+	ev = co_await s.next_event(std::move(f));
+	out.push_back(ev ? ev->id : 0);
+}
+
+static event_filter id_is(uint64_t id)
+{
+	return [id](const struct iio_event_data &ev) { return ev.id == id; };
+}
+
+TEST_F(sensor_test, queued_samples_ready)
+{
+	std::vector<int64_t> got;
+	task<> t = take_samples(sens, 3, got);
+
+	push(10, 3);
+	t.start();
+
+	EXPECT_TRUE(t.done());
+	EXPECT_EQ(got, (std::vector<int64_t>{ 10, 11, 12 }));
+	EXPECT_EQ(sens.queued(), 0u);
+}
+
+/* Each sample goes to one waiter, the longest waiting one first */
+TEST_F(sensor_test, several_sample_waiters)
+{
+	std::vector<int64_t> a, b;
+	task<> ta = take_samples(sens, 1, a);
+	task<> tb = take_samples(sens, 1, b);
+
+	ta.start();
+	tb.start();
+	push(1, 1);
+
+	EXPECT_TRUE(ta.done());
+	EXPECT_FALSE(tb.done());
+
+	push(2, 3);
+
+	EXPECT_TRUE(tb.done());
+	EXPECT_EQ(a, (std::vector<int64_t>{ 1 }));
+	EXPECT_EQ(b, (std::vector<int64_t>{ 2 }));
+	EXPECT_EQ(sens.queued(), 2u);
+}
+
+/* Events no waiter wants stay queued for a later next_event() */
+TEST_F(sensor_test, unmatched_events_kept)
+{
+	std::vector<uint64_t> a, b, c;
+	task<> ta = take_event(sens, id_is(2), a);
+	task<> tb = take_event(sens, id_is(3), b);
+
+	ta.start();
+	tb.start();
+	push_event(1);
+	push_event(3);
+
+	EXPECT_FALSE(ta.done());
+	EXPECT_TRUE(tb.done());
+	EXPECT_EQ(b, (std::vector<uint64_t>{ 3 }));
+
+	push_event(2);
+	EXPECT_TRUE(ta.done());
+	EXPECT_EQ(a, (std::vector<uint64_t>{ 2 }));
+
+	task<> tc = take_event(sens, nullptr, c);
+
+	tc.start();
+	EXPECT_TRUE(tc.done());
+	EXPECT_EQ(c, (std::vector<uint64_t>{ 1 }));
+}
+
+TEST_F(sensor_test, error_wakes_everybody)
+{
+	std::vector<int64_t> a, b;
+	std::vector<uint64_t> e;
+	task<> ta = take_samples(sens, 1, a);
+	task<> tb = take_samples(sens, 2, b);
+	task<> te = take_event(sens, nullptr, e);
+
+	ta.start();
+	tb.start();
+	te.start();
+	h.on_error(-EIO);
+
+	EXPECT_TRUE(ta.done());
+	EXPECT_TRUE(tb.done());
+	EXPECT_TRUE(te.done());
+	EXPECT_EQ(a, (std::vector<int64_t>{ -1 }));
+	EXPECT_EQ(b, (std::vector<int64_t>{ -1, -1 }));
+	EXPECT_EQ(e, (std::vector<uint64_t>{ 0 }));
+	EXPECT_EQ(sens.error(), -EIO);
+}
+
+/* A coroutine destroyed while waiting is never resumed */
+TEST_F(sensor_test, destroyed_waiter)
+{
+	std::vector<int64_t> a, b;
+
+	{
+		task<> ta = take_samples(sens, 1, a);
+
+		ta.start();
+	}
+
+	task<> tb = take_samples(sens, 1, b);
+
+	tb.start();
+	push(5, 1);
+
+	EXPECT_TRUE(a.empty());
+	EXPECT_EQ(b, (std::vector<int64_t>{ 5 }));
+}
+
+} /* namespace */
@@ -0,0 +1,157 @@
+#include "shm_ring.h"
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+
+#include "tmpdir.h"
+
+using namespace apds9960;
+
+namespace {
+
+class shm_ring_test : public tmpdir_test {
+protected:
+	void SetUp() override
+	{
+		tmpdir_test::SetUp();
+
+		layout.add("in_intensity_clear", 0, "le:u16/16>>0");
+		layout.add("in_timestamp", 1, "le:s64/64>>0");
+		layout.compile();
+
+		ASSERT_EQ(prod.create(layout, 64), 0);
+		ASSERT_EQ(cons.attach(dup(prod.reader_fd())), 0);
+	}
+
+	/* Publish n scans carrying values and timestamps from first on */
+	void publish(int first, int n)
+	{
+		std::vector<uint8_t> buf(n * layout.scan_bytes());
+
+		for (int i = 0; i < n; i++) {
+			uint8_t *s = &buf[i * layout.scan_bytes()];
+
+			layout.encode(s, 0, (first + i) & 0xffff);
+			layout.encode(s, 1, first + i);
+		}
+		prod.publish(batch(&layout, span<const uint8_t>(buf.data(),
+								  buf.size())));
+	}
+
+	scan_layout layout;
+	shm_producer prod;
+	shm_consumer cons;
+};
+
+TEST_F(shm_ring_test, layout)
+{
+	EXPECT_EQ(cons.layout().scan_bytes(), layout.scan_bytes());
+	EXPECT_EQ(cons.layout().num_channels(), layout.num_channels());
+	EXPECT_EQ(cons.layout().timestamp_channel(), 1);
+}
+
+TEST_F(shm_ring_test, in_order)
+{
+	int next = 0;
+	batch b;
+	int ret;
+
+	for (int i = 0; i < 10; i++) {
+		publish(i * 5, 5);
+
+		while ((ret = cons.read(b, 4, 0)) > 0)
+			for (auto s : b) {
+				EXPECT_EQ(s.value(0), next);
+				EXPECT_EQ(s.timestamp(), next);
+				next++;
+			}
+		ASSERT_EQ(ret, 0);
+	}
+
+	EXPECT_EQ(next, 50);
+	EXPECT_EQ(cons.overruns(), 0u);
+}
+
+TEST_F(shm_ring_test, timeout)
+{
+	batch b;
+
+	EXPECT_EQ(cons.read(b, 16, 10), 0);
+}
+
+/* A lapped consumer skips to the oldest scan still held and counts the rest */
+TEST_F(shm_ring_test, overrun)
+{
+	batch b;
+	int ret;
+
+	publish(0, 100);
+
+	ret = cons.read(b, 256, 0);
+	ASSERT_GT(ret, 0);
+	EXPECT_EQ(cons.overruns() + ret, 100u);
+	EXPECT_EQ(b[b.size() - 1].timestamp(), 99);
+	EXPECT_EQ(b[0].timestamp(), (int64_t)cons.overruns());
+}
+
+/* What consumers get can not be mapped, or reopened, for writing */
+TEST_F(shm_ring_test, read_only)
+{
+	std::string self = "/proc/self/fd/" + std::to_string(prod.reader_fd());
+	struct stat st;
+	void *p;
+
+	EXPECT_EQ(fcntl(prod.reader_fd(), F_GETFL) & O_ACCMODE, O_RDONLY);
+
+	ASSERT_EQ(fstat(prod.reader_fd(), &st), 0);
+	p = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		 prod.reader_fd(), 0);
+	EXPECT_EQ(p, MAP_FAILED);
+	EXPECT_EQ(errno, EACCES);
+	EXPECT_EQ(st.st_mode & 0222, 0u);
+}
+
+/* A consumer fetches the reader fd through the socket, which is 0660 */
+TEST_F(shm_ring_test, socket)
+{
+	std::string sock = path("sock");
+	shm_consumer c2;
+	struct stat st;
+	batch b;
+	int lfd;
+
+	lfd = prod.listen(sock);
+	ASSERT_GE(lfd, 0);
+	ASSERT_EQ(stat(sock.c_str(), &st), 0);
+	EXPECT_EQ(st.st_mode & 0777, 0660u);
+
+	/* connect() waits for the fd, which accept_consumers() sends */
+	std::thread t([&]() { EXPECT_EQ(c2.connect(sock), 0); });
+	struct pollfd pfd = { lfd, POLLIN, 0 };
+
+	EXPECT_EQ(poll(&pfd, 1, 5000), 1);
+	prod.accept_consumers(lfd);
+	t.join();
+	close(lfd);
+
+	publish(7, 2);
+	ASSERT_EQ(c2.read(b, 16, 0), 2);
+	EXPECT_EQ(b[0].value(0), 7);
+}
+
+/* The producer's event count is visible to every consumer as it is */
+TEST_F(shm_ring_test, events)
+{
+	EXPECT_EQ(cons.events(), 0u);
+	prod.count_events(3);
+	prod.count_events(2);
+	EXPECT_EQ(cons.events(), 5u);
+}
+
+} /* namespace */
@@ -0,0 +1,34 @@
+#ifndef _APDS9960_TESTS_TMPDIR_H_
+#define _APDS9960_TESTS_TMPDIR_H_
+
+#include <cstdlib>
+#include <filesystem>
+#include <string>
+
+#include <gtest/gtest.h>
+
+/* Fixture owning a scratch directory that is removed after each test */
+class tmpdir_test : public ::testing::Test {
+protected:
+	void SetUp() override
+	{
+		char tmpl[] = "/tmp/apds9960-test-XXXXXX";
+
+		ASSERT_NE(mkdtemp(tmpl), nullptr);
+		dir = tmpl;
+	}
+
+	void TearDown() override
+	{
+		std::filesystem::remove_all(dir);
+	}
+
+	std::string path(const std::string &name) const
+	{
+		return dir + "/" + name;
+	}
+
+	std::string dir;
+};
+
+#endif /* _APDS9960_TESTS_TMPDIR_H_ */
@@ -0,0 +1,90 @@
+#include "uring.h"
+
+#include <cerrno>
+#include <map>
+
+#include "fake_iio.h"
+
+using namespace apds9960;
+
+namespace {
+
+class uring_test : public fake_iio_test {
+protected:
+	void SetUp() override
+	{
+		fake_iio_test::SetUp();
+
+		for (int i = 0; i < 2; i++) {
+			device_config cfg;
+			std::string d = make_device("iio:device" +
+						    std::to_string(i));
+
+			cfg.dev_node = d + "/node";
+			cfg.read_scans = 16;
+			ASSERT_EQ(devs[i].open(cfg, d), 0);
+		}
+	}
+
+	/* Queue n scans with values first.. on fake device i */
+	void feed(int i, int first, int n)
+	{
+		const scan_layout &l = devs[i].layout();
+		std::vector<uint8_t> buf(n * l.scan_bytes());
+
+		for (int k = 0; k < n; k++) {
+			l.encode(&buf[k * l.scan_bytes()], 0, first + k);
+			l.encode(&buf[k * l.scan_bytes()], 1, first + k);
+		}
+		ASSERT_EQ(write(writers[i], buf.data(), buf.size()),
+			  (ssize_t)buf.size());
+	}
+
+	device devs[2];
+	uring_reader r;
+};
+
+TEST_F(uring_test, open_fake_device)
+{
+	EXPECT_EQ(devs[0].layout().num_channels(), 2u);
+	EXPECT_EQ(devs[0].layout().scan_bytes(), 16u);
+	EXPECT_EQ(devs[0].layout().timestamp_channel(), 1);
+}
+
+TEST_F(uring_test, add)
+{
+	device closed;
+
+	EXPECT_EQ(r.add(devs[0]), 0);
+	EXPECT_EQ(r.add(devs[1]), 1);
+	EXPECT_EQ(r.add(closed), -EINVAL);
+}
+
+/* Batches come back tagged with the index add() returned, in order */
+TEST_F(uring_test, reads_every_device)
+{
+	std::map<std::size_t, std::vector<int64_t>> got;
+
+	ASSERT_EQ(r.add(devs[0]), 0);
+	ASSERT_EQ(r.add(devs[1]), 1);
+	ASSERT_EQ(r.start([&got](std::size_t dev, const batch &b) {
+		for (sample s : b)
+			got[dev].push_back(s.value(0));
+	}), 0);
+
+	feed(0, 100, 3);
+	feed(1, 200, 2);
+	while (got[0].size() < 3 || got[1].size() < 2)
+		ASSERT_GT(r.run_once(1), 0);
+
+	feed(0, 103, 1);
+	while (got[0].size() < 4)
+		ASSERT_GT(r.run_once(1), 0);
+
+	EXPECT_EQ(got[0], (std::vector<int64_t>{ 100, 101, 102, 103 }));
+	EXPECT_EQ(got[1], (std::vector<int64_t>{ 200, 201 }));
+
+	r.stop();
+}
+
+} /* namespace */